@@ -0,0 +1,494 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * bench_codecs.c
+ *
+ * Microbenchmarks for the Minecraft protocol codecs in minecraft_funcs.c,
+ * built against the ngx_core shim in bench/shim so they run without an
+ * nginx tree. Every case reports the time per operation and the number of
+ * malloc() calls per operation (counted with the linker's --wrap).
+ *
+ * usage: bench_codecs [-t msec] [filter]
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "minecraft_funcs.h"
+
+#define BENCH_VARINTS     1024
+#define BENCH_BUF_SIZE    4096
+
+typedef struct {
+    u_char       data[BENCH_BUF_SIZE];
+    size_t       len;
+} bench_buf_t;
+
+typedef struct {
+    const char   *name;
+    /* runs at least n operations, returns how many it ran */
+    ngx_uint_t  (*run)(void *arg, ngx_uint_t n);
+    void         *arg;
+} bench_case_t;
+
+static ngx_uint_t  bench_allocs;
+static volatile ngx_uint_t  bench_sink;
+
+/* corpora */
+static u_char       varints[BENCH_VARINTS * MC_VARINT_MAX_SIZE];
+static size_t       varints_len;
+static int32_t      values[BENCH_VARINTS];
+
+static bench_buf_t  hs_short;
+static bench_buf_t  hs_long;
+static bench_buf_t  hs_fml;
+static bench_buf_t  hs_fml2;
+static bench_buf_t  seg_status;
+static bench_buf_t  seg_login;
+static bench_buf_t  seg_login_1_19;
+
+static ngx_str_t    text_short = ngx_string("{\"text\":\"Server is restarting\"}");
+static u_char       text_long[2048];
+
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    bench_allocs++;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+    bench_allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+
+static void
+bench_handshake(bench_buf_t *b, int32_t protocol, const char *host,
+    size_t host_len, int32_t nextState)
+{
+    size_t  len;
+
+    len = get_handshake_packet_size(protocol, host_len, nextState);
+    create_handshake_packet(b->data + b->len, protocol, (const u_char *) host,
+                            host_len, 25565, nextState);
+    b->len += len;
+}
+
+static void
+bench_append(bench_buf_t *b, const u_char *data, size_t len)
+{
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void
+bench_login_start(bench_buf_t *b, int32_t protocol, const char *name)
+{
+    size_t   name_len = strlen(name);
+    u_char   body[128], *p;
+
+    p = body;
+    *p++ = 0x00;
+    writeVarInt(p, name_len);
+    p += get_VarInt_size(name_len);
+    p = ngx_cpymem(p, name, name_len);
+
+    if (protocol == MC_PROTOCOL_1_19) {
+        /* no signature data */
+        *p++ = 0x00;
+
+    } else if (protocol >= MC_PROTOCOL_1_20_2) {
+        memset(p, 0x5a, MC_UUID_SIZE);
+        p += MC_UUID_SIZE;
+    }
+
+    writeVarInt(b->data + b->len, p - body);
+    b->len += get_VarInt_size(p - body);
+    bench_append(b, body, p - body);
+}
+
+static void
+bench_init_corpora(void)
+{
+    static const u_char  status_request[] = { 0x01, 0x00 };
+    static const u_char  ping_request[] = {
+        0x09, 0x01, 0x00, 0x00, 0x01, 0x8f, 0x2a, 0x61, 0x3c, 0x10
+    };
+
+    char        host[256];
+    size_t      i;
+    uint32_t    seed;
+
+    /* a spread of 1 to 5 byte VarInts, weighted towards short ones */
+
+    seed = 12345;
+
+    for (i = 0; i < BENCH_VARINTS; i++) {
+        seed = seed * 1103515245 + 12345;
+
+        switch (i % 8) {
+        case 0:
+            values[i] = -(int32_t) (seed >> 8);
+            break;
+        case 1:
+        case 2:
+            values[i] = (seed >> 8) & 0x1fffff;
+            break;
+        case 3:
+            values[i] = (seed >> 8) & 0x3fff;
+            break;
+        default:
+            values[i] = (seed >> 8) & 0x7f;
+        }
+
+        writeVarInt(varints + varints_len, values[i]);
+        varints_len += get_VarInt_size(values[i]);
+    }
+
+    bench_handshake(&hs_short, 767, "mc.io", 5, 2);
+
+    /* the longest name parse_handshake() accepts */
+    memset(host, 'a', 253);
+    for (i = 63; i < 253; i += 64) {
+        host[i] = '.';
+    }
+    bench_handshake(&hs_long, 767, host, 253, 2);
+
+    bench_handshake(&hs_fml, 340, "play.example.com\0FML\0", 21, 2);
+    bench_handshake(&hs_fml2, 767, "play.example.com\0FML2\0", 22, 2);
+
+    /* what a client sends before the proxy gets to read anything */
+
+    bench_handshake(&seg_status, 767, "play.example.com", 16, 1);
+    bench_append(&seg_status, status_request, sizeof(status_request));
+    bench_append(&seg_status, ping_request, sizeof(ping_request));
+
+    bench_handshake(&seg_login, 767, "play.example.com", 16, 2);
+    bench_login_start(&seg_login, 767, "Notch");
+
+    bench_handshake(&seg_login_1_19, MC_PROTOCOL_1_19, "play.example.com", 16, 2);
+    bench_login_start(&seg_login_1_19, MC_PROTOCOL_1_19, "Notch");
+
+    memset(text_long, 'x', sizeof(text_long));
+    memcpy(text_long, "{\"text\":\"", 9);
+    memcpy(text_long + sizeof(text_long) - 2, "\"}", 2);
+}
+
+
+static ngx_uint_t
+bench_read_varint(void *arg, ngx_uint_t n)
+{
+    size_t      off;
+    VarInt      v;
+    ngx_uint_t  i, sum;
+
+    sum = 0;
+
+    for (i = 0; i < n; i += BENCH_VARINTS) {
+        for (off = 0; off < varints_len; off += v.length) {
+            v = readVarInt(varints + off, varints_len - off);
+            sum += v.value;
+        }
+    }
+
+    bench_sink = sum;
+
+    return i;
+}
+
+static ngx_uint_t
+bench_write_varint(void *arg, ngx_uint_t n)
+{
+    size_t      off;
+    ngx_uint_t  i, j;
+    u_char      buf[BENCH_VARINTS * MC_VARINT_MAX_SIZE];
+
+    off = 0;
+
+    for (i = 0; i < n; i += BENCH_VARINTS) {
+        off = 0;
+
+        for (j = 0; j < BENCH_VARINTS; j++) {
+            writeVarInt(buf + off, values[j]);
+            off += get_VarInt_size(values[j]);
+        }
+    }
+
+    bench_sink = off + buf[off / 2];
+
+    return i;
+}
+
+/* what ngx_stream_nginxcraft_parse() does with the first packet */
+static ngx_uint_t
+bench_parse_handshake(void *arg, ngx_uint_t n)
+{
+    bench_buf_t          *b = arg;
+    ngx_uint_t            i, sum;
+    minecraft_packet      packet;
+    minecraft_handshake   handshake;
+
+    sum = 0;
+
+    for (i = 0; i < n; i++) {
+        if (parse_packet(b->data, b->len, &packet) != NGX_OK
+            || parse_handshake(&packet, &handshake) != NGX_OK)
+        {
+            abort();
+        }
+
+        sum += mc_host_length(handshake.serv_Address.data,
+                              handshake.serv_Address.data_length);
+    }
+
+    bench_sink = sum;
+
+    return n;
+}
+
+/* walk every packet of a segment as the preread and login handlers do */
+static ngx_uint_t
+bench_parse_segment(void *arg, ngx_uint_t n)
+{
+    bench_buf_t             *b = arg;
+    size_t                   off;
+    ngx_uint_t               i, sum;
+    minecraft_packet         packet;
+    minecraft_handshake      handshake;
+    minecraft_login_start    login;
+
+    sum = 0;
+
+    for (i = 0; i < n; i++) {
+        if (parse_packet(b->data, b->len, &packet) != NGX_OK
+            || parse_handshake(&packet, &handshake) != NGX_OK)
+        {
+            abort();
+        }
+
+        off = packet.data + packet.data_length - b->data;
+
+        while (off < b->len) {
+            if (parse_packet(b->data + off, b->len - off, &packet) != NGX_OK) {
+                abort();
+            }
+
+            if (handshake.nextState == 2
+                && parse_login_start(&packet, handshake.protocolVersion,
+                                     &login) == NGX_OK)
+            {
+                sum += login.name.data_length;
+            }
+
+            off = packet.data + packet.data_length - b->data;
+        }
+
+        sum += off;
+    }
+
+    bench_sink = sum;
+
+    return n;
+}
+
+/* the same segments with parse_frames(), as the preread handler does */
+static ngx_uint_t
+bench_parse_frames(void *arg, ngx_uint_t n)
+{
+    bench_buf_t             *b = arg;
+    ngx_uint_t               i, f, sum;
+    minecraft_frames         frames;
+    minecraft_handshake      handshake;
+    minecraft_login_start    login;
+
+    sum = 0;
+
+    for (i = 0; i < n; i++) {
+        if (parse_frames(b->data, b->len, &frames) != NGX_OK
+            || parse_handshake(&frames.packet[0], &handshake) != NGX_OK)
+        {
+            abort();
+        }
+
+        for (f = 1; f < frames.count; f++) {
+            if (handshake.nextState == 2
+                && parse_login_start(&frames.packet[f],
+                                     handshake.protocolVersion, &login)
+                   == NGX_OK)
+            {
+                sum += login.name.data_length;
+            }
+        }
+
+        sum += frames.length;
+    }
+
+    bench_sink = sum;
+
+    return n;
+}
+
+/* every prefix of a handshake, as it trickles in a byte at a time */
+static ngx_uint_t
+bench_parse_partial(void *arg, ngx_uint_t n)
+{
+    bench_buf_t       *b = arg;
+    size_t             len;
+    ngx_uint_t         i, sum;
+    minecraft_packet   packet;
+
+    sum = 0;
+
+    for (i = 0; i < n; i += b->len) {
+        for (len = 1; len <= b->len; len++) {
+            sum += parse_packet(b->data, len, &packet);
+        }
+    }
+
+    bench_sink = sum;
+
+    return i;
+}
+
+static ngx_uint_t
+bench_disconnect(void *arg, ngx_uint_t n)
+{
+    ngx_str_t   *text = arg;
+    size_t       len;
+    ngx_uint_t   i;
+    u_char       buf[sizeof(text_long) + 16];
+
+    len = 0;
+
+    for (i = 0; i < n; i++) {
+        len = get_disconnect_packet_size(text->len);
+        create_disconnect_packet(buf, text->data, text->len);
+    }
+
+    bench_sink = len + buf[len - 1];
+
+    return n;
+}
+
+
+static double
+bench_now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+bench_case(bench_case_t *bc, double budget)
+{
+    double      start, elapsed;
+    ngx_uint_t  n, ops, allocs;
+
+    /* warm up, then grow the count until a run fills the budget */
+
+    bc->run(bc->arg, 1000);
+
+    n = 1000;
+
+    for ( ;; ) {
+        allocs = bench_allocs;
+        start = bench_now();
+        ops = bc->run(bc->arg, n);
+        elapsed = bench_now() - start;
+        allocs = bench_allocs - allocs;
+
+        if (elapsed >= budget || n >= (ngx_uint_t) 1 << 40) {
+            break;
+        }
+
+        if (elapsed < budget / 100) {
+            n *= 10;
+
+        } else {
+            n = n * (budget * 1.2 / elapsed);
+        }
+    }
+
+    printf("%-28s %12lu %10.2f %10.3f\n", bc->name, (unsigned long) ops,
+           elapsed / ops, (double) allocs / ops);
+}
+
+int
+main(int argc, char **argv)
+{
+    double       budget;
+    ngx_uint_t   i;
+    const char  *filter;
+    ngx_str_t    long_text = { sizeof(text_long), text_long };
+
+    bench_case_t  cases[] = {
+        { "readVarInt",              bench_read_varint, NULL },
+        { "writeVarInt",             bench_write_varint, NULL },
+        { "handshake/short",         bench_parse_handshake, &hs_short },
+        { "handshake/long",          bench_parse_handshake, &hs_long },
+        { "handshake/fml",           bench_parse_handshake, &hs_fml },
+        { "handshake/fml2",          bench_parse_handshake, &hs_fml2 },
+        { "handshake/partial",       bench_parse_partial, &hs_long },
+        { "segment/status",          bench_parse_segment, &seg_status },
+        { "segment/login",           bench_parse_segment, &seg_login },
+        { "segment/login-1.19",      bench_parse_segment, &seg_login_1_19 },
+        { "frames/status",           bench_parse_frames, &seg_status },
+        { "frames/login",            bench_parse_frames, &seg_login },
+        { "frames/login-1.19",       bench_parse_frames, &seg_login_1_19 },
+        { "disconnect/short",        bench_disconnect, &text_short },
+        { "disconnect/long",         bench_disconnect, &long_text },
+    };
+
+    budget = 200;
+    filter = NULL;
+
+    for (i = 1; i < (ngx_uint_t) argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < (ngx_uint_t) argc) {
+            budget = atof(argv[++i]);
+            continue;
+        }
+
+        filter = argv[i];
+    }
+
+    if (budget <= 0) {
+        fprintf(stderr, "usage: %s [-t msec] [filter]\n", argv[0]);
+        return 1;
+    }
+
+    bench_init_corpora();
+
+    printf("%-28s %12s %10s %10s\n", "case", "ops", "ns/op", "allocs/op");
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (filter && strstr(cases[i].name, filter) == NULL) {
+            continue;
+        }
+
+        bench_case(&cases[i], budget * 1e6);
+    }
+
+    return 0;
+}
@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_config.h
+ *
+ * Just enough of nginx's ngx_config.h to build minecraft_funcs.c outside of
+ * an nginx tree. Only used by the benchmarks.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef _NGX_CONFIG_H_INCLUDED_
+#define _NGX_CONFIG_H_INCLUDED_
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+typedef intptr_t        ngx_int_t;
+typedef uintptr_t       ngx_uint_t;
+typedef intptr_t        ngx_flag_t;
+
+#define NGX_INT32_LEN   (sizeof("-2147483648") - 1)
+
+#define ngx_inline      inline
+
+#endif /* _NGX_CONFIG_H_INCLUDED_ */
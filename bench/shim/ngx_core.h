@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_core.h
+ *
+ * Just enough of nginx's ngx_core.h to build minecraft_funcs.c outside of
+ * an nginx tree.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef _NGX_CORE_H_INCLUDED_
+#define _NGX_CORE_H_INCLUDED_
+
+#include <ngx_config.h>
+
+#define  NGX_OK          0
+#define  NGX_ERROR      -1
+#define  NGX_AGAIN      -2
+#define  NGX_BUSY       -3
+#define  NGX_DONE       -4
+#define  NGX_DECLINED   -5
+#define  NGX_ABORT      -6
+
+typedef struct {
+    size_t      len;
+    u_char     *data;
+} ngx_str_t;
+
+#define ngx_string(str)     { sizeof(str) - 1, (u_char *) str }
+
+#define ngx_strncmp(s1, s2, n)  strncmp((const char *) s1, (const char *) s2, n)
+#define ngx_strlen(s)       strlen((const char *) s)
+#define ngx_memcpy(dst, src, n)   (void) memcpy(dst, src, n)
+#define ngx_cpymem(dst, src, n)   (((u_char *) memcpy(dst, src, n)) + (n))
+#define ngx_memzero(buf, n)       (void) memset(buf, 0, n)
+
+#define ngx_min(val1, val2)  ((val1 > val2) ? (val2) : (val1))
+#define ngx_max(val1, val2)  ((val1 < val2) ? (val2) : (val1))
+
+/* pools are plain malloc() here, the benchmarks count malloc() calls */
+#define ngx_alloc(size, log)     malloc(size)
+#define ngx_palloc(pool, size)   malloc(size)
+#define ngx_pnalloc(pool, size)  malloc(size)
+
+#endif /* _NGX_CORE_H_INCLUDED_ */
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * mc_backend.c
+ *
+ * A fake Minecraft server for load testing. It answers the handshake,
+ * Status Request, Ping Request and Login Start (with a disconnect) and
+ * nothing else. The time the first byte of a connection arrived is sent
+ * back as "t=<ns>" in the status description and the disconnect reason so
+ * that mc_load can measure accept to first upstream byte.
+ *
+ * With -s connections are accepted and read but never answered, like a
+ * server stuck in garbage collection, to try nginxcraft_check against.
+ *
+ * usage: mc_backend [-l addr] [-p port] [-s]
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "minecraft_funcs.h"
+
+#define MC_BACKEND_BUF_SIZE   4096
+#define MC_BACKEND_EVENTS     512
+
+typedef struct {
+    int            fd;
+    int32_t        nextState;
+    uint64_t       first;
+    size_t         len;
+    u_char         buf[MC_BACKEND_BUF_SIZE];
+} mc_conn_t;
+
+static int  mc_stall;
+
+static uint64_t
+mc_now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+mc_close(int ep, mc_conn_t *c)
+{
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c);
+}
+
+/* Status Response and Disconnect are both a packet 0 with one string */
+static int
+mc_send_string(mc_conn_t *c, const char *text, size_t len)
+{
+    u_char  out[MC_BACKEND_BUF_SIZE];
+
+    create_disconnect_packet(out, (const u_char *) text, len);
+
+    len = get_disconnect_packet_size(len);
+
+    return write(c->fd, out, len) == (ssize_t) len ? 0 : -1;
+}
+
+/* returns -1 when the connection is to be closed */
+static int
+mc_process(mc_conn_t *c)
+{
+    int                   n;
+    char                  text[256];
+    size_t                off, start;
+    ngx_int_t             rc;
+    minecraft_packet      packet;
+    minecraft_handshake   handshake;
+
+    off = 0;
+
+    while (off < c->len) {
+        start = off;
+        rc = parse_packet(c->buf + start, c->len - start, &packet);
+
+        if (rc == NGX_AGAIN) {
+            break;
+        }
+
+        if (rc != NGX_OK) {
+            return -1;
+        }
+
+        off = packet.data + packet.data_length - c->buf;
+
+        if (c->nextState == 0) {
+            if (parse_handshake(&packet, &handshake) != NGX_OK
+                || (handshake.nextState != 1 && handshake.nextState != 2))
+            {
+                return -1;
+            }
+
+            c->nextState = handshake.nextState;
+            continue;
+        }
+
+        if (c->nextState == 1 && packet.packetId.value == 0) {
+            n = snprintf(text, sizeof(text),
+                         "{\"version\":{\"name\":\"mc_backend\",\"protocol\":767},"
+                         "\"players\":{\"max\":100000,\"online\":0},"
+                         "\"description\":{\"text\":\"t=%llu\"}}",
+                         (unsigned long long) c->first);
+
+            if (mc_send_string(c, text, n) != 0) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (c->nextState == 1 && packet.packetId.value == 1) {
+            /* the pong is the ping echoed back */
+            (void) write(c->fd, c->buf + start, off - start);
+
+            return -1;
+        }
+
+        if (c->nextState == 2 && packet.packetId.value == 0) {
+            n = snprintf(text, sizeof(text), "{\"text\":\"t=%llu\"}",
+                         (unsigned long long) c->first);
+
+            (void) mc_send_string(c, text, n);
+
+            return -1;
+        }
+
+        return -1;
+    }
+
+    memmove(c->buf, c->buf + off, c->len - off);
+    c->len -= off;
+
+    if (c->len == sizeof(c->buf)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    int                  ep, ls, fd, i, n, one;
+    ssize_t              r;
+    const char          *addr;
+    mc_conn_t           *c;
+    struct sockaddr_in   sin;
+    struct epoll_event   ev, events[MC_BACKEND_EVENTS];
+
+    addr = "127.0.0.1";
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(25566);
+
+    while ((i = getopt(argc, argv, "l:p:s")) != -1) {
+        switch (i) {
+        case 'l':
+            addr = optarg;
+            break;
+        case 'p':
+            sin.sin_port = htons(atoi(optarg));
+            break;
+        case 's':
+            mc_stall = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-l addr] [-p port] [-s]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+        fprintf(stderr, "invalid address \"%s\"\n", addr);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    ls = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    one = 1;
+    setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(ls, (struct sockaddr *) &sin, sizeof(sin)) != 0
+        || listen(ls, 4096) != 0)
+    {
+        perror("listen");
+        return 1;
+    }
+
+    ep = epoll_create1(0);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(ep, EPOLL_CTL_ADD, ls, &ev);
+
+    for ( ;; ) {
+        n = epoll_wait(ep, events, MC_BACKEND_EVENTS, -1);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("epoll_wait");
+            return 1;
+        }
+
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+
+            if (c == NULL) {
+                while ((fd = accept4(ls, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+                    c = calloc(1, sizeof(mc_conn_t));
+
+                    if (c == NULL) {
+                        close(fd);
+                        continue;
+                    }
+
+                    c->fd = fd;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+                }
+
+                continue;
+            }
+
+            r = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+
+            if (r == -1 && errno == EAGAIN) {
+                continue;
+            }
+
+            if (r <= 0) {
+                mc_close(ep, c);
+                continue;
+            }
+
+            if (c->first == 0) {
+                c->first = mc_now();
+            }
+
+            if (mc_stall) {
+                continue;
+            }
+
+            c->len += r;
+
+            if (mc_process(c) != 0) {
+                mc_close(ep, c);
+            }
+        }
+    }
+}
@@ -0,0 +1,545 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * mc_load.c
+ *
+ * Connection-rate load generator for nginx with this module in front of
+ * mc_backend. Keeps a fixed number of connections open, each sending one
+ * of a mix of handshakes:
+ *
+ *   status   handshake, Status Request and Ping Request in one segment
+ *   login    handshake and Login Start in one segment
+ *   split    login, with the handshake split over three segments
+ *   invalid  bytes that are not a Minecraft handshake
+ *
+ * Latency is measured from the connection being established to the first
+ * byte reaching mc_backend, which echoes its timestamp. Connections answered
+ * by nginx itself (nginxcraft_return, invalid traffic) are reported
+ * separately, up to the first byte or the close.
+ *
+ * usage: mc_load [-a addr] [-p port] [-c concurrency] [-n connections]
+ *                [-m status:N,login:N,split:N,invalid:N] [-H host-format]
+ *                [-N hostnames] [-P protocol] [-l label]
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "minecraft_funcs.h"
+
+#define MC_LOAD_BUF_SIZE     1024
+#define MC_LOAD_EVENTS       512
+#define MC_LOAD_TIMEOUT      5000000000ULL
+#define MC_LOAD_SPLIT_DELAY  1000000ULL
+
+enum {
+    MC_LOAD_STATUS = 0,
+    MC_LOAD_LOGIN,
+    MC_LOAD_SPLIT,
+    MC_LOAD_INVALID,
+    MC_LOAD_KINDS
+};
+
+static const char  *mc_load_kinds[MC_LOAD_KINDS] = {
+    "status", "login", "split", "invalid"
+};
+
+typedef struct {
+    int             fd;
+    int             kind;
+    /* bytes of out already written */
+    size_t          sent;
+    size_t          out_len;
+    /* when the next part of a split handshake is due, 0 if none */
+    uint64_t        next;
+    uint64_t        start;
+    uint64_t        established;
+    size_t          in_len;
+    u_char          in[MC_LOAD_BUF_SIZE];
+    u_char          out[MC_LOAD_BUF_SIZE];
+} mc_conn_t;
+
+typedef struct {
+    uint64_t       *samples;
+    size_t          n;
+    size_t          size;
+} mc_samples_t;
+
+static struct sockaddr_in   mc_addr;
+static const char          *mc_host_format = "play%u.example.com";
+static unsigned             mc_hosts = 100;
+static int32_t              mc_protocol = 767;
+static unsigned             mc_mix[MC_LOAD_KINDS] = { 60, 30, 5, 5 };
+static unsigned             mc_mix_total = 100;
+
+static size_t               mc_started, mc_done, mc_errors;
+static mc_samples_t         mc_upstream, mc_direct;
+
+static uint64_t
+mc_now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+mc_sample(mc_samples_t *s, uint64_t v)
+{
+    uint64_t  *p;
+
+    if (s->n == s->size) {
+        s->size = s->size ? s->size * 2 : 4096;
+        p = realloc(s->samples, s->size * sizeof(uint64_t));
+
+        if (p == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+
+        s->samples = p;
+    }
+
+    s->samples[s->n++] = v;
+}
+
+static int
+mc_cmp(const void *one, const void *two)
+{
+    uint64_t  a = *(const uint64_t *) one;
+    uint64_t  b = *(const uint64_t *) two;
+
+    return a < b ? -1 : a > b;
+}
+
+static double
+mc_percentile(mc_samples_t *s, double p)
+{
+    if (s->n == 0) {
+        return 0;
+    }
+
+    return s->samples[(size_t) (p * (s->n - 1))] / 1000.0;
+}
+
+static int
+mc_parse_mix(char *arg)
+{
+    int        k;
+    char      *name, *value;
+    unsigned   mix[MC_LOAD_KINDS] = { 0 };
+
+    mc_mix_total = 0;
+
+    for (name = strtok(arg, ","); name; name = strtok(NULL, ",")) {
+        value = strchr(name, ':');
+
+        if (value == NULL) {
+            return -1;
+        }
+
+        *value++ = '\0';
+
+        for (k = 0; k < MC_LOAD_KINDS; k++) {
+            if (strcmp(name, mc_load_kinds[k]) == 0) {
+                break;
+            }
+        }
+
+        if (k == MC_LOAD_KINDS) {
+            return -1;
+        }
+
+        mix[k] = atoi(value);
+        mc_mix_total += mix[k];
+    }
+
+    if (mc_mix_total == 0) {
+        return -1;
+    }
+
+    memcpy(mc_mix, mix, sizeof(mix));
+
+    return 0;
+}
+
+static void
+mc_build(mc_conn_t *c, unsigned seq)
+{
+    static const u_char  status[] = {
+        0x01, 0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x2a
+    };
+    static const char    invalid[] = "GET / HTTP/1.1\r\nHost: play\r\n\r\n";
+    static const char    name[] = "LoadTest";
+
+    int        n;
+    char       host[256];
+    u_char    *p;
+    unsigned   pick;
+
+    pick = seq % mc_mix_total;
+
+    for (c->kind = 0; c->kind < MC_LOAD_KINDS - 1; c->kind++) {
+        if (pick < mc_mix[c->kind]) {
+            break;
+        }
+
+        pick -= mc_mix[c->kind];
+    }
+
+    if (c->kind == MC_LOAD_INVALID) {
+        c->out_len = sizeof(invalid) - 1;
+        memcpy(c->out, invalid, c->out_len);
+        return;
+    }
+
+    n = snprintf(host, sizeof(host), mc_host_format,
+                 (seq * 2654435761u) % mc_hosts);
+
+    p = c->out;
+
+    create_handshake_packet(p, mc_protocol, (u_char *) host, n, 25565,
+                            c->kind == MC_LOAD_STATUS ? 1 : 2);
+    p += get_handshake_packet_size(mc_protocol, n,
+                                   c->kind == MC_LOAD_STATUS ? 1 : 2);
+
+    if (c->kind == MC_LOAD_STATUS) {
+        p = ngx_cpymem(p, status, sizeof(status));
+
+    } else {
+        /* Login Start for 1.20.2 and later: name, UUID */
+        writeVarInt(p, 1 + 1 + sizeof(name) - 1 + MC_UUID_SIZE);
+        p++;
+        *p++ = 0x00;
+        *p++ = sizeof(name) - 1;
+        p = ngx_cpymem(p, name, sizeof(name) - 1);
+        memset(p, 0x11, MC_UUID_SIZE);
+        p += MC_UUID_SIZE;
+    }
+
+    c->out_len = p - c->out;
+}
+
+/* mc_backend answers with "t=<ns>" somewhere in a string */
+static u_char *
+mc_timestamp(mc_conn_t *c)
+{
+    u_char  *t;
+
+    t = memmem(c->in, c->in_len, "t=", 2);
+
+    if (t == NULL || memchr(t, '"', c->in + c->in_len - t) == NULL) {
+        return NULL;
+    }
+
+    return t + 2;
+}
+
+static int
+mc_open(int ep, mc_conn_t *c, unsigned seq)
+{
+    int                  one;
+    struct epoll_event   ev;
+
+    memset(c, 0, offsetof(mc_conn_t, in));
+
+    mc_build(c, seq);
+
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if (c->fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->start = mc_now();
+
+    if (connect(c->fd, (struct sockaddr *) &mc_addr, sizeof(mc_addr)) != 0
+        && errno != EINPROGRESS)
+    {
+        perror("connect");
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+
+    mc_started++;
+
+    return 0;
+}
+
+static void
+mc_finish(int ep, mc_conn_t *c, int ok)
+{
+    u_char     *t;
+    uint64_t    first;
+
+    if (ok && c->established) {
+        t = mc_timestamp(c);
+
+        if (t != NULL) {
+            first = strtoull((char *) t, NULL, 10);
+            mc_sample(&mc_upstream, first > c->established
+                                    ? first - c->established : 0);
+
+        } else {
+            mc_sample(&mc_direct, mc_now() - c->established);
+        }
+
+    } else if (!ok) {
+        mc_errors++;
+    }
+
+    mc_done++;
+
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* how much of the request to write now: splits go in three parts */
+static size_t
+mc_chunk(mc_conn_t *c)
+{
+    if (c->kind != MC_LOAD_SPLIT) {
+        return c->out_len - c->sent;
+    }
+
+    if (c->sent == 0) {
+        return 1;
+    }
+
+    if (c->sent == 1) {
+        return c->out_len / 2 - 1;
+    }
+
+    return c->out_len - c->sent;
+}
+
+static int
+mc_write(mc_conn_t *c)
+{
+    ssize_t  n;
+
+    n = write(c->fd, c->out + c->sent, mc_chunk(c));
+
+    if (n == -1) {
+        return errno == EAGAIN ? 0 : -1;
+    }
+
+    c->sent += n;
+    c->next = c->sent < c->out_len ? mc_now() + MC_LOAD_SPLIT_DELAY : 0;
+
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    int                  ep, i, n, opt;
+    char                *label;
+    ssize_t              r;
+    uint64_t             now, start, elapsed;
+    unsigned             concurrency, total, seq;
+    mc_conn_t           *conns, *c;
+    socklen_t            len;
+    struct epoll_event   ev, events[MC_LOAD_EVENTS];
+    const char          *addr;
+
+    addr = "127.0.0.1";
+    mc_addr.sin_family = AF_INET;
+    mc_addr.sin_port = htons(25565);
+    concurrency = 256;
+    total = 100000;
+    label = "-";
+
+    while ((opt = getopt(argc, argv, "a:p:c:n:m:H:N:P:l:")) != -1) {
+        switch (opt) {
+        case 'a':
+            addr = optarg;
+            break;
+        case 'p':
+            mc_addr.sin_port = htons(atoi(optarg));
+            break;
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 'n':
+            total = atoi(optarg);
+            break;
+        case 'm':
+            if (mc_parse_mix(optarg) != 0) {
+                fprintf(stderr, "invalid mix\n");
+                return 1;
+            }
+            break;
+        case 'H':
+            mc_host_format = optarg;
+            break;
+        case 'N':
+            mc_hosts = atoi(optarg);
+            break;
+        case 'P':
+            mc_protocol = atoi(optarg);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-a addr] [-p port] [-c concurrency] "
+                    "[-n connections]\n"
+                    "          [-m status:N,login:N,split:N,invalid:N] "
+                    "[-H host-format]\n"
+                    "          [-N hostnames] [-P protocol] [-l label]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (inet_pton(AF_INET, addr, &mc_addr.sin_addr) != 1
+        || concurrency == 0 || total == 0 || mc_hosts == 0)
+    {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    if (concurrency > total) {
+        concurrency = total;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    conns = calloc(concurrency, sizeof(mc_conn_t));
+    ep = epoll_create1(0);
+    seq = 0;
+
+    start = mc_now();
+
+    for (i = 0; i < (int) concurrency; i++) {
+        conns[i].fd = -1;
+
+        if (mc_open(ep, &conns[i], seq++) != 0) {
+            return 1;
+        }
+    }
+
+    while (mc_done < total) {
+        n = epoll_wait(ep, events, MC_LOAD_EVENTS, 1);
+        now = mc_now();
+
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+
+            if (c->fd == -1) {
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR|EPOLLHUP)
+                && c->established == 0)
+            {
+                mc_finish(ep, c, 0);
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) && c->established == 0) {
+                len = sizeof(opt);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &opt, &len);
+
+                if (opt != 0) {
+                    mc_finish(ep, c, 0);
+                    continue;
+                }
+
+                c->established = now;
+
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+                epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+
+                if (mc_write(c) != 0) {
+                    mc_finish(ep, c, 0);
+                    continue;
+                }
+            }
+
+            if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) {
+                r = read(c->fd, c->in + c->in_len,
+                         MC_LOAD_BUF_SIZE - 1 - c->in_len);
+
+                if (r == -1 && errno == EAGAIN) {
+                    continue;
+                }
+
+                if (r > 0) {
+                    c->in_len += r;
+
+                    /* a full answer from mc_backend, or a pong */
+                    if (mc_timestamp(c) == NULL
+                        && c->in_len < MC_LOAD_BUF_SIZE - 1)
+                    {
+                        continue;
+                    }
+                }
+
+                /* invalid traffic is expected to be dropped */
+                mc_finish(ep, c, r >= 0 || c->kind == MC_LOAD_INVALID);
+            }
+        }
+
+        /* send the rest of split handshakes, reap stuck connections */
+
+        for (i = 0; i < (int) concurrency; i++) {
+            c = &conns[i];
+
+            if (c->fd != -1 && c->next && now >= c->next
+                && mc_write(c) != 0)
+            {
+                mc_finish(ep, c, 0);
+            }
+
+            if (c->fd != -1 && now - c->start > MC_LOAD_TIMEOUT) {
+                mc_finish(ep, c, 0);
+            }
+
+            if (c->fd == -1 && seq < total) {
+                if (mc_open(ep, c, seq++) != 0) {
+                    return 1;
+                }
+            }
+        }
+    }
+
+    elapsed = mc_now() - start;
+
+    qsort(mc_upstream.samples, mc_upstream.n, sizeof(uint64_t), mc_cmp);
+    qsort(mc_direct.samples, mc_direct.n, sizeof(uint64_t), mc_cmp);
+
+    printf("%-8s %8zu %7zu %10.0f %9.1f %9.1f %9.1f %9.1f\n", label, mc_done,
+           mc_errors, mc_done / (elapsed / 1e9),
+           mc_percentile(&mc_upstream, 0.5), mc_percentile(&mc_upstream, 0.99),
+           mc_percentile(&mc_direct, 0.5), mc_percentile(&mc_direct, 0.99));
+
+    return 0;
+}
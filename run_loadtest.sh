@@ -0,0 +1,76 @@
+#!/bin/bash
+# Load test a locally built nginx (see build.sh) in front of loadtest/mc_backend
+# with loadtest/mc_load, once per worker count.
+#
+# Environment: NGINX, WORKERS ("1 2 4"), CONNS, CONCURRENCY, MIX, HOSTS, PORT
+set -e
+MYDIR=$(dirname $(readlink -f $0))
+NGINX=$(readlink -f ${NGINX:-$MYDIR/../nginx/objs/nginx})
+WORKERS=${WORKERS:-"1 2 4"}
+CONNS=${CONNS:-100000}
+CONCURRENCY=${CONCURRENCY:-1000}
+MIX=${MIX:-status:50,login:35,split:5,invalid:10}
+HOSTS=${HOSTS:-1000}
+PORT=${PORT:-25565}
+BACKEND_PORT=$((PORT + 1))
+
+make -s -C $MYDIR/loadtest
+
+PREFIX=$(mktemp -d)
+mkdir $PREFIX/logs $PREFIX/conf
+
+cleanup() {
+	[ -f $PREFIX/logs/nginx.pid ] && $NGINX -p $PREFIX -c conf/nginx.conf -s stop 2>/dev/null
+	[ -n "$BACKEND" ] && kill $BACKEND 2>/dev/null
+	sleep 0.5
+	rm -rf $PREFIX
+}
+trap cleanup EXIT
+
+ulimit -n 200000 2>/dev/null || ulimit -n $(ulimit -Hn)
+
+# a tenth of the client hostnames are not in the map and get nginxcraft_return
+for ((i = 0; i < HOSTS; i++)); do
+	echo "play$i.example.com 127.0.0.1:$BACKEND_PORT;"
+done > $PREFIX/conf/hosts.map
+
+$MYDIR/loadtest/mc_backend -p $BACKEND_PORT &
+BACKEND=$!
+
+printf "%-8s %8s %7s %10s %9s %9s %9s %9s\n" workers conns errors conn/s \
+	up_p50us up_p99us ret_p50us ret_p99us
+
+for W in $WORKERS; do
+	cat > $PREFIX/conf/nginx.conf <<CONF
+worker_processes	$W;
+worker_rlimit_nofile	200000;
+error_log	logs/error.log	warn;
+pid		logs/nginx.pid;
+
+events {
+	worker_connections	65535;
+}
+
+stream {
+	server {
+		listen			unix:$PREFIX/return.sock;
+		nginxcraft_return	"{\"text\":\"Unknown server\"}";
+	}
+
+	server {
+		listen			127.0.0.1:$PORT reuseport;
+		nginxcraft		on;
+		nginxcraft_map		conf/hosts.map default=unix:$PREFIX/return.sock;
+		proxy_pass		\$minecraft_upstream;
+	}
+}
+CONF
+	$NGINX -p $PREFIX -c conf/nginx.conf
+	sleep 0.5
+
+	$MYDIR/loadtest/mc_load -p $PORT -n $CONNS -c $CONCURRENCY -m $MIX \
+		-N $((HOSTS * 11 / 10)) -l $W
+
+	$NGINX -p $PREFIX -c conf/nginx.conf -s stop
+	while [ -f $PREFIX/logs/nginx.pid ]; do sleep 0.1; done
+done
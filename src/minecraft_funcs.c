@@ -30,36 +30,64 @@ mc_str2ngx_str(ngx_str_t* ret, size_t sz, const mc_string mc_str)
     return NGX_OK;
 }
 
-VarInt
-readVarInt(const u_char* buffer, size_t length)
+/*
+ * Returns the size of the VarInt at buffer and stores its value, or 0 if
+ * the buffer ends before it does or it is longer than MC_VARINT_MAX_SIZE.
+ *
+ * Packet lengths up to 2 MiB, packet ids and protocol versions all fit in
+ * 3 bytes, those are decoded from one word without a branch per byte.
+ * The parsers below use this instead of readVarInt() so that nothing goes
+ * through a VarInt in memory.
+ */
+static ngx_inline size_t
+mc_varint(const u_char* buffer, size_t length, int32_t* value)
 {
-    VarInt   ret = {0, 0, true};
-    size_t   ind = 0;
+    size_t     ind;
+    uint32_t   word, stop, val;
 
-    while (true) {
-        if (ind >= length) {
-            ret.valid = false;
-            ret.value = -1;
-            // Not enough data
-            return ret;
-        }
+    if (length >= 3) {
+        word = buffer[0] | (buffer[1] << 8) | ((uint32_t)buffer[2] << 16);
+        stop = ~word & 0x808080;
 
-        ret.value |= (buffer[ind] & SEGMENT_BITS) << (ind*7);
+        if (stop != 0) {
+            // Bytes up to and including the first one without CONTINUE_BIT
+            ind = 1 + ((stop & 0x80) == 0) + ((stop & 0x8080) == 0);
 
-        if ((buffer[ind] & CONTINUE_BIT) == 0)
-            break;
+            word = (word & 0x7f) | ((word >> 1) & 0x3f80)
+                   | ((word >> 2) & 0x1fc000);
+            *value = word & ((1u << (7 * ind)) - 1);
 
-        ind++;
+            return ind;
+        }
+    }
+
+    val = 0;
 
-        if ((ind*7) >= 32) {
-            ret.valid = false;
-            ret.value = -1;
-            // Value is too large to be a varint
-            return ret;
+    for (ind = 0; ind < length && ind < MC_VARINT_MAX_SIZE; ind++) {
+        val |= (uint32_t)(buffer[ind] & SEGMENT_BITS) << (ind*7);
+
+        if ((buffer[ind] & CONTINUE_BIT) == 0) {
+            *value = val;
+            return ind + 1;
         }
     }
 
-    ret.length = ind + 1;
+    // Not enough data, or the value is too large to be a varint
+    return 0;
+}
+
+VarInt
+readVarInt(const u_char* buffer, size_t length)
+{
+    VarInt    ret;
+    size_t    sz;
+    int32_t   value;
+
+    sz = mc_varint(buffer, length, &value);
+
+    ret.value = sz ? value : -1;
+    ret.length = sz;
+    ret.valid = (sz != 0);
 
     return ret;
 }
@@ -67,19 +95,11 @@ readVarInt(const u_char* buffer, size_t length)
 size_t
 get_VarInt_size(int32_t value)
 {
-    size_t   ind = 0;
-
-    //TODO: there must be a better way to do this
-    if (value == 0) {
-        return 1;
-    }
-
-    while (true) {
-        if ((value & ~CONTINUE_BIT) == 0) {
-            return ind;
-        }
+    uint32_t   val = value;
+    size_t     ind = 1;
 
-        value >>= 7;
+    while ((val & ~SEGMENT_BITS) != 0) {
+        val >>= 7;
         ind++;
     }
 
@@ -89,34 +109,34 @@ get_VarInt_size(int32_t value)
 void
 writeVarInt(u_char* buffer, int32_t value)
 {
-    size_t   ind = 0;
-
-    while (true) {
-        if ((value & ~SEGMENT_BITS) == 0) {
-            buffer[ind] = value;
-            return;
-        }
+    uint32_t   val = value;
+    size_t     ind = 0;
 
-        buffer[ind++] = (value & SEGMENT_BITS) | CONTINUE_BIT;
-        value >>= 7;
+    while ((val & ~SEGMENT_BITS) != 0) {
+        buffer[ind++] = (val & SEGMENT_BITS) | CONTINUE_BIT;
+        val >>= 7;
     }
 
-    return;
+    buffer[ind] = val;
 }
 
 mc_string
 read_mc_string(const u_char* buffer, size_t length)
 {
-    mc_string    ret = {NULL, 0, true};
-    VarInt       stringLength = readVarInt(buffer, length);
+    mc_string    ret = {NULL, 0, false};
+    size_t       sz;
+    int32_t      stringLength;
+
+    sz = mc_varint(buffer, length, &stringLength);
 
-    if (!stringLength.valid) {
-        ret.valid = false;
+    // String must fit in what is left of the buffer
+    if (sz == 0 || stringLength < 0 || (size_t)stringLength > length - sz) {
         return ret;
     }
 
-    ret.data = buffer + stringLength.length;
-    ret.data_length = stringLength.value;
+    ret.data = buffer + sz;
+    ret.data_length = stringLength;
+    ret.valid = true;
 
     return ret;
 }
@@ -124,33 +144,137 @@ read_mc_string(const u_char* buffer, size_t length)
 ngx_int_t
 parse_packet(const u_char* buffer, size_t length, minecraft_packet* packet)
 {
-    size_t   Length_ID_sz = 0;
-    size_t   Packet_ID_sz = 0;
+    size_t    sz;
+    int32_t   frameLength;
 
-    packet->length = readVarInt(buffer, length);
-    Length_ID_sz = packet->length.length;
+    packet->valid = false;
+
+    sz = mc_varint(buffer, length, &frameLength);
+
+    packet->length.valid = (sz != 0);
+    packet->length.length = sz;
+    packet->length.value = sz ? frameLength : -1;
+
+    if (sz == 0) {
+        // A VarInt shorter than its maximum size may still be incomplete
+        return (length < MC_VARINT_MAX_SIZE) ? NGX_AGAIN : NGX_ERROR;
+    }
 
-    if (!packet->length.valid) {
-        packet->valid = false;
+    if (frameLength <= 0) {
         return NGX_ERROR;
     }
 
-    buffer += Length_ID_sz;
-    length -= Length_ID_sz;
-    packet->packetId = readVarInt(buffer, length);
-    Packet_ID_sz = packet->packetId.length;
+    if (length - sz < (size_t)frameLength) {
+        return NGX_AGAIN;
+    }
+
+    return parse_packet_frame(buffer + sz, packet->length, packet);
+}
+
+/*
+ * Decodes a frame whose length prefix has already been read,
+ * frame points just past the length VarInt.
+ */
+ngx_int_t
+parse_packet_frame(const u_char* frame, VarInt length, minecraft_packet* packet)
+{
+    size_t    sz;
+    int32_t   packetId;
 
-    if (!packet->packetId.valid) {
-        packet->valid = false;
+    packet->valid = false;
+    packet->length = length;
+
+    sz = mc_varint(frame, length.value, &packetId);
+
+    packet->packetId.valid = (sz != 0);
+    packet->packetId.length = sz;
+    packet->packetId.value = sz ? packetId : -1;
+
+    if (sz == 0) {
         return NGX_ERROR;
     }
 
-    packet->data = buffer + Packet_ID_sz;
-    packet->data_length = length - Packet_ID_sz;
+    packet->data = frame + sz;
+    packet->data_length = length.value - sz;
+    packet->valid = true;
 
     return NGX_OK;
 }
 
+/*
+ * Finds every complete frame at the start of buffer in one pass, a client
+ * usually sends the handshake with the Status Request and Ping or with
+ * Login Start. Returns NGX_AGAIN if not even the first frame is complete,
+ * with frames->partial holding its length prefix when that could be read.
+ * A malformed frame ends the scan, it is an error only if it is the first.
+ */
+ngx_int_t
+parse_frames(const u_char* buffer, size_t length, minecraft_frames* frames)
+{
+    size_t             left, sz, id_sz;
+    int32_t            frameLength, packetId;
+    minecraft_packet  *packet;
+
+    frames->count = 0;
+    frames->length = 0;
+    frames->partial.valid = false;
+
+    left = length;
+
+    while (frames->count < MC_FRAMES_MAX && left) {
+        sz = mc_varint(buffer, left, &frameLength);
+
+        if (sz == 0) {
+            if (left >= MC_VARINT_MAX_SIZE) {
+                break;
+            }
+
+            return frames->count ? NGX_OK : NGX_AGAIN;
+        }
+
+        if (frameLength <= 0) {
+            break;
+        }
+
+        if (left - sz < (size_t)frameLength) {
+            frames->partial.value = frameLength;
+            frames->partial.length = sz;
+            frames->partial.valid = true;
+            return frames->count ? NGX_OK : NGX_AGAIN;
+        }
+
+        id_sz = mc_varint(buffer + sz, frameLength, &packetId);
+
+        if (id_sz == 0) {
+            break;
+        }
+
+        packet = &frames->packet[frames->count];
+
+        packet->length.value = frameLength;
+        packet->length.length = sz;
+        packet->length.valid = true;
+        packet->packetId.value = packetId;
+        packet->packetId.length = id_sz;
+        packet->packetId.valid = true;
+        packet->data = buffer + sz + id_sz;
+        packet->data_length = frameLength - id_sz;
+        packet->valid = true;
+
+        buffer += sz + frameLength;
+        left -= sz + frameLength;
+
+        frames->count++;
+        frames->length = length - left;
+    }
+
+    if (frames->count) {
+        return NGX_OK;
+    }
+
+    return left ? NGX_ERROR : NGX_AGAIN;
+}
+
 ngx_int_t
 parse_handshake(const minecraft_packet* packet, minecraft_handshake* handshake)
 {
@@ -159,7 +283,7 @@ parse_handshake(const minecraft_packet* packet, minecraft_handshake* handshake)
     size_t           protocolVersion_sz = 0;
     size_t           serv_Address_sz = 0;
     //size_t           nextState_sz = 0;
-    VarInt           protocolVersion, nextState;
+    int32_t          nextState;
 
     handshake->valid = false;
     handshake->serv_Address.valid = false;
@@ -168,25 +292,23 @@ parse_handshake(const minecraft_packet* packet, minecraft_handshake* handshake)
         return NGX_ERROR;
     }
 
-    protocolVersion = readVarInt(data, data_length);
-    protocolVersion_sz = protocolVersion.length;
+    protocolVersion_sz = mc_varint(data, data_length, &handshake->protocolVersion);
 
-    if (!protocolVersion.valid) {
+    if (protocolVersion_sz == 0) {
         return NGX_ERROR;
     }
 
-    handshake->protocolVersion = protocolVersion.value;
-
     data += protocolVersion_sz;
     data_length -= protocolVersion_sz;
     handshake->serv_Address = read_mc_string(data, data_length);
-    serv_Address_sz = handshake->serv_Address.data - data;
-    serv_Address_sz += handshake->serv_Address.data_length;
 
     if (!handshake->serv_Address.valid) {
         return NGX_ERROR;
     }
 
+    serv_Address_sz = handshake->serv_Address.data - data;
+    serv_Address_sz += handshake->serv_Address.data_length;
+
     if (serv_Address_sz > 255) {
         return NGX_ERROR;
     }
@@ -201,10 +323,7 @@ parse_handshake(const minecraft_packet* packet, minecraft_handshake* handshake)
     handshake->serv_Port = be16toh(*(uint16_t*)data);
     data += 2;
     data_length -= 2;
-    nextState = readVarInt(data, data_length);
-    //nextState_sz = nextState.length;
-
-    if (!nextState.valid) {
+    if (mc_varint(data, data_length, &nextState) == 0) {
         return NGX_ERROR;
     }
 
@@ -215,13 +334,172 @@ parse_handshake(const minecraft_packet* packet, minecraft_handshake* handshake)
     }
     */
 
-    handshake->nextState = nextState.value;
+    handshake->nextState = nextState;
     handshake->serv_Address.valid = true;
     handshake->valid = true;
 
     return NGX_OK;
 }
 
+/*
+ * Tells from the first bytes a client sent whether they can start a
+ * handshake at all: the frame must fit one, the packet id must be 0 and
+ * the protocol version one a client sends, -1 from pingers, a release or
+ * a snapshot. Returns NGX_AGAIN until enough bytes are there to tell.
+ */
+ngx_int_t
+mc_handshake_plausible(const u_char* buffer, size_t length)
+{
+    size_t     sz, protocol_sz;
+    int32_t    frame, protocol;
+
+    sz = mc_varint(buffer, length, &frame);
+
+    if (sz == 0) {
+        return length < 3 ? NGX_AGAIN : NGX_DECLINED;
+    }
+
+    if (frame < MC_HANDSHAKE_MIN_SIZE || frame > MC_HANDSHAKE_MAX_SIZE) {
+        return NGX_DECLINED;
+    }
+
+    if (length == sz) {
+        return NGX_AGAIN;
+    }
+
+    if (buffer[sz] != 0x00) {
+        return NGX_DECLINED;
+    }
+
+    buffer += sz + 1;
+    length -= sz + 1;
+
+    protocol_sz = mc_varint(buffer, length, &protocol);
+
+    if (protocol_sz == 0) {
+        return length < MC_VARINT_MAX_SIZE ? NGX_AGAIN : NGX_DECLINED;
+    }
+
+    if (protocol == -1
+        || (protocol >= 0 && protocol < MC_PROTOCOL_RELEASE_MAX)
+        || (protocol >= MC_PROTOCOL_SNAPSHOT
+            && protocol < MC_PROTOCOL_SNAPSHOT + MC_PROTOCOL_RELEASE_MAX))
+    {
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+/*
+ * Login Start changed with almost every release since 1.19:
+ *   < 759      name
+ *   759        name, optional signature data
+ *   760        name, optional signature data, optional UUID
+ *   761 - 763  name, optional UUID
+ *   >= 764     name, UUID
+ */
+ngx_int_t
+parse_login_start(const minecraft_packet* packet, int32_t protocolVersion,
+    minecraft_login_start* login)
+{
+    const u_char    *data = packet->data;
+    size_t           data_length = packet->data_length;
+    size_t           field_sz = 0;
+    VarInt           arrayLength;
+    int              i;
+
+    login->valid = false;
+    login->uuid = NULL;
+
+    if (packet->packetId.value != 0) {
+        return NGX_ERROR;
+    }
+
+    login->name = read_mc_string(data, data_length);
+
+    if (!login->name.valid || login->name.data_length == 0
+        || login->name.data_length > MC_USERNAME_MAX_SIZE)
+    {
+        return NGX_ERROR;
+    }
+
+    field_sz = login->name.data - data + login->name.data_length;
+    data += field_sz;
+    data_length -= field_sz;
+
+    if (protocolVersion >= MC_PROTOCOL_1_20_2) {
+        if (data_length < MC_UUID_SIZE) {
+            return NGX_ERROR;
+        }
+
+        login->uuid = data;
+        login->valid = true;
+
+        return NGX_OK;
+    }
+
+    if (protocolVersion < MC_PROTOCOL_1_19) {
+        login->valid = true;
+        return NGX_OK;
+    }
+
+    if (protocolVersion <= MC_PROTOCOL_1_19_1) {
+        if (data_length < 1) {
+            return NGX_ERROR;
+        }
+
+        data_length--;
+
+        if (*data++) {
+            // Timestamp, then the public key and its signature
+            if (data_length < 8) {
+                return NGX_ERROR;
+            }
+
+            data += 8;
+            data_length -= 8;
+
+            for (i = 0; i < 2; i++) {
+                arrayLength = readVarInt(data, data_length);
+
+                if (!arrayLength.valid || arrayLength.value < 0
+                    || (size_t)arrayLength.value > data_length - arrayLength.length)
+                {
+                    return NGX_ERROR;
+                }
+
+                field_sz = arrayLength.length + arrayLength.value;
+                data += field_sz;
+                data_length -= field_sz;
+            }
+        }
+
+        if (protocolVersion == MC_PROTOCOL_1_19) {
+            login->valid = true;
+            return NGX_OK;
+        }
+    }
+
+    if (data_length < 1) {
+        return NGX_ERROR;
+    }
+
+    data_length--;
+
+    if (*data++) {
+        if (data_length < MC_UUID_SIZE) {
+            return NGX_ERROR;
+        }
+
+        login->uuid = data;
+    }
+
+    login->valid = true;
+
+    return NGX_OK;
+}
+
 size_t
 get_disconnect_packet_size(size_t length)
 {
@@ -250,3 +528,298 @@ create_disconnect_packet(u_char* buffer, const u_char* text, size_t length)
     writeVarInt(buffer + length_len + ID_len, length);
     (void)ngx_cpymem(buffer + length_len + ID_len + mcstr_vint_len, text, length);
 }
+
+/*
+ * Length of the hostname in a handshake server address, without the
+ * "\0FML\0"-style marker Forge clients append and without trailing dots.
+ */
+size_t
+mc_host_length(const u_char* host, size_t length)
+{
+    const u_char  *nul;
+
+    nul = memchr(host, '\0', length);
+
+    if (nul != NULL) {
+        length = nul - host;
+    }
+
+    while (length && host[length - 1] == '.') {
+        length--;
+    }
+
+    return length;
+}
+
+size_t
+get_handshake_packet_size(int32_t protocolVersion, size_t length, int32_t nextState)
+{
+    size_t   data_len, ID_len;
+
+    data_len = get_VarInt_size(protocolVersion) + get_VarInt_size(length) + length
+               + 2 + get_VarInt_size(nextState);
+    ID_len = get_VarInt_size(0x00);
+
+    return get_VarInt_size(data_len + ID_len) + ID_len + data_len;
+}
+
+void
+create_handshake_packet(u_char* buffer, int32_t protocolVersion, const u_char* host,
+    size_t length, uint16_t port, int32_t nextState)
+{
+    size_t   data_len, ID_len;
+
+    data_len = get_VarInt_size(protocolVersion) + get_VarInt_size(length) + length
+               + 2 + get_VarInt_size(nextState);
+    ID_len = get_VarInt_size(0x00);
+
+    writeVarInt(buffer, data_len + ID_len);
+    buffer += get_VarInt_size(data_len + ID_len);
+    writeVarInt(buffer, 0x00);
+    buffer += ID_len;
+    writeVarInt(buffer, protocolVersion);
+    buffer += get_VarInt_size(protocolVersion);
+    writeVarInt(buffer, length);
+    buffer += get_VarInt_size(length);
+    buffer = ngx_cpymem(buffer, host, length);
+    *buffer++ = port >> 8;
+    *buffer++ = port & 0xff;
+    writeVarInt(buffer, nextState);
+}
+
+/*
+ * Login Plugin Request, 1.13 and newer. Clients answer a channel they do
+ * not know with an empty Login Plugin Response.
+ */
+size_t
+get_login_plugin_request_size(int32_t messageId, size_t channel_len, size_t data_len)
+{
+    size_t   body_len;
+
+    body_len = get_VarInt_size(MC_LOGIN_PLUGIN_REQUEST) + get_VarInt_size(messageId)
+               + get_VarInt_size(channel_len) + channel_len + data_len;
+
+    return get_VarInt_size(body_len) + body_len;
+}
+
+void
+create_login_plugin_request(u_char* buffer, int32_t messageId, const u_char* channel,
+    size_t channel_len, const u_char* data, size_t data_len)
+{
+    size_t   body_len;
+
+    body_len = get_VarInt_size(MC_LOGIN_PLUGIN_REQUEST) + get_VarInt_size(messageId)
+               + get_VarInt_size(channel_len) + channel_len + data_len;
+
+    writeVarInt(buffer, body_len);
+    buffer += get_VarInt_size(body_len);
+    writeVarInt(buffer, MC_LOGIN_PLUGIN_REQUEST);
+    buffer += get_VarInt_size(MC_LOGIN_PLUGIN_REQUEST);
+    writeVarInt(buffer, messageId);
+    buffer += get_VarInt_size(messageId);
+    writeVarInt(buffer, channel_len);
+    buffer += get_VarInt_size(channel_len);
+    buffer = ngx_cpymem(buffer, channel, channel_len);
+    (void)ngx_cpymem(buffer, data, data_len);
+}
+
+/*
+ * Finds "players":{"max":N,"online":N} in a Status Response. Only the
+ * structure needed to skip strings and nested values is understood.
+ */
+ngx_int_t
+mc_status_players(const u_char* json, size_t length, int32_t* online, int32_t* max)
+{
+    const u_char   *p, *last, *key;
+    size_t          key_len;
+    ngx_uint_t      depth, found;
+    ngx_int_t       value;
+    bool            in_players;
+
+    p = json;
+    last = json + length;
+    depth = 0;
+    found = 0;
+    in_players = false;
+
+    while (p < last) {
+
+        switch (*p) {
+
+        case '"':
+            key = ++p;
+
+            while (p < last && *p != '"') {
+                if (*p == '\\') {
+                    p++;
+                }
+
+                p++;
+            }
+
+            if (p >= last) {
+                return NGX_ERROR;
+            }
+
+            key_len = p++ - key;
+
+            while (p < last && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+                p++;
+            }
+
+            if (p >= last || *p != ':') {
+                break;
+            }
+
+            p++;
+
+            while (p < last && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+                p++;
+            }
+
+            if (depth == 1 && key_len == 7 && ngx_strncmp(key, "players", 7) == 0
+                && p < last && *p == '{')
+            {
+                in_players = true;
+                break;
+            }
+
+            if (!in_players || depth != 2) {
+                break;
+            }
+
+            if (!((key_len == 6 && ngx_strncmp(key, "online", 6) == 0)
+                  || (key_len == 3 && ngx_strncmp(key, "max", 3) == 0)))
+            {
+                break;
+            }
+
+            value = 0;
+
+            if (p >= last || *p < '0' || *p > '9') {
+                return NGX_ERROR;
+            }
+
+            while (p < last && *p >= '0' && *p <= '9') {
+                value = value * 10 + (*p++ - '0');
+
+                if (value > INT32_MAX) {
+                    return NGX_ERROR;
+                }
+            }
+
+            if (key_len == 3) {
+                *max = (int32_t)value;
+                found |= 1;
+
+            } else {
+                *online = (int32_t)value;
+                found |= 2;
+            }
+
+            if (found == 3) {
+                return NGX_OK;
+            }
+
+            continue;
+
+        case '{':
+        case '[':
+            depth++;
+            p++;
+            continue;
+
+        case '}':
+        case ']':
+            if (depth == 0) {
+                return NGX_ERROR;
+            }
+
+            if (--depth == 1) {
+                in_players = false;
+            }
+
+            p++;
+            continue;
+
+        default:
+            p++;
+            continue;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+/*
+ * Checks that a Status Response is a single JSON object: braces and
+ * brackets balanced outside of strings and nothing but whitespace around
+ * it. Values themselves are not validated.
+ */
+ngx_int_t
+mc_json_object(const u_char* json, size_t length)
+{
+    const u_char   *p, *last;
+    ngx_uint_t      depth;
+
+    p = json;
+    last = json + length;
+
+    while (p < last && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        p++;
+    }
+
+    if (p == last || *p != '{') {
+        return NGX_ERROR;
+    }
+
+    depth = 0;
+
+    while (p < last) {
+
+        switch (*p++) {
+
+        case '"':
+            while (p < last && *p != '"') {
+                if (*p == '\\') {
+                    p++;
+                }
+
+                p++;
+            }
+
+            if (p >= last) {
+                return NGX_ERROR;
+            }
+
+            p++;
+            continue;
+
+        case '{':
+        case '[':
+            depth++;
+            continue;
+
+        case '}':
+        case ']':
+            if (--depth == 0) {
+                goto done;
+            }
+
+            continue;
+
+        default:
+            continue;
+        }
+    }
+
+    return NGX_ERROR;
+
+done:
+
+    while (p < last && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        p++;
+    }
+
+    return (p == last) ? NGX_OK : NGX_ERROR;
+}
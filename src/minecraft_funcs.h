@@ -15,11 +15,27 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 
-typedef struct nginxcraft_var nginxcraft_var;
-struct nginxcraft_var {
-    ngx_str_t minecraft_port;
-    ngx_str_t minecraft_version;
-};
+#define MC_VARINT_MAX_SIZE 5
+#define MC_USERNAME_MAX_SIZE 16
+#define MC_UUID_SIZE 16
+/* handshake, Status Request and Ping, with one to spare */
+#define MC_FRAMES_MAX 4
+
+#define MC_PROTOCOL_1_13 393
+#define MC_PROTOCOL_1_19 759
+#define MC_PROTOCOL_1_19_1 760
+#define MC_PROTOCOL_1_20_2 764
+/* login state packet ids, the same since 1.13 */
+#define MC_LOGIN_PLUGIN_REQUEST 0x04
+#define MC_LOGIN_PLUGIN_RESPONSE 0x02
+
+/* far above any release so far, snapshots set bit 30 */
+#define MC_PROTOCOL_RELEASE_MAX 0x1000
+#define MC_PROTOCOL_SNAPSHOT 0x40000000
+
+/* packet id, protocol version, address of up to 255 bytes, port, next state */
+#define MC_HANDSHAKE_MIN_SIZE (1 + 1 + 1 + 2 + 1)
+#define MC_HANDSHAKE_MAX_SIZE (1 + MC_VARINT_MAX_SIZE + 255 + 2 + MC_VARINT_MAX_SIZE)
 
 typedef struct VarInt VarInt;
 struct VarInt {
@@ -44,6 +60,16 @@ struct minecraft_packet {
     bool             valid;
 };
 
+typedef struct minecraft_frames minecraft_frames;
+struct minecraft_frames {
+    minecraft_packet   packet[MC_FRAMES_MAX];
+    ngx_uint_t         count;
+    /* bytes taken by the complete frames */
+    size_t             length;
+    /* length prefix of the frame after them, if it could be read */
+    VarInt             partial;
+};
+
 typedef struct minecraft_handshake minecraft_handshake;
 struct minecraft_handshake {
     int32_t      protocolVersion;
@@ -53,17 +79,40 @@ struct minecraft_handshake {
     bool         valid;
 };
 
+typedef struct minecraft_login_start minecraft_login_start;
+struct minecraft_login_start {
+    mc_string        name;
+    const u_char    *uuid;
+    bool             valid;
+};
+
 ngx_int_t parse_handshake(const minecraft_packet* packet, minecraft_handshake* handshake);
+ngx_int_t mc_handshake_plausible(const u_char* buffer, size_t length);
+ngx_int_t parse_login_start(const minecraft_packet* packet, int32_t protocolVersion,
+    minecraft_login_start* login);
 ngx_int_t parse_packet(const u_char* buffer, size_t length, minecraft_packet* packet);
+ngx_int_t parse_packet_frame(const u_char* frame, VarInt length, minecraft_packet* packet);
+ngx_int_t parse_frames(const u_char* buffer, size_t length, minecraft_frames* frames);
 mc_string read_mc_string(const u_char* buffer, size_t length);
 VarInt readVarInt(const u_char* buffer, size_t length);
 
 size_t get_VarInt_size(int32_t value);
 void writeVarInt(u_char* buffer, int32_t value);
 
+size_t get_handshake_packet_size(int32_t protocolVersion, size_t length, int32_t nextState);
+void create_handshake_packet(u_char* buffer, int32_t protocolVersion, const u_char* host,
+    size_t length, uint16_t port, int32_t nextState);
+
+size_t get_login_plugin_request_size(int32_t messageId, size_t channel_len, size_t data_len);
+void create_login_plugin_request(u_char* buffer, int32_t messageId, const u_char* channel,
+    size_t channel_len, const u_char* data, size_t data_len);
+
 size_t get_disconnect_packet_size(size_t length);
 void create_disconnect_packet(u_char* buffer, const u_char* text, size_t length);
 
 ngx_int_t mc_str2ngx_str(ngx_str_t* ret, size_t sz, const mc_string mc_str);
+ngx_int_t mc_status_players(const u_char* json, size_t length, int32_t* online, int32_t* max);
+ngx_int_t mc_json_object(const u_char* json, size_t length);
+size_t mc_host_length(const u_char* host, size_t length);
 
 #endif /* MINECRAFT_FUNCS_H */
@@ -0,0 +1,388 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_event_log_module.c
+ *
+ * Appends a fixed size binary record of every handshake to a ring in
+ * shared memory, for analytics at connection rates where formatting an
+ * access log line per session is not cheap. A drain server hands out the
+ * records not drained yet, see tools/mc_events.c for a reader.
+ *
+ * Workers append without a lock: a slot is claimed by incrementing the
+ * head, and its sequence number is cleared before the record is written
+ * and set to the index plus one after. The ring is not held back for the
+ * reader, records not drained in time are overwritten. The drain takes
+ * the zone mutex against other drains only, copies the records whose
+ * sequence number was the expected one before and after the copy, and
+ * counts the others as lost.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_event_log_module.h"
+#include "ngx_stream_nginxcraft_return_module.h"
+
+typedef struct {
+    ngx_atomic_t                           head;
+    /* next to drain, moved under the mutex */
+    uint64_t                               tail;
+    ngx_uint_t                             nrecords;
+    ngx_stream_nginxcraft_event_record_t  *records;
+} ngx_stream_nginxcraft_event_log_sh_t;
+
+typedef struct {
+    ngx_stream_nginxcraft_event_log_sh_t  *sh;
+    ngx_slab_pool_t                       *shpool;
+} ngx_stream_nginxcraft_event_log_zone_t;
+
+static void ngx_stream_nginxcraft_event_log_drain_handler(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_nginxcraft_event_log_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+void
+ngx_stream_nginxcraft_event_log_session(ngx_stream_session_t *s, ngx_int_t rc)
+{
+    u_char                                  *p;
+    size_t                                   len;
+    uint64_t                                 idx;
+    ngx_time_t                              *tp;
+    ngx_connection_t                        *c;
+    struct sockaddr_in                      *sin;
+    ngx_stream_nginxcraft_ctx_t             *ctx;
+    ngx_stream_nginxcraft_srv_conf_t        *nscf;
+    ngx_stream_nginxcraft_event_record_t    *r;
+    ngx_stream_nginxcraft_event_log_sh_t    *sh;
+    ngx_stream_nginxcraft_event_log_zone_t  *zone;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6                     *sin6;
+#endif
+    u_char                                   low[NGX_STREAM_NGINXCRAFT_HOST_LEN];
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+
+    if (ctx == NULL || ctx->event_logged) {
+        return;
+    }
+
+    ctx->event_logged = 1;
+
+    /* the session may have moved to another server */
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+
+    if (nscf->event_log == NULL) {
+        return;
+    }
+
+    zone = nscf->event_log->data;
+    sh = zone->sh;
+    c = s->connection;
+
+    idx = ngx_atomic_fetch_add(&sh->head, 1);
+    r = &sh->records[idx % sh->nrecords];
+
+    r->seq = 0;
+    ngx_memory_barrier();
+
+    tp = ngx_timeofday();
+    r->time = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    ngx_memzero(r->addr, 16);
+
+    switch (c->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) c->sockaddr;
+        ngx_memcpy(r->addr, sin6->sin6_addr.s6_addr, 16);
+        break;
+#endif
+
+    case AF_INET:
+        sin = (struct sockaddr_in *) c->sockaddr;
+        r->addr[10] = 0xff;
+        r->addr[11] = 0xff;
+        ngx_memcpy(&r->addr[12], &sin->sin_addr.s_addr, 4);
+        break;
+
+    default:
+        break;
+    }
+
+    len = ngx_min(ctx->host.len, NGX_STREAM_NGINXCRAFT_HOST_LEN);
+
+    if (len) {
+        ngx_strlow(low, ctx->host.data, len);
+        r->host_hash = ngx_crc32_short(low, len);
+
+    } else {
+        r->host_hash = 0;
+    }
+
+    r->host_len = (uint8_t) len;
+
+    p = ngx_cpymem(r->host, low, ngx_min(len, NGX_STREAM_NGINXCRAFT_EVENT_HOST));
+    ngx_memzero(p, r->host + NGX_STREAM_NGINXCRAFT_EVENT_HOST - p);
+
+    if (ctx->routed) {
+        r->version = ctx->handshake.protocolVersion;
+        r->port = ctx->handshake.serv_Port;
+        r->next_state = (uint8_t) ctx->handshake.nextState;
+
+    } else {
+        r->version = -1;
+        r->port = 0;
+        r->next_state = 0;
+    }
+
+    r->route = (uint8_t) ctx->route;
+
+    r->outcome = (rc == NGX_OK || rc == NGX_DECLINED)
+                 ? NGX_STREAM_NGINXCRAFT_EVENT_PROXY
+                 : (rc == NGX_DONE) ? NGX_STREAM_NGINXCRAFT_EVENT_LOCAL
+                                    : NGX_STREAM_NGINXCRAFT_EVENT_CLOSED;
+
+    ngx_memory_barrier();
+    r->seq = idx + 1;
+}
+
+static void
+ngx_stream_nginxcraft_event_log_drain_handler(ngx_stream_session_t *s)
+{
+    u_char                                  *p;
+    uint64_t                                 i, head, lost, seq;
+    ngx_str_t                                packet;
+    ngx_uint_t                               n, count;
+    ngx_connection_t                        *c;
+    ngx_stream_nginxcraft_srv_conf_t        *nscf;
+    ngx_stream_nginxcraft_event_record_t    *r, *out;
+    ngx_stream_nginxcraft_event_header_t    *h;
+    ngx_stream_nginxcraft_event_log_sh_t    *sh;
+    ngx_stream_nginxcraft_event_log_zone_t  *zone;
+
+    c = s->connection;
+
+    c->log->action = "draining events";
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+
+    zone = nscf->event_log_drain->data;
+    sh = zone->sh;
+    n = sh->nrecords;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    head = sh->head;
+    lost = 0;
+
+    if (head - sh->tail > n) {
+        lost = head - n - sh->tail;
+        sh->tail = head - n;
+    }
+
+    p = ngx_pnalloc(c->pool, sizeof(ngx_stream_nginxcraft_event_header_t)
+                             + (head - sh->tail)
+                               * sizeof(ngx_stream_nginxcraft_event_record_t));
+
+    if (p == NULL) {
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    h = (ngx_stream_nginxcraft_event_header_t *) p;
+    out = (ngx_stream_nginxcraft_event_record_t *) (h + 1);
+    count = 0;
+
+    for (i = sh->tail; i != head; i++) {
+        r = &sh->records[i % n];
+        seq = r->seq;
+
+        if (seq == i + 1) {
+            /* the record is read only after seq, as it is written before */
+            ngx_memory_barrier();
+
+            ngx_memcpy(&out[count], r, sizeof(ngx_stream_nginxcraft_event_record_t));
+            ngx_memory_barrier();
+
+            if (r->seq == i + 1) {
+                count++;
+                continue;
+            }
+
+            /* overwritten while copied */
+            lost++;
+            continue;
+        }
+
+        if (seq > i + 1) {
+            lost++;
+            continue;
+        }
+
+        /*
+         * Still being written, the next drain picks it up. A record that
+         * stays unfinished while half the ring passes was left by a
+         * worker that died.
+         */
+
+        if (head - i < n / 2) {
+            break;
+        }
+
+        lost++;
+    }
+
+    sh->tail = i;
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    ngx_memcpy(h->magic, NGX_STREAM_NGINXCRAFT_EVENT_MAGIC, 8);
+    h->record_size = sizeof(ngx_stream_nginxcraft_event_record_t);
+    h->count = count;
+    h->lost = lost;
+    h->total = head;
+
+    packet.data = p;
+    packet.len = sizeof(ngx_stream_nginxcraft_event_header_t)
+                 + count * sizeof(ngx_stream_nginxcraft_event_record_t);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "nginxcraft event log drain: %ui records, %uL lost",
+                   count, lost);
+
+    if (ngx_stream_nginxcraft_disconnect(s, &packet) != NGX_DONE) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+    }
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_event_log_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_stream_nginxcraft_event_log_zone_t  *ozone = data;
+
+    size_t                                   len;
+    ngx_uint_t                               nrecords;
+    ngx_stream_nginxcraft_event_log_zone_t  *zone;
+
+    zone = shm_zone->data;
+
+    /* records not drained yet are kept across reloads */
+
+    if (ozone) {
+        zone->sh = ozone->sh;
+        zone->shpool = ozone->shpool;
+        return NGX_OK;
+    }
+
+    zone->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        zone->sh = zone->shpool->data;
+        return NGX_OK;
+    }
+
+    zone->sh = ngx_slab_calloc(zone->shpool,
+                               sizeof(ngx_stream_nginxcraft_event_log_sh_t));
+
+    if (zone->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    zone->shpool->data = zone->sh;
+
+    /* the slab allocator keeps a little of every page for itself */
+
+    len = shm_zone->shm.size - shm_zone->shm.size / 16 - 8 * ngx_pagesize;
+    nrecords = len / sizeof(ngx_stream_nginxcraft_event_record_t);
+
+    zone->sh->records = ngx_slab_calloc(zone->shpool,
+                            nrecords * sizeof(ngx_stream_nginxcraft_event_record_t));
+
+    if (zone->sh->records == NULL) {
+        return NGX_ERROR;
+    }
+
+    zone->sh->nrecords = nrecords;
+
+    len = sizeof(" in nginxcraft_event_log zone \"\"") + shm_zone->shm.name.len;
+
+    zone->shpool->log_ctx = ngx_slab_alloc(zone->shpool, len);
+
+    if (zone->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(zone->shpool->log_ctx, " in nginxcraft_event_log zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+char *
+ngx_stream_nginxcraft_event_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    ngx_str_t       *value;
+    ngx_shm_zone_t  *shm_zone;
+
+    if (nscf->event_log != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        nscf->event_log = NULL;
+        return NGX_CONF_OK;
+    }
+
+    shm_zone = ngx_stream_nginxcraft_zone(cf, &value[1], 0,
+                   ngx_stream_nginxcraft_event_log_init_zone,
+                   sizeof(ngx_stream_nginxcraft_event_log_zone_t));
+
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    nscf->event_log = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+char *
+ngx_stream_nginxcraft_event_log_drain(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    ngx_str_t                   *value;
+    ngx_shm_zone_t              *shm_zone;
+    ngx_stream_core_srv_conf_t  *cscf;
+
+    if (nscf->event_log_drain) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    shm_zone = ngx_stream_nginxcraft_zone(cf, &value[1], 0,
+                   ngx_stream_nginxcraft_event_log_init_zone,
+                   sizeof(ngx_stream_nginxcraft_event_log_zone_t));
+
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    nscf->event_log_drain = shm_zone;
+
+    cscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_core_module);
+
+    cscf->handler = ngx_stream_nginxcraft_event_log_drain_handler;
+
+    return NGX_CONF_OK;
+}
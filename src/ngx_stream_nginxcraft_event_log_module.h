@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_event_log_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_EVENT_LOG_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_EVENT_LOG_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+/* how the preread ended, the outcome of a record */
+#define NGX_STREAM_NGINXCRAFT_EVENT_PROXY    0
+#define NGX_STREAM_NGINXCRAFT_EVENT_LOCAL    1
+#define NGX_STREAM_NGINXCRAFT_EVENT_CLOSED   2
+
+#define NGX_STREAM_NGINXCRAFT_EVENT_MAGIC    "NCEVLOG1"
+#define NGX_STREAM_NGINXCRAFT_EVENT_HOST     18
+
+/*
+ * One session, 64 bytes in host byte order. tools/mc_events.c has its
+ * own copy of this layout and of the drain header.
+ */
+typedef struct {
+    /* index in the ring plus one, written last */
+    uint64_t           seq;
+    /* milliseconds since the epoch */
+    uint64_t           time;
+    /* IPv6, or IPv4 mapped into it, zero for unix sockets */
+    u_char             addr[16];
+    /* crc32 of the whole lowercased hostname, 0 without one */
+    uint32_t           host_hash;
+    int32_t            version;
+    uint16_t           port;
+    uint8_t            next_state;
+    /* $minecraft_route_source */
+    uint8_t            route;
+    uint8_t            outcome;
+    /* of the whole hostname, only the start of which is kept */
+    uint8_t            host_len;
+    u_char             host[NGX_STREAM_NGINXCRAFT_EVENT_HOST];
+} ngx_stream_nginxcraft_event_record_t;
+
+/* ahead of the records of each drain */
+typedef struct {
+    u_char             magic[8];
+    uint32_t           record_size;
+    uint32_t           count;
+    /* overwritten before they could be drained, since the last drain */
+    uint64_t           lost;
+    /* records appended since the zone was created */
+    uint64_t           total;
+} ngx_stream_nginxcraft_event_header_t;
+
+char *ngx_stream_nginxcraft_event_log(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_stream_nginxcraft_event_log_drain(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+void ngx_stream_nginxcraft_event_log_session(ngx_stream_session_t *s,
+    ngx_int_t rc);
+
+#endif /* NGX_STREAM_NGINXCRAFT_EVENT_LOG_MODULE_H */
@@ -0,0 +1,417 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_forward_module.c
+ *
+ * Passes the address of the player on to backends that expect it from a
+ * BungeeCord proxy, so no Java proxy is needed in between only for that.
+ * The server address of the handshake becomes "host\0ip\0uuid", the
+ * format of BungeeCord's ip_forward and of Velocity's legacy forwarding,
+ * which Spigot and Paper read with bungeecord enabled.
+ *
+ * With proxy_protocol a PROXY protocol v2 header goes first, with the
+ * hostname, protocol version, next state and username as TLVs, so that
+ * backends need not decode the handshake again. It is encoded in binary
+ * straight from the ctx.
+ *
+ * Once the session is about to be proxied the header and the handshake
+ * frame at the start of the preread buffer are written into a new
+ * buffer, and the rest of the preread data is copied after them
+ * unchanged. The old buffer is left as it was, the variables keep
+ * pointing into it.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_forward_module.h"
+#include "minecraft_funcs.h"
+
+/* a UUID without dashes */
+#define NGX_STREAM_NGINXCRAFT_FORWARD_UUID_LEN  32
+
+/* signature, version, family and length, two IPv6 addresses and ports, TLVs */
+#define NGX_STREAM_NGINXCRAFT_FORWARD_HEADER                                  \
+    (16 + 36 + 4 * 3 + NGX_STREAM_NGINXCRAFT_HOST_LEN + 4 + 1                 \
+     + MC_USERNAME_MAX_SIZE)
+
+static u_char *ngx_stream_nginxcraft_forward_proxy_protocol(
+    ngx_stream_session_t *s, ngx_stream_nginxcraft_ctx_t *ctx, u_char *p);
+static u_char *ngx_stream_nginxcraft_forward_address(u_char *p,
+    struct sockaddr *sa, ngx_uint_t inet6);
+static u_char *ngx_stream_nginxcraft_forward_tlv(u_char *p, ngx_uint_t type,
+    const u_char *data, size_t len);
+static size_t ngx_stream_nginxcraft_forward_bungeecord(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx, ngx_uint_t uuid, u_char *host);
+static void ngx_stream_nginxcraft_forward_offline_uuid(ngx_str_t *username,
+    u_char *uuid);
+
+ngx_int_t
+ngx_stream_nginxcraft_forward_handler(ngx_stream_session_t *s)
+{
+    u_char                            *p;
+    size_t                             len, size, frame, rest;
+    ngx_int_t                          rc;
+    ngx_buf_t                         *b;
+    ngx_connection_t                  *c;
+    minecraft_packet                   packet;
+    ngx_stream_nginxcraft_ctx_t       *ctx;
+    ngx_stream_nginxcraft_srv_conf_t  *nscf;
+    u_char                             header[NGX_STREAM_NGINXCRAFT_FORWARD_HEADER];
+    u_char                             host[NGX_STREAM_NGINXCRAFT_HOST_LEN
+                                            + NGX_SOCKADDR_STRLEN + 2
+                                            + NGX_STREAM_NGINXCRAFT_FORWARD_UUID_LEN];
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+
+    if (nscf->forward == NGX_STREAM_NGINXCRAFT_FORWARD_OFF) {
+        return NGX_OK;
+    }
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+
+    if (ctx == NULL || ctx->forwarded) {
+        return NGX_OK;
+    }
+
+    ctx->forwarded = 1;
+
+    c = s->connection;
+
+    /* the header goes on every session, a backend expecting it rejects others */
+
+    p = header;
+
+    if (nscf->forward & NGX_STREAM_NGINXCRAFT_FORWARD_PROXY_PROTOCOL) {
+        p = ngx_stream_nginxcraft_forward_proxy_protocol(s, ctx, p);
+
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* only logins carry the address, status pings stay as they are */
+
+    len = 0;
+
+    if ((nscf->forward & NGX_STREAM_NGINXCRAFT_FORWARD_BUNGEECORD)
+        && ctx->routed && ctx->login_done && ctx->handshake.nextState != 1)
+    {
+        len = ngx_stream_nginxcraft_forward_bungeecord(s, ctx, nscf->forward_uuid,
+                                                       host);
+    }
+
+    if (p == header && len == 0) {
+        return NGX_OK;
+    }
+
+    frame = 0;
+    size = 0;
+
+    if (len) {
+        rc = parse_packet(c->buffer->pos, c->buffer->last - c->buffer->pos,
+                          &packet);
+
+        if (rc != NGX_OK || packet.packetId.value != 0x00) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "nginxcraft forward: no handshake to rewrite");
+            return NGX_ERROR;
+        }
+
+        frame = packet.length.length + packet.length.value;
+
+        size = get_handshake_packet_size(ctx->handshake.protocolVersion, len,
+                                         ctx->handshake.nextState);
+    }
+
+    rest = c->buffer->last - c->buffer->pos - frame;
+
+    b = ngx_create_temp_buf(c->pool, (p - header) + size + rest);
+
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->last = ngx_cpymem(b->last, header, p - header);
+
+    if (len) {
+        create_handshake_packet(b->last, ctx->handshake.protocolVersion, host,
+                                len, ctx->handshake.serv_Port,
+                                ctx->handshake.nextState);
+        b->last += size;
+    }
+
+    b->last = ngx_cpymem(b->last, c->buffer->pos + frame, rest);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "nginxcraft forward: header %uz, handshake of %uz bytes now %uz",
+                   (size_t) (p - header), frame, size);
+
+    c->buffer = b;
+
+    return NGX_OK;
+}
+
+static u_char *
+ngx_stream_nginxcraft_forward_proxy_protocol(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx, u_char *p)
+{
+    u_char            *family, *length, *start;
+    uint32_t           version;
+    ngx_uint_t         src, dst;
+    ngx_connection_t  *c;
+
+    c = s->connection;
+
+    if (ngx_connection_local_sockaddr(c, NULL, 0) != NGX_OK) {
+        return NULL;
+    }
+
+    p = ngx_cpymem(p, "\r\n\r\n\0\r\nQUIT\n", 12);
+
+    /* version 2, PROXY */
+    *p++ = 0x21;
+
+    family = p++;
+    length = p;
+    p += 2;
+    start = p;
+
+    src = c->sockaddr->sa_family;
+    dst = c->local_sockaddr->sa_family;
+
+    if (src == AF_INET && dst == AF_INET) {
+        /* TCP over IPv4 */
+        *family = 0x11;
+        p = ngx_stream_nginxcraft_forward_address(p, c->sockaddr, 0);
+        p = ngx_stream_nginxcraft_forward_address(p, c->local_sockaddr, 0);
+        p = ngx_cpymem(p, &((struct sockaddr_in *) c->sockaddr)->sin_port, 2);
+        p = ngx_cpymem(p, &((struct sockaddr_in *) c->local_sockaddr)->sin_port, 2);
+
+#if (NGX_HAVE_INET6)
+    } else if ((src == AF_INET || src == AF_INET6)
+               && (dst == AF_INET || dst == AF_INET6))
+    {
+        /* TCP over IPv6, with IPv4 mapped when the two differ */
+        *family = 0x21;
+        p = ngx_stream_nginxcraft_forward_address(p, c->sockaddr, 1);
+        p = ngx_stream_nginxcraft_forward_address(p, c->local_sockaddr, 1);
+        p = ngx_cpymem(p, src == AF_INET
+                          ? &((struct sockaddr_in *) c->sockaddr)->sin_port
+                          : &((struct sockaddr_in6 *) c->sockaddr)->sin6_port,
+                       2);
+        p = ngx_cpymem(p, dst == AF_INET
+                          ? &((struct sockaddr_in *) c->local_sockaddr)->sin_port
+                          : &((struct sockaddr_in6 *) c->local_sockaddr)->sin6_port,
+                       2);
+#endif
+
+    } else {
+        /* unix sockets, the backend uses the addresses it sees */
+        *family = 0x00;
+    }
+
+    if (ctx->routed) {
+        p = ngx_stream_nginxcraft_forward_tlv(p, NGX_STREAM_NGINXCRAFT_TLV_HOST,
+                                              ctx->host.data,
+                                              ngx_min(ctx->host.len,
+                                                      NGX_STREAM_NGINXCRAFT_HOST_LEN));
+
+        version = htonl((uint32_t) ctx->handshake.protocolVersion);
+
+        p = ngx_stream_nginxcraft_forward_tlv(p, NGX_STREAM_NGINXCRAFT_TLV_VERSION,
+                                              (u_char *) &version, 4);
+
+        *p = (u_char) ctx->handshake.nextState;
+
+        p = ngx_stream_nginxcraft_forward_tlv(p, NGX_STREAM_NGINXCRAFT_TLV_NEXT_STATE,
+                                              p, 1);
+    }
+
+    if (ctx->login_done && ctx->username.len) {
+        p = ngx_stream_nginxcraft_forward_tlv(p, NGX_STREAM_NGINXCRAFT_TLV_USERNAME,
+                                              ctx->username.data,
+                                              ngx_min(ctx->username.len,
+                                                      MC_USERNAME_MAX_SIZE));
+    }
+
+    length[0] = (u_char) ((p - start) >> 8);
+    length[1] = (u_char) (p - start);
+
+    return p;
+}
+
+static u_char *
+ngx_stream_nginxcraft_forward_address(u_char *p, struct sockaddr *sa,
+    ngx_uint_t inet6)
+{
+    struct sockaddr_in   *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6  *sin6;
+
+    if (sa->sa_family == AF_INET6) {
+        sin6 = (struct sockaddr_in6 *) sa;
+        return ngx_cpymem(p, sin6->sin6_addr.s6_addr, 16);
+    }
+#endif
+
+    sin = (struct sockaddr_in *) sa;
+
+    if (inet6) {
+        ngx_memzero(p, 10);
+        p[10] = 0xff;
+        p[11] = 0xff;
+        p += 12;
+    }
+
+    return ngx_cpymem(p, &sin->sin_addr.s_addr, 4);
+}
+
+/* the value may already be in place, at p + 3 */
+static u_char *
+ngx_stream_nginxcraft_forward_tlv(u_char *p, ngx_uint_t type, const u_char *data,
+    size_t len)
+{
+    ngx_memmove(p + 3, data, len);
+
+    p[0] = (u_char) type;
+    p[1] = (u_char) (len >> 8);
+    p[2] = (u_char) len;
+
+    return p + 3 + len;
+}
+
+/* host\0ip\0uuid into host, 0 when the address cannot be forwarded */
+static size_t
+ngx_stream_nginxcraft_forward_bungeecord(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx, ngx_uint_t uuid, u_char *host)
+{
+    u_char            *p;
+    ngx_connection_t  *c;
+    u_char             id[MC_UUID_SIZE];
+
+    c = s->connection;
+
+    switch (c->sockaddr->sa_family) {
+
+    case AF_INET:
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+#endif
+        break;
+
+    default:
+        /* BungeeCord forwards nothing else either */
+        return 0;
+    }
+
+    if (uuid == NGX_STREAM_NGINXCRAFT_FORWARD_UUID_CLIENT && ctx->uuid) {
+        ngx_memcpy(id, ctx->uuid, MC_UUID_SIZE);
+
+    } else {
+        ngx_stream_nginxcraft_forward_offline_uuid(&ctx->username, id);
+    }
+
+    p = ngx_cpymem(host, ctx->host.data,
+                   ngx_min(ctx->host.len, NGX_STREAM_NGINXCRAFT_HOST_LEN));
+    *p++ = '\0';
+    p += ngx_sock_ntop(c->sockaddr, c->socklen, p, NGX_SOCKADDR_STRLEN, 0);
+    *p++ = '\0';
+    p = ngx_hex_dump(p, id, MC_UUID_SIZE);
+
+    return p - host;
+}
+
+/* as BungeeCord and the server in offline mode, a version 3 UUID of the name */
+static void
+ngx_stream_nginxcraft_forward_offline_uuid(ngx_str_t *username, u_char *uuid)
+{
+    ngx_md5_t  md5;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, "OfflinePlayer:", sizeof("OfflinePlayer:") - 1);
+    ngx_md5_update(&md5, username->data, username->len);
+    ngx_md5_final(uuid, &md5);
+
+    uuid[6] = (uuid[6] & 0x0f) | 0x30;
+    uuid[8] = (uuid[8] & 0x3f) | 0x80;
+}
+
+char *
+ngx_stream_nginxcraft_forward(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    ngx_str_t   *value;
+    ngx_uint_t   i, uuid;
+
+    if (nscf->forward != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+
+        if (cf->args->nelts > 2) {
+            i = 2;
+            goto invalid;
+        }
+
+        nscf->forward = NGX_STREAM_NGINXCRAFT_FORWARD_OFF;
+        return NGX_CONF_OK;
+    }
+
+    nscf->forward = NGX_STREAM_NGINXCRAFT_FORWARD_OFF;
+    uuid = 0;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strcmp(value[i].data, "bungeecord") == 0) {
+            nscf->forward |= NGX_STREAM_NGINXCRAFT_FORWARD_BUNGEECORD;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "proxy_protocol") == 0) {
+            nscf->forward |= NGX_STREAM_NGINXCRAFT_FORWARD_PROXY_PROTOCOL;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "uuid=offline") == 0) {
+            nscf->forward_uuid = NGX_STREAM_NGINXCRAFT_FORWARD_UUID_OFFLINE;
+            uuid = i;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "uuid=client") == 0) {
+            nscf->forward_uuid = NGX_STREAM_NGINXCRAFT_FORWARD_UUID_CLIENT;
+            uuid = i;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (nscf->forward == NGX_STREAM_NGINXCRAFT_FORWARD_OFF) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"bungeecord\" or \"proxy_protocol\" is required");
+        return NGX_CONF_ERROR;
+    }
+
+    if (uuid && !(nscf->forward & NGX_STREAM_NGINXCRAFT_FORWARD_BUNGEECORD)) {
+        i = uuid;
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
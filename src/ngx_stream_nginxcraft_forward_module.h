@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_forward_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_FORWARD_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_FORWARD_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+/* nginxcraft_forward, a bit each */
+#define NGX_STREAM_NGINXCRAFT_FORWARD_OFF             0
+#define NGX_STREAM_NGINXCRAFT_FORWARD_BUNGEECORD      1
+#define NGX_STREAM_NGINXCRAFT_FORWARD_PROXY_PROTOCOL  2
+
+/* PROXY protocol v2 TLVs, from the range kept for custom types */
+#define NGX_STREAM_NGINXCRAFT_TLV_HOST        0xE0
+#define NGX_STREAM_NGINXCRAFT_TLV_VERSION     0xE1
+#define NGX_STREAM_NGINXCRAFT_TLV_NEXT_STATE  0xE2
+#define NGX_STREAM_NGINXCRAFT_TLV_USERNAME    0xE3
+
+/* the UUID sent with bungeecord */
+#define NGX_STREAM_NGINXCRAFT_FORWARD_UUID_OFFLINE  0
+#define NGX_STREAM_NGINXCRAFT_FORWARD_UUID_CLIENT   1
+
+char *ngx_stream_nginxcraft_forward(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_stream_nginxcraft_forward_handler(ngx_stream_session_t *s);
+
+#endif /* NGX_STREAM_NGINXCRAFT_FORWARD_MODULE_H */
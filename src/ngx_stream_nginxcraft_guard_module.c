@@ -0,0 +1,641 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_guard_module.c
+ *
+ * Drops connections whose first bytes cannot start a handshake before a
+ * context is allocated for them, bans their address for a while and
+ * limits how many sessions an address may keep in the preread phase.
+ * Addresses live in a shared memory zone, least recently seen first out.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_guard_module.h"
+#include "ngx_stream_nginxcraft_metrics_module.h"
+#include "minecraft_funcs.h"
+
+#define NGX_STREAM_NGINXCRAFT_GUARD_KEY_LEN  NGX_SOCKADDR_STRLEN
+
+typedef struct {
+    ngx_rbtree_t                  rbtree;
+    ngx_rbtree_node_t             sentinel;
+    ngx_queue_t                   queue;
+} ngx_stream_nginxcraft_guard_shctx_t;
+
+typedef struct {
+    ngx_stream_nginxcraft_guard_shctx_t  *sh;
+    ngx_slab_pool_t                      *shpool;
+} ngx_stream_nginxcraft_guard_zone_t;
+
+typedef struct {
+    ngx_str_node_t     sn;
+    ngx_queue_t        queue;
+    /* end of the ban, if banned */
+    ngx_msec_t         expire;
+    ngx_uint_t         half_open;
+    unsigned           banned:1;
+    u_char             key[1];
+} ngx_stream_nginxcraft_guard_node_t;
+
+/* an address counted as half-open, until its session is done prereading */
+typedef struct {
+    ngx_shm_zone_t    *shm_zone;
+    ngx_str_t          key;
+    u_char             buf[NGX_STREAM_NGINXCRAFT_GUARD_KEY_LEN];
+} ngx_stream_nginxcraft_guard_cleanup_t;
+
+static size_t ngx_stream_nginxcraft_guard_key(ngx_connection_t *c, u_char *buf);
+static void ngx_stream_nginxcraft_guard_ban(ngx_stream_nginxcraft_guard_t *guard,
+    ngx_connection_t *c);
+static void ngx_stream_nginxcraft_guard_cleanup(void *data);
+static ngx_stream_nginxcraft_guard_node_t *ngx_stream_nginxcraft_guard_create(
+    ngx_stream_nginxcraft_guard_zone_t *zone, ngx_str_t *key, uint32_t hash);
+static void ngx_stream_nginxcraft_guard_delete(
+    ngx_stream_nginxcraft_guard_zone_t *zone,
+    ngx_stream_nginxcraft_guard_node_t *node);
+static void ngx_stream_nginxcraft_guard_expire(
+    ngx_stream_nginxcraft_guard_zone_t *zone, ngx_uint_t n);
+static ngx_int_t ngx_stream_nginxcraft_guard_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+/* neither banned nor prereading, the node can go */
+static ngx_inline ngx_uint_t
+ngx_stream_nginxcraft_guard_idle(ngx_stream_nginxcraft_guard_node_t *node,
+    ngx_msec_t now)
+{
+    return node->half_open == 0
+           && (!node->banned || (ngx_msec_int_t) (node->expire - now) <= 0);
+}
+
+/* preaccess phase, before anything is read */
+ngx_int_t
+ngx_stream_nginxcraft_guard_handler(ngx_stream_session_t *s)
+{
+    uint32_t                                hash;
+    ngx_msec_t                              now;
+    ngx_str_t                               key;
+    ngx_connection_t                       *c;
+    ngx_pool_cleanup_t                     *cln;
+    ngx_stream_nginxcraft_guard_t          *guard;
+    ngx_stream_nginxcraft_guard_node_t     *node;
+    ngx_stream_nginxcraft_guard_zone_t     *zone;
+    ngx_stream_nginxcraft_srv_conf_t       *nscf;
+    ngx_stream_nginxcraft_guard_cleanup_t  *gc;
+    u_char                                  buf[NGX_STREAM_NGINXCRAFT_GUARD_KEY_LEN];
+
+    c = s->connection;
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+    guard = nscf->guard;
+
+    if (guard == NULL || nscf->metrics) {
+        return NGX_DECLINED;
+    }
+
+    cln = NULL;
+    gc = NULL;
+
+    if (guard->half_open) {
+        cln = ngx_pool_cleanup_add(c->pool,
+                                   sizeof(ngx_stream_nginxcraft_guard_cleanup_t));
+
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        gc = cln->data;
+        key.data = gc->buf;
+
+    } else {
+        key.data = buf;
+    }
+
+    key.len = ngx_stream_nginxcraft_guard_key(c, key.data);
+
+    hash = ngx_crc32_short(key.data, key.len);
+    now = ngx_current_msec;
+    zone = guard->shm_zone->data;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    ngx_stream_nginxcraft_guard_expire(zone, 1);
+
+    node = (ngx_stream_nginxcraft_guard_node_t *)
+               ngx_str_rbtree_lookup(&zone->sh->rbtree, &key, hash);
+
+    if (node && node->banned) {
+
+        if ((ngx_msec_int_t) (node->expire - now) > 0) {
+            ngx_shmtx_unlock(&zone->shpool->mutex);
+
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "address banned by zone \"%V\"",
+                          &guard->shm_zone->shm.name);
+
+            ngx_stream_nginxcraft_metrics_reject(s,
+                                                 NGX_STREAM_NGINXCRAFT_METRICS_GUARD);
+
+            return NGX_STREAM_FORBIDDEN;
+        }
+
+        node->banned = 0;
+    }
+
+    if (cln == NULL) {
+
+        if (node && ngx_stream_nginxcraft_guard_idle(node, now)) {
+            ngx_stream_nginxcraft_guard_delete(zone, node);
+        }
+
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+
+        return NGX_DECLINED;
+    }
+
+    if (node == NULL) {
+        node = ngx_stream_nginxcraft_guard_create(zone, &key, hash);
+
+        if (node == NULL) {
+            ngx_shmtx_unlock(&zone->shpool->mutex);
+
+            /* fail open, a full zone must not lock every player out */
+            return NGX_DECLINED;
+        }
+
+    } else if (node->half_open >= guard->half_open) {
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "limiting half-open sessions by zone \"%V\"",
+                      &guard->shm_zone->shm.name);
+
+        ngx_stream_nginxcraft_metrics_reject(s,
+                                             NGX_STREAM_NGINXCRAFT_METRICS_GUARD);
+
+        return NGX_STREAM_SERVICE_UNAVAILABLE;
+
+    } else {
+        ngx_queue_remove(&node->queue);
+        ngx_queue_insert_head(&zone->sh->queue, &node->queue);
+    }
+
+    node->half_open++;
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    gc->shm_zone = guard->shm_zone;
+    gc->key = key;
+
+    cln->handler = ngx_stream_nginxcraft_guard_cleanup;
+
+    return NGX_DECLINED;
+}
+
+/*
+ * Runs on the preread buffer before the session has a context: NGX_OK
+ * lets the bytes through, NGX_AGAIN waits for more of them and anything
+ * else is the status to close the session with.
+ */
+ngx_int_t
+ngx_stream_nginxcraft_guard_classify(ngx_stream_session_t *s)
+{
+    ngx_int_t                          rc;
+    ngx_buf_t                         *b;
+    ngx_connection_t                  *c;
+    ngx_stream_nginxcraft_guard_t     *guard;
+    ngx_stream_nginxcraft_srv_conf_t  *nscf;
+
+    c = s->connection;
+    b = c->buffer;
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+    guard = nscf->guard;
+
+    if (guard == NULL) {
+        return NGX_OK;
+    }
+
+    if (b->pos == b->last) {
+        return NGX_AGAIN;
+    }
+
+    /* legacy pings, answered by nginxcraft_legacy_ping or proxied */
+    if (*b->pos == 0xFE) {
+        return NGX_OK;
+    }
+
+    rc = mc_handshake_plausible(b->pos, b->last - b->pos);
+
+    if (rc != NGX_DECLINED) {
+        return rc;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "not a Minecraft handshake, closing connection");
+
+    ngx_stream_nginxcraft_metrics_handshake(s, NULL,
+                                            NGX_STREAM_NGINXCRAFT_METRICS_DECLINED);
+
+    if (guard->ban) {
+        ngx_stream_nginxcraft_guard_ban(guard, c);
+    }
+
+    return NGX_STREAM_BAD_REQUEST;
+}
+
+/* stops counting the session as half-open once the preread phase is over */
+void
+ngx_stream_nginxcraft_guard_done(ngx_stream_session_t *s)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    for (cln = s->connection->pool->cleanup; cln; cln = cln->next) {
+
+        if (cln->handler == ngx_stream_nginxcraft_guard_cleanup) {
+            cln->handler(cln->data);
+            cln->handler = NULL;
+            return;
+        }
+    }
+}
+
+static size_t
+ngx_stream_nginxcraft_guard_key(ngx_connection_t *c, u_char *buf)
+{
+    u_char  *p;
+
+    switch (c->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        p = ngx_cpymem(buf, ((struct sockaddr_in6 *) c->sockaddr)->sin6_addr.s6_addr, 16);
+        break;
+#endif
+
+    case AF_INET:
+        p = ngx_cpymem(buf, &((struct sockaddr_in *) c->sockaddr)->sin_addr, 4);
+        break;
+
+    default:
+        p = ngx_cpymem(buf, c->addr_text.data,
+                       ngx_min(c->addr_text.len, NGX_SOCKADDR_STRLEN));
+        break;
+    }
+
+    return p - buf;
+}
+
+static void
+ngx_stream_nginxcraft_guard_ban(ngx_stream_nginxcraft_guard_t *guard,
+    ngx_connection_t *c)
+{
+    uint32_t                             hash;
+    ngx_str_t                            key;
+    ngx_stream_nginxcraft_guard_node_t  *node;
+    ngx_stream_nginxcraft_guard_zone_t  *zone;
+    u_char                               buf[NGX_STREAM_NGINXCRAFT_GUARD_KEY_LEN];
+
+    key.data = buf;
+    key.len = ngx_stream_nginxcraft_guard_key(c, buf);
+
+    hash = ngx_crc32_short(key.data, key.len);
+    zone = guard->shm_zone->data;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    node = (ngx_stream_nginxcraft_guard_node_t *)
+               ngx_str_rbtree_lookup(&zone->sh->rbtree, &key, hash);
+
+    if (node == NULL) {
+        node = ngx_stream_nginxcraft_guard_create(zone, &key, hash);
+
+        if (node == NULL) {
+            ngx_shmtx_unlock(&zone->shpool->mutex);
+            return;
+        }
+
+    } else {
+        ngx_queue_remove(&node->queue);
+        ngx_queue_insert_head(&zone->sh->queue, &node->queue);
+    }
+
+    node->banned = 1;
+    node->expire = ngx_current_msec + guard->ban;
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+}
+
+static void
+ngx_stream_nginxcraft_guard_cleanup(void *data)
+{
+    ngx_stream_nginxcraft_guard_cleanup_t  *gc = data;
+
+    ngx_stream_nginxcraft_guard_node_t  *node;
+    ngx_stream_nginxcraft_guard_zone_t  *zone;
+
+    zone = gc->shm_zone->data;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    node = (ngx_stream_nginxcraft_guard_node_t *)
+               ngx_str_rbtree_lookup(&zone->sh->rbtree, &gc->key,
+                                     ngx_crc32_short(gc->key.data, gc->key.len));
+
+    /* gone if the zone ran out of memory meanwhile */
+
+    if (node && node->half_open) {
+        node->half_open--;
+
+        if (ngx_stream_nginxcraft_guard_idle(node, ngx_current_msec)) {
+            ngx_stream_nginxcraft_guard_delete(zone, node);
+        }
+    }
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+}
+
+static ngx_stream_nginxcraft_guard_node_t *
+ngx_stream_nginxcraft_guard_create(ngx_stream_nginxcraft_guard_zone_t *zone,
+    ngx_str_t *key, uint32_t hash)
+{
+    size_t                               size;
+    ngx_stream_nginxcraft_guard_node_t  *node;
+
+    size = offsetof(ngx_stream_nginxcraft_guard_node_t, key) + key->len;
+
+    node = ngx_slab_alloc_locked(zone->shpool, size);
+
+    if (node == NULL) {
+        ngx_stream_nginxcraft_guard_expire(zone, 0);
+
+        node = ngx_slab_alloc_locked(zone->shpool, size);
+
+        if (node == NULL) {
+            return NULL;
+        }
+    }
+
+    node->sn.node.key = hash;
+    node->sn.str.len = key->len;
+    node->sn.str.data = node->key;
+    node->expire = 0;
+    node->half_open = 0;
+    node->banned = 0;
+
+    ngx_memcpy(node->key, key->data, key->len);
+
+    ngx_rbtree_insert(&zone->sh->rbtree, &node->sn.node);
+    ngx_queue_insert_head(&zone->sh->queue, &node->queue);
+
+    return node;
+}
+
+static void
+ngx_stream_nginxcraft_guard_delete(ngx_stream_nginxcraft_guard_zone_t *zone,
+    ngx_stream_nginxcraft_guard_node_t *node)
+{
+    ngx_queue_remove(&node->queue);
+
+    ngx_rbtree_delete(&zone->sh->rbtree, &node->sn.node);
+
+    ngx_slab_free_locked(zone->shpool, node);
+}
+
+/*
+ * n == 1 removes one or two addresses that are neither banned nor
+ * prereading, n == 0 removes the least recently seen ones to make room,
+ * bans included.
+ */
+static void
+ngx_stream_nginxcraft_guard_expire(ngx_stream_nginxcraft_guard_zone_t *zone,
+    ngx_uint_t n)
+{
+    ngx_msec_t                           now;
+    ngx_queue_t                         *q;
+    ngx_stream_nginxcraft_guard_node_t  *node;
+
+    now = ngx_current_msec;
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&zone->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&zone->sh->queue);
+
+        node = ngx_queue_data(q, ngx_stream_nginxcraft_guard_node_t, queue);
+
+        if (n++ != 0 && !ngx_stream_nginxcraft_guard_idle(node, now)) {
+            return;
+        }
+
+        ngx_stream_nginxcraft_guard_delete(zone, node);
+    }
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_guard_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_stream_nginxcraft_guard_zone_t  *ozone = data;
+
+    size_t                               len;
+    ngx_stream_nginxcraft_guard_zone_t  *zone;
+
+    zone = shm_zone->data;
+
+    if (ozone) {
+        zone->sh = ozone->sh;
+        zone->shpool = ozone->shpool;
+        return NGX_OK;
+    }
+
+    zone->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        zone->sh = zone->shpool->data;
+        return NGX_OK;
+    }
+
+    zone->sh = ngx_slab_alloc(zone->shpool,
+                              sizeof(ngx_stream_nginxcraft_guard_shctx_t));
+
+    if (zone->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    zone->shpool->data = zone->sh;
+
+    ngx_rbtree_init(&zone->sh->rbtree, &zone->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&zone->sh->queue);
+
+    len = sizeof(" in nginxcraft_guard zone \"\"") + shm_zone->shm.name.len;
+
+    zone->shpool->log_ctx = ngx_slab_alloc(zone->shpool, len);
+
+    if (zone->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(zone->shpool->log_ctx, " in nginxcraft_guard zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+char *
+ngx_stream_nginxcraft_guard(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t    *nscf = conf;
+
+    u_char                              *p;
+    ssize_t                              size;
+    ngx_int_t                            n;
+    ngx_str_t                           *value, name, s;
+    ngx_uint_t                           i;
+    ngx_shm_zone_t                      *shm_zone;
+    ngx_stream_nginxcraft_guard_t       *guard;
+    ngx_stream_nginxcraft_guard_zone_t  *zone;
+
+    if (nscf->guard != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        nscf->guard = NULL;
+        return NGX_CONF_OK;
+    }
+
+    guard = ngx_pcalloc(cf->pool, sizeof(ngx_stream_nginxcraft_guard_t));
+
+    if (guard == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    size = 0;
+    guard->ban = 60000;
+    ngx_str_null(&name);
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+            name.len = value[i].len - 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p) {
+                name.len = p - name.data;
+
+                s.data = p + 1;
+                s.len = value[i].data + value[i].len - s.data;
+
+                size = ngx_parse_size(&s);
+
+                if (size == NGX_ERROR) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "invalid zone size \"%V\"", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+
+                if (size < (ssize_t) (8 * ngx_pagesize)) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "zone \"%V\" is too small", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+            }
+
+            if (name.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone name \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ban=", 4) == 0) {
+
+            s.data = value[i].data + 4;
+            s.len = value[i].len - 4;
+
+            n = ngx_parse_time(&s, 0);
+
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ban time \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            guard->ban = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "half_open=", 10) == 0) {
+
+            n = ngx_atoi(value[i].data + 10, value[i].len - 10);
+
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid half_open value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            guard->half_open = n;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_stream_nginxcraft_module);
+
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data && shm_zone->init != ngx_stream_nginxcraft_guard_init_zone) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is already used by another directive",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data == NULL) {
+        zone = ngx_pcalloc(cf->pool, sizeof(ngx_stream_nginxcraft_guard_zone_t));
+
+        if (zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        shm_zone->init = ngx_stream_nginxcraft_guard_init_zone;
+        shm_zone->data = zone;
+    }
+
+    guard->shm_zone = shm_zone;
+    nscf->guard = guard;
+
+    return NGX_CONF_OK;
+}
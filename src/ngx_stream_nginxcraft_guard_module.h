@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_guard_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_GUARD_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_GUARD_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+struct ngx_stream_nginxcraft_guard_s {
+    ngx_shm_zone_t              *shm_zone;
+    /* how long an address is banned, 0 if not banned */
+    ngx_msec_t                   ban;
+    /* sessions per address still prereading, 0 if not limited */
+    ngx_uint_t                   half_open;
+};
+
+char *ngx_stream_nginxcraft_guard(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_stream_nginxcraft_guard_handler(ngx_stream_session_t *s);
+ngx_int_t ngx_stream_nginxcraft_guard_classify(ngx_stream_session_t *s);
+void ngx_stream_nginxcraft_guard_done(ngx_stream_session_t *s);
+
+#endif /* NGX_STREAM_NGINXCRAFT_GUARD_MODULE_H */
@@ -0,0 +1,348 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_legacy_module.c
+ *
+ * Answers the server list ping of clients from before 1.7, which starts
+ * with 0xFE instead of a handshake, with a kick packet holding the server
+ * description in UTF-16BE. Both packets are built when the configuration
+ * is read.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_legacy_module.h"
+#include "ngx_stream_nginxcraft_metrics_module.h"
+#include "ngx_stream_nginxcraft_return_module.h"
+
+#define NGX_STREAM_NGINXCRAFT_LEGACY_PING      0xFE
+#define NGX_STREAM_NGINXCRAFT_LEGACY_KICK      0xFF
+
+/* longest kick reason legacy clients read, in UTF-16 code units */
+#define NGX_STREAM_NGINXCRAFT_LEGACY_MAX_LEN   256
+
+/* how long a short ping may wait for the byte that tells it apart */
+#define NGX_STREAM_NGINXCRAFT_LEGACY_WAIT      1000
+
+static ngx_int_t ngx_stream_nginxcraft_legacy_wait(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx);
+static void ngx_stream_nginxcraft_legacy_wait_handler(ngx_event_t *ev);
+static void ngx_stream_nginxcraft_legacy_cleanup(void *data);
+static ngx_int_t ngx_stream_nginxcraft_legacy_packet(ngx_pool_t *pool,
+    u_char *text, size_t len, ngx_str_t *packet);
+
+/*
+ * Beta 1.8 to 1.3 send 0xFE alone, 1.4 and 1.5 add 0x01 and 1.6 follows
+ * it with a plugin message, 0xFA. A handshake of 254 bytes also starts
+ * with 0xFE 0x01 but has its packet id, 0, next, so one or two bytes are
+ * answered only once no third byte came in time.
+ */
+ngx_int_t
+ngx_stream_nginxcraft_legacy_handler(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx)
+{
+    u_char                            *p;
+    size_t                             len;
+    ngx_stream_nginxcraft_legacy_t    *legacy;
+    ngx_stream_nginxcraft_srv_conf_t  *nscf;
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+    legacy = nscf->legacy;
+
+    p = s->connection->buffer->pos;
+    len = s->connection->buffer->last - p;
+
+    if (legacy == NULL || len == 0 || p[0] != NGX_STREAM_NGINXCRAFT_LEGACY_PING) {
+        return NGX_DECLINED;
+    }
+
+    if (len < 3 && (len == 1 || p[1] == 0x01) && !ctx->legacy_timedout) {
+        return ngx_stream_nginxcraft_legacy_wait(s, ctx);
+    }
+
+    if (ctx->legacy_wait && ctx->legacy_wait->timer_set) {
+        ngx_del_timer(ctx->legacy_wait);
+    }
+
+    if ((len > 1 && p[1] != 0x01) || (len > 2 && p[2] != 0xFA)) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "nginxcraft legacy ping");
+
+    ctx->route = NGX_STREAM_NGINXCRAFT_ROUTE_DECLINED;
+
+    ngx_stream_nginxcraft_metrics_handshake(s, ctx,
+                                            NGX_STREAM_NGINXCRAFT_METRICS_DECLINED);
+
+    return ngx_stream_nginxcraft_disconnect(s, len == 1 ? &legacy->beta
+                                                        : &legacy->response);
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_legacy_wait(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx)
+{
+    ngx_event_t                 *ev;
+    ngx_connection_t            *c;
+    ngx_pool_cleanup_t          *cln;
+    ngx_stream_core_srv_conf_t  *cscf;
+
+    if (ctx->legacy_wait) {
+        return NGX_AGAIN;
+    }
+
+    c = s->connection;
+
+    ev = ngx_pcalloc(c->pool, sizeof(ngx_event_t));
+
+    if (ev == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_stream_nginxcraft_legacy_cleanup;
+    cln->data = ctx;
+
+    ev->handler = ngx_stream_nginxcraft_legacy_wait_handler;
+    ev->data = s;
+    ev->log = c->log;
+
+    ctx->legacy_wait = ev;
+
+    /* before the preread phase gives up on the session */
+
+    cscf = ngx_stream_get_module_srv_conf(s, ngx_stream_core_module);
+
+    ngx_add_timer(ev, ngx_min(NGX_STREAM_NGINXCRAFT_LEGACY_WAIT,
+                              cscf->preread_timeout / 2));
+
+    return NGX_AGAIN;
+}
+
+/* nothing more came, the ping is answered from the preread phase */
+static void
+ngx_stream_nginxcraft_legacy_wait_handler(ngx_event_t *ev)
+{
+    ngx_connection_t             *c;
+    ngx_stream_session_t         *s;
+    ngx_stream_nginxcraft_ctx_t  *ctx;
+
+    s = ev->data;
+    c = s->connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "nginxcraft legacy ping timed out");
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+    ctx->legacy_timedout = 1;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    ngx_stream_core_run_phases(s);
+}
+
+static void
+ngx_stream_nginxcraft_legacy_cleanup(void *data)
+{
+    ngx_stream_nginxcraft_ctx_t  *ctx = data;
+
+    if (ctx->legacy_wait->timer_set) {
+        ngx_del_timer(ctx->legacy_wait);
+    }
+}
+
+/* UTF-8 from the configuration to a kick packet */
+static ngx_int_t
+ngx_stream_nginxcraft_legacy_packet(ngx_pool_t *pool, u_char *text, size_t len,
+    ngx_str_t *packet)
+{
+    u_char      *p, *last;
+    uint32_t     ch;
+    ngx_uint_t   n;
+
+    packet->data = ngx_pnalloc(pool, 3 + 2 * NGX_STREAM_NGINXCRAFT_LEGACY_MAX_LEN);
+
+    if (packet->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = packet->data + 3;
+    last = text + len;
+    n = 0;
+
+    while (text < last) {
+        ch = ngx_utf8_decode(&text, last - text);
+
+        if (ch > 0x10ffff) {
+            return NGX_DECLINED;
+        }
+
+        if (ch > 0xffff) {
+            if (n + 2 > NGX_STREAM_NGINXCRAFT_LEGACY_MAX_LEN) {
+                return NGX_DECLINED;
+            }
+
+            /* surrogate pair */
+            ch -= 0x10000;
+            *p++ = (u_char) (0xd8 | (ch >> 18));
+            *p++ = (u_char) (ch >> 10);
+            *p++ = (u_char) (0xdc | ((ch >> 8) & 0x03));
+            *p++ = (u_char) ch;
+            n += 2;
+            continue;
+        }
+
+        if (n + 1 > NGX_STREAM_NGINXCRAFT_LEGACY_MAX_LEN) {
+            return NGX_DECLINED;
+        }
+
+        *p++ = (u_char) (ch >> 8);
+        *p++ = (u_char) ch;
+        n++;
+    }
+
+    packet->data[0] = NGX_STREAM_NGINXCRAFT_LEGACY_KICK;
+    packet->data[1] = (u_char) (n >> 8);
+    packet->data[2] = (u_char) n;
+    packet->len = p - packet->data;
+
+    return NGX_OK;
+}
+
+char *
+ngx_stream_nginxcraft_legacy_ping(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    u_char                          *p, *text, *slash;
+    ngx_int_t                        rc, protocol, online, max;
+    ngx_str_t                       *value, version;
+    ngx_uint_t                       i;
+    ngx_stream_nginxcraft_legacy_t  *legacy;
+
+    if (nscf->legacy != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    protocol = 127;
+    online = 0;
+    max = 20;
+    ngx_str_set(&version, "nginxcraft");
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "players=", 8) == 0) {
+            p = value[i].data + 8;
+            slash = ngx_strlchr(p, value[i].data + value[i].len, '/');
+
+            if (slash == NULL) {
+                goto invalid;
+            }
+
+            online = ngx_atoi(p, slash - p);
+            max = ngx_atoi(slash + 1, value[i].data + value[i].len - slash - 1);
+
+            if (online == NGX_ERROR || max == NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "version=", 8) == 0) {
+            version.data = value[i].data + 8;
+            version.len = value[i].len - 8;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "protocol=", 9) == 0) {
+            protocol = ngx_atoi(value[i].data + 9, value[i].len - 9);
+
+            if (protocol == NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    legacy = ngx_pcalloc(cf->pool, sizeof(ngx_stream_nginxcraft_legacy_t));
+
+    if (legacy == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    text = ngx_pnalloc(cf->pool, value[1].len + version.len + 4 * NGX_INT_T_LEN
+                                 + sizeof("\xc2\xa7" "1"));
+
+    if (text == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* fields separated by NUL, after a section sign and "1" */
+
+    p = ngx_sprintf(text, "\xc2\xa7" "1%Z%i%Z%V%Z%V%Z%i%Z%i",
+                    protocol, &version, &value[1], online, max);
+
+    rc = ngx_stream_nginxcraft_legacy_packet(cf->pool, text, p - text,
+                                             &legacy->response);
+
+    if (rc == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (rc == NGX_DECLINED) {
+        goto too_long;
+    }
+
+    /* before 1.4 only the description and the players, with section signs */
+
+    p = ngx_sprintf(text, "%V\xc2\xa7%i\xc2\xa7%i", &value[1], online, max);
+
+    rc = ngx_stream_nginxcraft_legacy_packet(cf->pool, text, p - text,
+                                             &legacy->beta);
+
+    if (rc == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (rc == NGX_DECLINED) {
+        goto too_long;
+    }
+
+    nscf->legacy = legacy;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+
+too_long:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "description \"%V\" is not valid UTF-8 or too long",
+                       &value[1]);
+
+    return NGX_CONF_ERROR;
+}
@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_legacy_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_LEGACY_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_LEGACY_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+struct ngx_stream_nginxcraft_legacy_s {
+    /* kick packets for 1.4 to 1.6 clients and for older ones */
+    ngx_str_t                    response;
+    ngx_str_t                    beta;
+};
+
+char *ngx_stream_nginxcraft_legacy_ping(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_stream_nginxcraft_legacy_handler(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx);
+
+#endif /* NGX_STREAM_NGINXCRAFT_LEGACY_MODULE_H */
@@ -0,0 +1,522 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_limit_module.c
+ *
+ * Token buckets in shared memory that limit server list pings and login
+ * attempts per client address, and optionally per $minecraft_server.
+ * Throttled sessions are answered from the preread phase and never reach
+ * an upstream.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_limit_module.h"
+#include "ngx_stream_nginxcraft_return_module.h"
+#include "ngx_stream_nginxcraft_status_module.h"
+#include "ngx_stream_nginxcraft_metrics_module.h"
+#include "minecraft_funcs.h"
+
+#define NGX_STREAM_NGINXCRAFT_LIMIT_PING    'p'
+#define NGX_STREAM_NGINXCRAFT_LIMIT_LOGIN   'l'
+
+/* kind, address and hostname */
+#define NGX_STREAM_NGINXCRAFT_LIMIT_KEY_LEN  (1 + NGX_SOCKADDR_STRLEN + NGX_STREAM_NGINXCRAFT_HOST_LEN)
+
+typedef struct {
+    ngx_rbtree_t                  rbtree;
+    ngx_rbtree_node_t             sentinel;
+    ngx_queue_t                   queue;
+} ngx_stream_nginxcraft_limit_shctx_t;
+
+typedef struct {
+    ngx_stream_nginxcraft_limit_shctx_t  *sh;
+    ngx_slab_pool_t                      *shpool;
+} ngx_stream_nginxcraft_limit_zone_t;
+
+typedef struct {
+    ngx_str_node_t     sn;
+    ngx_queue_t        queue;
+    ngx_msec_t         last;
+    /* 1000 times the number of requests over the rate */
+    ngx_uint_t         excess;
+    u_char             key[1];
+} ngx_stream_nginxcraft_limit_node_t;
+
+static ngx_int_t ngx_stream_nginxcraft_limit_lookup(
+    ngx_stream_nginxcraft_limit_t *limit, ngx_str_t *key, ngx_uint_t rate);
+static void ngx_stream_nginxcraft_limit_expire(
+    ngx_stream_nginxcraft_limit_zone_t *zone, ngx_uint_t n);
+static ngx_int_t ngx_stream_nginxcraft_limit_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_stream_nginxcraft_limit_rate(ngx_str_t *value);
+
+static ngx_str_t  ngx_stream_nginxcraft_limit_message =
+    ngx_string("{\"text\":\"Too many connection attempts, try again later\"}");
+
+ngx_int_t
+ngx_stream_nginxcraft_limit_handler(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx)
+{
+    u_char                            *p;
+    ngx_int_t                          rc;
+    ngx_str_t                          key;
+    ngx_uint_t                         rate, ping;
+    ngx_connection_t                  *c;
+    ngx_stream_nginxcraft_limit_t     *limit;
+    ngx_stream_nginxcraft_srv_conf_t  *nscf;
+    u_char                             buf[NGX_STREAM_NGINXCRAFT_LIMIT_KEY_LEN];
+
+    c = s->connection;
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+    limit = nscf->limit;
+
+    if (limit == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ping = (ctx->handshake.nextState == 1);
+    rate = ping ? limit->ping_rate : limit->login_rate;
+
+    if (rate == 0) {
+        return NGX_DECLINED;
+    }
+
+    p = buf;
+    *p++ = ping ? NGX_STREAM_NGINXCRAFT_LIMIT_PING
+                : NGX_STREAM_NGINXCRAFT_LIMIT_LOGIN;
+
+    switch (c->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        p = ngx_cpymem(p, ((struct sockaddr_in6 *) c->sockaddr)->sin6_addr.s6_addr, 16);
+        break;
+#endif
+
+    case AF_INET:
+        p = ngx_cpymem(p, &((struct sockaddr_in *) c->sockaddr)->sin_addr, 4);
+        break;
+
+    default:
+        p = ngx_cpymem(p, c->addr_text.data,
+                       ngx_min(c->addr_text.len, NGX_SOCKADDR_STRLEN));
+        break;
+    }
+
+    if (limit->per_server) {
+        ngx_strlow(p, ctx->host.data, ngx_min(ctx->host.len, NGX_STREAM_NGINXCRAFT_HOST_LEN));
+        p += ngx_min(ctx->host.len, NGX_STREAM_NGINXCRAFT_HOST_LEN);
+    }
+
+    key.data = buf;
+    key.len = p - buf;
+
+    rc = ngx_stream_nginxcraft_limit_lookup(limit, &key, rate);
+
+    if (rc != NGX_BUSY) {
+        return rc;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "limiting %s by zone \"%V\"", ping ? "pings" : "logins",
+                  &limit->shm_zone->shm.name);
+
+    ngx_stream_nginxcraft_metrics_reject(s, NGX_STREAM_NGINXCRAFT_METRICS_LIMIT);
+
+    if (!ping) {
+        return ngx_stream_nginxcraft_disconnect(s, &limit->disconnect);
+    }
+
+    rc = ngx_stream_nginxcraft_status_cached(s, ctx);
+
+    if (rc != NGX_DECLINED) {
+        return rc;
+    }
+
+    return ngx_stream_nginxcraft_status_respond(s, ctx, limit->status.data,
+                                                limit->status.len);
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_limit_lookup(ngx_stream_nginxcraft_limit_t *limit,
+    ngx_str_t *key, ngx_uint_t rate)
+{
+    size_t                               size;
+    uint32_t                             hash;
+    ngx_msec_t                           now;
+    ngx_int_t                            excess;
+    ngx_msec_int_t                       ms;
+    ngx_stream_nginxcraft_limit_node_t  *node;
+    ngx_stream_nginxcraft_limit_zone_t  *zone;
+
+    zone = limit->shm_zone->data;
+
+    hash = ngx_crc32_short(key->data, key->len);
+    now = ngx_current_msec;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    ngx_stream_nginxcraft_limit_expire(zone, 1);
+
+    node = (ngx_stream_nginxcraft_limit_node_t *)
+               ngx_str_rbtree_lookup(&zone->sh->rbtree, key, hash);
+
+    if (node) {
+        ngx_queue_remove(&node->queue);
+        ngx_queue_insert_head(&zone->sh->queue, &node->queue);
+
+        ms = (ngx_msec_int_t) (now - node->last);
+
+        if (ms < -60000) {
+            ms = 1;
+
+        } else if (ms < 0) {
+            ms = 0;
+        }
+
+        excess = node->excess - rate * ms / 1000 + 1000;
+
+        if (excess < 0) {
+            excess = 0;
+        }
+
+        if ((ngx_uint_t) excess > limit->burst) {
+            ngx_shmtx_unlock(&zone->shpool->mutex);
+            return NGX_BUSY;
+        }
+
+        node->excess = excess;
+        node->last = now;
+
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+
+        return NGX_DECLINED;
+    }
+
+    size = offsetof(ngx_stream_nginxcraft_limit_node_t, key) + key->len;
+
+    node = ngx_slab_alloc_locked(zone->shpool, size);
+
+    if (node == NULL) {
+        ngx_stream_nginxcraft_limit_expire(zone, 0);
+
+        node = ngx_slab_alloc_locked(zone->shpool, size);
+
+        if (node == NULL) {
+            ngx_shmtx_unlock(&zone->shpool->mutex);
+
+            /* fail open, a full zone must not lock every player out */
+            return NGX_DECLINED;
+        }
+    }
+
+    node->sn.node.key = hash;
+    node->sn.str.len = key->len;
+    node->sn.str.data = node->key;
+    node->last = now;
+    node->excess = 0;
+
+    ngx_memcpy(node->key, key->data, key->len);
+
+    ngx_rbtree_insert(&zone->sh->rbtree, &node->sn.node);
+    ngx_queue_insert_head(&zone->sh->queue, &node->queue);
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    return NGX_DECLINED;
+}
+
+/*
+ * n == 1 removes one or two buckets idle for a minute,
+ * n == 0 removes the oldest buckets to make room.
+ */
+static void
+ngx_stream_nginxcraft_limit_expire(ngx_stream_nginxcraft_limit_zone_t *zone,
+    ngx_uint_t n)
+{
+    ngx_msec_t                           now;
+    ngx_queue_t                         *q;
+    ngx_msec_int_t                       ms;
+    ngx_stream_nginxcraft_limit_node_t  *node;
+
+    now = ngx_current_msec;
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&zone->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&zone->sh->queue);
+
+        node = ngx_queue_data(q, ngx_stream_nginxcraft_limit_node_t, queue);
+
+        if (n++ != 0) {
+            ms = (ngx_msec_int_t) (now - node->last);
+            ms = ngx_abs(ms);
+
+            if (ms < 60000) {
+                return;
+            }
+        }
+
+        ngx_queue_remove(q);
+
+        ngx_rbtree_delete(&zone->sh->rbtree, &node->sn.node);
+
+        ngx_slab_free_locked(zone->shpool, node);
+    }
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_stream_nginxcraft_limit_zone_t  *ozone = data;
+
+    size_t                               len;
+    ngx_stream_nginxcraft_limit_zone_t  *zone;
+
+    zone = shm_zone->data;
+
+    if (ozone) {
+        zone->sh = ozone->sh;
+        zone->shpool = ozone->shpool;
+        return NGX_OK;
+    }
+
+    zone->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        zone->sh = zone->shpool->data;
+        return NGX_OK;
+    }
+
+    zone->sh = ngx_slab_alloc(zone->shpool,
+                              sizeof(ngx_stream_nginxcraft_limit_shctx_t));
+
+    if (zone->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    zone->shpool->data = zone->sh;
+
+    ngx_rbtree_init(&zone->sh->rbtree, &zone->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&zone->sh->queue);
+
+    len = sizeof(" in nginxcraft_limit_zone \"\"") + shm_zone->shm.name.len;
+
+    zone->shpool->log_ctx = ngx_slab_alloc(zone->shpool, len);
+
+    if (zone->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(zone->shpool->log_ctx, " in nginxcraft_limit_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+/* Parses "10r/s" or "10r/m" into requests per 1000 seconds. */
+static ngx_int_t
+ngx_stream_nginxcraft_limit_rate(ngx_str_t *value)
+{
+    size_t      len;
+    ngx_int_t   rate, scale;
+
+    len = value->len;
+    scale = 1;
+
+    if (len > 3 && ngx_strncmp(value->data + len - 3, "r/s", 3) == 0) {
+        len -= 3;
+
+    } else if (len > 3 && ngx_strncmp(value->data + len - 3, "r/m", 3) == 0) {
+        scale = 60;
+        len -= 3;
+    }
+
+    rate = ngx_atoi(value->data, len);
+
+    if (rate <= 0) {
+        return NGX_ERROR;
+    }
+
+    return rate * 1000 / scale;
+}
+
+char *
+ngx_stream_nginxcraft_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t    *nscf = conf;
+
+    size_t                               len;
+    ngx_int_t                            burst;
+    ngx_str_t                           *value, *zone, s, message, status;
+    ngx_uint_t                           i;
+    ngx_shm_zone_t                      *shm_zone;
+    ngx_stream_nginxcraft_limit_t       *limit;
+
+    if (nscf->limit != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        nscf->limit = NULL;
+        return NGX_CONF_OK;
+    }
+
+    limit = ngx_pcalloc(cf->pool, sizeof(ngx_stream_nginxcraft_limit_t));
+
+    if (limit == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    burst = 0;
+    message = ngx_stream_nginxcraft_limit_message;
+    zone = NULL;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            zone = &value[i];
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ping=", 5) == 0) {
+
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
+
+            burst = ngx_stream_nginxcraft_limit_rate(&s);
+
+            if (burst == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid rate \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            limit->ping_rate = burst;
+            burst = 0;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "login=", 6) == 0) {
+
+            s.data = value[i].data + 6;
+            s.len = value[i].len - 6;
+
+            burst = ngx_stream_nginxcraft_limit_rate(&s);
+
+            if (burst == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid rate \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            limit->login_rate = burst;
+            burst = 0;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "burst=", 6) == 0) {
+
+            burst = ngx_atoi(value[i].data + 6, value[i].len - 6);
+
+            if (burst < 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid burst value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            limit->burst = burst * 1000;
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "per_server") == 0) {
+            limit->per_server = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "message=", 8) == 0) {
+            message.data = value[i].data + 8;
+            message.len = value[i].len - 8;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (limit->ping_rate == 0 && limit->login_rate == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"ping\" or \"login\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    /* a throttled login is told why, a throttled ping sees it as the MOTD */
+
+    if (ngx_stream_nginxcraft_disconnect_packet(cf->pool, &message,
+                                                &limit->disconnect)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    len = sizeof("{\"version\":{\"name\":\"nginxcraft\",\"protocol\":-1},"
+                 "\"players\":{\"max\":0,\"online\":0},\"description\":}") - 1
+          + message.len;
+
+    status.data = ngx_pnalloc(cf->pool, len);
+
+    if (status.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    status.len = ngx_sprintf(status.data,
+                             "{\"version\":{\"name\":\"nginxcraft\",\"protocol\":-1},"
+                             "\"players\":{\"max\":0,\"online\":0},"
+                             "\"description\":%V}", &message)
+                 - status.data;
+
+    if (ngx_stream_nginxcraft_disconnect_packet(cf->pool, &status,
+                                                &limit->status)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_stream_nginxcraft_zone(cf, zone, 0,
+                   ngx_stream_nginxcraft_limit_init_zone,
+                   sizeof(ngx_stream_nginxcraft_limit_zone_t));
+
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    limit->shm_zone = shm_zone;
+    nscf->limit = limit;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_limit_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_LIMIT_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_LIMIT_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+struct ngx_stream_nginxcraft_limit_s {
+    ngx_shm_zone_t              *shm_zone;
+    /* requests per 1000 seconds, 0 if not limited */
+    ngx_uint_t                   ping_rate;
+    ngx_uint_t                   login_rate;
+    ngx_uint_t                   burst;
+    ngx_flag_t                   per_server;
+    ngx_str_t                    disconnect;
+    ngx_str_t                    status;
+};
+
+char *ngx_stream_nginxcraft_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_stream_nginxcraft_limit_handler(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx);
+
+#endif /* NGX_STREAM_NGINXCRAFT_LIMIT_MODULE_H */
@@ -0,0 +1,418 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_map_module.c
+ *
+ * Maps $minecraft_server to an upstream through a hash built from a file of
+ * "hostname upstream;" lines at configuration time. Hostnames may be exact
+ * or wildcards as in server_name ("*.example.com", ".example.com",
+ * "mc.example.*"). The result is available as $minecraft_upstream, where
+ * routes set at run time with nginxcraft_routes take precedence.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_map_module.h"
+#include "ngx_stream_nginxcraft_routes_module.h"
+#include "minecraft_funcs.h"
+
+typedef struct {
+    ngx_hash_keys_arrays_t        keys;
+    ngx_array_t                  *values_hash;
+    size_t                        elt_size;
+} ngx_stream_nginxcraft_map_conf_ctx_t;
+
+static char *ngx_stream_nginxcraft_map_entry(ngx_conf_t *cf,
+    ngx_command_t *dummy, void *conf);
+static int ngx_libc_cdecl ngx_stream_nginxcraft_map_cmp_dns_wildcards(
+    const void *one, const void *two);
+
+ngx_int_t
+ngx_stream_nginxcraft_upstream_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data)
+{
+    size_t                             len;
+    ngx_int_t                          rc;
+    ngx_str_t                          host, upstream;
+    ngx_uint_t                         key;
+    ngx_stream_nginxcraft_ctx_t       *ctx;
+    ngx_stream_nginxcraft_map_t       *map;
+    ngx_stream_variable_value_t       *value;
+    ngx_stream_nginxcraft_srv_conf_t  *nscf;
+    u_char                             low[NGX_STREAM_NGINXCRAFT_HOST_LEN];
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+    map = nscf->map;
+
+    if (map == NULL && nscf->routes == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+
+    value = NULL;
+
+    if (ctx != NULL && ctx->host.len) {
+        len = mc_host_length(ctx->host.data, ctx->host.len);
+
+        if (len && len <= NGX_STREAM_NGINXCRAFT_HOST_LEN) {
+            key = ngx_hash_strlow(low, ctx->host.data, len);
+
+            if (nscf->routes) {
+                host.len = len;
+                host.data = low;
+
+                rc = ngx_stream_nginxcraft_routes_lookup(nscf->routes,
+                                                         s->connection->pool,
+                                                         &host, &upstream);
+
+                if (rc == NGX_ERROR) {
+                    return NGX_ERROR;
+                }
+
+                if (rc == NGX_OK) {
+                    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                                   "nginxcraft route: \"%V\" \"%V\"",
+                                   &ctx->host, &upstream);
+
+                    v->len = upstream.len;
+                    v->data = upstream.data;
+                    v->valid = 1;
+                    v->no_cacheable = 0;
+                    v->not_found = 0;
+
+                    return NGX_OK;
+                }
+            }
+
+            if (map) {
+                value = ngx_hash_find_combined(&map->hash, key, low, len);
+            }
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                       "nginxcraft map: \"%V\" %s", &ctx->host,
+                       value ? "found" : "not found");
+    }
+
+    if (value == NULL && map) {
+        value = map->default_value;
+    }
+
+    if (value == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    *v = *value;
+
+    return NGX_OK;
+}
+
+char *
+ngx_stream_nginxcraft_map(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    char                                  *rv;
+    size_t                                 len;
+    ngx_str_t                             *value, file;
+    ngx_uint_t                             i;
+    ngx_conf_t                             save;
+    ngx_pool_t                            *pool;
+    ngx_hash_init_t                        hash;
+    ngx_stream_nginxcraft_map_t           *map;
+    ngx_stream_variable_value_t           *var;
+    ngx_stream_nginxcraft_map_conf_ctx_t   ctx;
+
+    if (nscf->map != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        nscf->map = NULL;
+        return NGX_CONF_OK;
+    }
+
+    map = ngx_pcalloc(cf->pool, sizeof(ngx_stream_nginxcraft_map_t));
+
+    if (map == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "default=", 8) == 0) {
+            len = value[i].len - 8;
+
+            var = ngx_pcalloc(cf->pool, sizeof(ngx_stream_variable_value_t));
+
+            if (var == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            var->len = len;
+            var->data = value[i].data + 8;
+            var->valid = 1;
+
+            map->default_value = var;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    file = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &file, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cf->log);
+
+    if (pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ctx.keys.pool = cf->pool;
+    ctx.keys.temp_pool = pool;
+
+    if (ngx_hash_keys_array_init(&ctx.keys, NGX_HASH_LARGE) != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx.values_hash = ngx_pcalloc(pool, sizeof(ngx_array_t) * ctx.keys.hsize);
+
+    if (ctx.values_hash == NULL) {
+        ngx_destroy_pool(pool);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx.elt_size = 0;
+
+    save = *cf;
+    cf->pool = pool;
+    cf->ctx = &ctx;
+    cf->handler = ngx_stream_nginxcraft_map_entry;
+    cf->handler_conf = conf;
+
+    rv = ngx_conf_parse(cf, &file);
+
+    *cf = save;
+
+    if (rv != NGX_CONF_OK) {
+        ngx_destroy_pool(pool);
+        return rv;
+    }
+
+    /*
+     * Size the hash for the file instead of adding *_hash_max_size and
+     * *_hash_bucket_size directives: a bucket must fit the longest name
+     * and the table may need to grow well past the usual 2048 entries.
+     */
+
+    hash.key = ngx_hash_key_lc;
+    hash.max_size = ngx_max(4 * ctx.keys.keys.nelts, 2048);
+    hash.bucket_size = ngx_align(ngx_max(ctx.elt_size + sizeof(void *), 64),
+                                 ngx_cacheline_size);
+    hash.name = "nginxcraft_map_hash";
+    hash.pool = cf->pool;
+
+    if (ctx.keys.keys.nelts) {
+        hash.hash = &map->hash.hash;
+        hash.temp_pool = NULL;
+
+        if (ngx_hash_init(&hash, ctx.keys.keys.elts, ctx.keys.keys.nelts)
+            != NGX_OK)
+        {
+            ngx_destroy_pool(pool);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (ctx.keys.dns_wc_head.nelts) {
+
+        ngx_qsort(ctx.keys.dns_wc_head.elts,
+                  (size_t) ctx.keys.dns_wc_head.nelts,
+                  sizeof(ngx_hash_key_t),
+                  ngx_stream_nginxcraft_map_cmp_dns_wildcards);
+
+        hash.hash = NULL;
+        hash.temp_pool = pool;
+
+        if (ngx_hash_wildcard_init(&hash, ctx.keys.dns_wc_head.elts,
+                                   ctx.keys.dns_wc_head.nelts)
+            != NGX_OK)
+        {
+            ngx_destroy_pool(pool);
+            return NGX_CONF_ERROR;
+        }
+
+        map->hash.wc_head = (ngx_hash_wildcard_t *) hash.hash;
+    }
+
+    if (ctx.keys.dns_wc_tail.nelts) {
+
+        ngx_qsort(ctx.keys.dns_wc_tail.elts,
+                  (size_t) ctx.keys.dns_wc_tail.nelts,
+                  sizeof(ngx_hash_key_t),
+                  ngx_stream_nginxcraft_map_cmp_dns_wildcards);
+
+        hash.hash = NULL;
+        hash.temp_pool = pool;
+
+        if (ngx_hash_wildcard_init(&hash, ctx.keys.dns_wc_tail.elts,
+                                   ctx.keys.dns_wc_tail.nelts)
+            != NGX_OK)
+        {
+            ngx_destroy_pool(pool);
+            return NGX_CONF_ERROR;
+        }
+
+        map->hash.wc_tail = (ngx_hash_wildcard_t *) hash.hash;
+    }
+
+    ngx_destroy_pool(pool);
+
+    nscf->map = map;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_stream_nginxcraft_map_entry(ngx_conf_t *cf, ngx_command_t *dummy,
+    void *conf)
+{
+    ngx_int_t                              rc;
+    ngx_str_t                             *value, name;
+    ngx_uint_t                             i, key;
+    ngx_stream_variable_value_t           *var, **vp;
+    ngx_stream_nginxcraft_map_conf_ctx_t  *ctx;
+
+    ctx = cf->ctx;
+
+    if (cf->args->nelts != 2) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of the map parameters");
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    name = value[0];
+
+    /* handshakes are matched without the trailing dot, so are the keys */
+
+    if (name.len > 1 && name.data[name.len - 1] == '.') {
+        name.len--;
+    }
+
+    if (name.len == 0 || name.len > NGX_STREAM_NGINXCRAFT_HOST_LEN) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid hostname \"%V\"", &value[0]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* upstreams are shared by all the hostnames naming them */
+
+    key = 0;
+
+    for (i = 0; i < value[1].len; i++) {
+        key = ngx_hash(key, value[1].data[i]);
+    }
+
+    key %= ctx->keys.hsize;
+
+    vp = ctx->values_hash[key].elts;
+
+    if (vp) {
+        for (i = 0; i < ctx->values_hash[key].nelts; i++) {
+
+            if (vp[i]->len != value[1].len) {
+                continue;
+            }
+
+            if (ngx_strncmp(value[1].data, vp[i]->data, value[1].len) == 0) {
+                var = vp[i];
+                goto found;
+            }
+        }
+
+    } else {
+        if (ngx_array_init(&ctx->values_hash[key], cf->pool, 4,
+                           sizeof(ngx_stream_variable_value_t *))
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    var = ngx_palloc(ctx->keys.pool, sizeof(ngx_stream_variable_value_t));
+
+    if (var == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    var->len = value[1].len;
+    var->data = ngx_pstrdup(ctx->keys.pool, &value[1]);
+
+    if (var->data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    var->valid = 1;
+    var->no_cacheable = 0;
+    var->not_found = 0;
+
+    vp = ngx_array_push(&ctx->values_hash[key]);
+
+    if (vp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *vp = var;
+
+found:
+
+    rc = ngx_hash_add_key(&ctx->keys, &name, var, NGX_HASH_WILDCARD_KEY);
+
+    if (rc == NGX_OK) {
+        ctx->elt_size = ngx_max(ctx->elt_size,
+                                sizeof(void *)
+                                + ngx_align(name.len + 2, sizeof(void *)));
+        return NGX_CONF_OK;
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid hostname or wildcard \"%V\"", &value[0]);
+    }
+
+    if (rc == NGX_BUSY) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "conflicting hostname \"%V\"", &value[0]);
+    }
+
+    return NGX_CONF_ERROR;
+}
+
+static int ngx_libc_cdecl
+ngx_stream_nginxcraft_map_cmp_dns_wildcards(const void *one, const void *two)
+{
+    ngx_hash_key_t  *first, *second;
+
+    first = (ngx_hash_key_t *) one;
+    second = (ngx_hash_key_t *) two;
+
+    return ngx_dns_strcmp(first->key.data, second->key.data);
+}
@@ -0,0 +1,26 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_map_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_MAP_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_MAP_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+struct ngx_stream_nginxcraft_map_s {
+    ngx_hash_combined_t           hash;
+    ngx_stream_variable_value_t  *default_value;
+};
+
+char *ngx_stream_nginxcraft_map(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_stream_nginxcraft_upstream_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data);
+
+#endif /* NGX_STREAM_NGINXCRAFT_MAP_MODULE_H */
@@ -0,0 +1,795 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_metrics_module.c
+ *
+ * Session counters in shared memory: handshake results, pings and logins,
+ * sessions per $minecraft_server and per protocol version, sessions
+ * answered by nginx itself and a histogram of the preread time. Served in
+ * the Prometheus text format or as JSON by nginxcraft_metrics.
+ *
+ * Each worker counts into its own cache lines, the hostname and version
+ * tables are shared and filled in without a lock.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_metrics_module.h"
+#include "ngx_stream_nginxcraft_return_module.h"
+
+#define NGX_STREAM_NGINXCRAFT_METRICS_PROMETHEUS  1
+#define NGX_STREAM_NGINXCRAFT_METRICS_JSON        2
+
+/* slots looked at before a name or version is counted as other */
+#define NGX_STREAM_NGINXCRAFT_METRICS_PROBES      16
+
+/* room for the HTTP response header in front of the body */
+#define NGX_STREAM_NGINXCRAFT_METRICS_HEADER      128
+
+/* a line, with the longest value */
+#define NGX_STREAM_NGINXCRAFT_METRICS_LINE                                    \
+    (sizeof("nginxcraft_server_sessions_total{server=\"\"} ") - 1             \
+     + NGX_STREAM_NGINXCRAFT_METRICS_NAME_LEN + NGX_ATOMIC_T_LEN + 1)
+
+typedef struct {
+    ngx_atomic_uint_t   handshakes[3];
+    ngx_atomic_uint_t   intents[4];
+    ngx_atomic_uint_t   rejects[5];
+    ngx_atomic_uint_t   preread[NGX_STREAM_NGINXCRAFT_METRICS_BUCKETS];
+    ngx_atomic_uint_t   preread_sum;
+} ngx_stream_nginxcraft_metrics_totals_t;
+
+static ngx_stream_nginxcraft_metrics_worker_t *ngx_stream_nginxcraft_metrics_worker(
+    ngx_stream_session_t *s);
+static ngx_atomic_t *ngx_stream_nginxcraft_metrics_server(
+    ngx_stream_nginxcraft_metrics_sh_t *sh, ngx_str_t *host);
+static ngx_atomic_t *ngx_stream_nginxcraft_metrics_version(
+    ngx_stream_nginxcraft_metrics_sh_t *sh, int32_t protocol);
+static void ngx_stream_nginxcraft_metrics_cleanup(void *data);
+static void ngx_stream_nginxcraft_metrics_handler(ngx_stream_session_t *s);
+static u_char *ngx_stream_nginxcraft_metrics_prometheus(u_char *p,
+    ngx_stream_nginxcraft_metrics_sh_t *sh,
+    ngx_stream_nginxcraft_metrics_totals_t *t);
+static u_char *ngx_stream_nginxcraft_metrics_json(u_char *p,
+    ngx_stream_nginxcraft_metrics_sh_t *sh,
+    ngx_stream_nginxcraft_metrics_totals_t *t);
+static ngx_int_t ngx_stream_nginxcraft_metrics_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+/* upper bounds of the preread histogram buckets, the last one is +Inf */
+static ngx_msec_t  ngx_stream_nginxcraft_metrics_bounds[] = {
+    1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000
+};
+
+static char  *ngx_stream_nginxcraft_metrics_results[] = {
+    "parsed", "declined", "error"
+};
+
+static char  *ngx_stream_nginxcraft_metrics_intents[] = {
+    "status", "login", "transfer", "other"
+};
+
+static char  *ngx_stream_nginxcraft_metrics_reasons[] = {
+    "return", "limit", "version", "guard", "queue"
+};
+
+static ngx_stream_nginxcraft_metrics_worker_t *
+ngx_stream_nginxcraft_metrics_worker(ngx_stream_session_t *s)
+{
+    ngx_stream_nginxcraft_metrics_t    *metrics;
+    ngx_stream_nginxcraft_metrics_sh_t *sh;
+    ngx_stream_nginxcraft_main_conf_t  *nmcf;
+
+    nmcf = ngx_stream_get_module_main_conf(s, ngx_stream_nginxcraft_module);
+    metrics = nmcf->metrics;
+
+    if (metrics == NULL) {
+        return NULL;
+    }
+
+    sh = metrics->sh;
+
+    /* workers beyond the slots there are after a reload share them */
+
+    return (ngx_stream_nginxcraft_metrics_worker_t *)
+           (sh->workers + (ngx_worker % sh->nworkers) * sh->worker_size);
+}
+
+/*
+ * Sessions closed before the handshake was complete, by the preread
+ * timeout or by the client, are counted as errors when the pool goes.
+ */
+void
+ngx_stream_nginxcraft_metrics_session(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx)
+{
+    ngx_pool_cleanup_t                 *cln;
+    ngx_stream_nginxcraft_main_conf_t  *nmcf;
+
+    nmcf = ngx_stream_get_module_main_conf(s, ngx_stream_nginxcraft_module);
+
+    if (nmcf->metrics == NULL) {
+        return;
+    }
+
+    cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+
+    if (cln == NULL) {
+        return;
+    }
+
+    cln->handler = ngx_stream_nginxcraft_metrics_cleanup;
+    cln->data = s;
+}
+
+static void
+ngx_stream_nginxcraft_metrics_cleanup(void *data)
+{
+    ngx_stream_session_t  *s = data;
+
+    ngx_stream_nginxcraft_ctx_t  *ctx;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+
+    if (!ctx->metrics_done) {
+        ngx_stream_nginxcraft_metrics_handshake(s, ctx,
+                                                NGX_STREAM_NGINXCRAFT_METRICS_ERROR);
+    }
+}
+
+void
+ngx_stream_nginxcraft_metrics_handshake(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx, ngx_uint_t result)
+{
+    ngx_uint_t                               i, intent;
+    ngx_msec_t                               ms;
+    ngx_atomic_t                            *count;
+    ngx_stream_nginxcraft_metrics_sh_t      *sh;
+    ngx_stream_nginxcraft_main_conf_t       *nmcf;
+    ngx_stream_nginxcraft_metrics_worker_t  *w;
+
+    /* without a context when dropped before one was allocated */
+
+    if (ctx) {
+        if (ctx->metrics_done) {
+            return;
+        }
+
+        ctx->metrics_done = 1;
+    }
+
+    w = ngx_stream_nginxcraft_metrics_worker(s);
+
+    if (w == NULL) {
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&w->handshakes[result], 1);
+
+    if (result != NGX_STREAM_NGINXCRAFT_METRICS_PARSED) {
+        return;
+    }
+
+    switch (ctx->handshake.nextState) {
+    case 1:
+        intent = 0;
+        break;
+    case 2:
+        intent = 1;
+        break;
+    case 3:
+        intent = 2;
+        break;
+    default:
+        intent = 3;
+    }
+
+    (void) ngx_atomic_fetch_add(&w->intents[intent], 1);
+
+    ms = ngx_current_msec - ctx->start;
+
+    for (i = 0; i < NGX_STREAM_NGINXCRAFT_METRICS_BUCKETS - 1; i++) {
+        if (ms <= ngx_stream_nginxcraft_metrics_bounds[i]) {
+            break;
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&w->preread[i], 1);
+    (void) ngx_atomic_fetch_add(&w->preread_sum, ms);
+
+    nmcf = ngx_stream_get_module_main_conf(s, ngx_stream_nginxcraft_module);
+    sh = nmcf->metrics->sh;
+
+    count = ngx_stream_nginxcraft_metrics_server(sh, &ctx->host);
+    (void) ngx_atomic_fetch_add(count, 1);
+
+    count = ngx_stream_nginxcraft_metrics_version(sh, ctx->handshake.protocolVersion);
+    (void) ngx_atomic_fetch_add(count, 1);
+}
+
+void
+ngx_stream_nginxcraft_metrics_reject(ngx_stream_session_t *s, ngx_uint_t reason)
+{
+    ngx_stream_nginxcraft_metrics_worker_t  *w;
+
+    w = ngx_stream_nginxcraft_metrics_worker(s);
+
+    if (w != NULL) {
+        (void) ngx_atomic_fetch_add(&w->rejects[reason], 1);
+    }
+}
+
+/*
+ * Finds or claims the slot of a hostname. Names are kept to the characters
+ * of a DNS name so they can be printed as they are, anything else and names
+ * that find no free slot are counted together.
+ */
+static ngx_atomic_t *
+ngx_stream_nginxcraft_metrics_server(ngx_stream_nginxcraft_metrics_sh_t *sh,
+    ngx_str_t *host)
+{
+    u_char                                   ch;
+    size_t                                   i, len;
+    ngx_uint_t                               n;
+    ngx_atomic_uint_t                        hash;
+    ngx_stream_nginxcraft_metrics_server_t  *slot;
+    u_char                                   low[NGX_STREAM_NGINXCRAFT_METRICS_NAME_LEN];
+
+    len = host->len;
+
+    if (len == 0 || len > NGX_STREAM_NGINXCRAFT_METRICS_NAME_LEN) {
+        return &sh->servers_other;
+    }
+
+    for (i = 0; i < len; i++) {
+        ch = ngx_tolower(host->data[i]);
+
+        if ((ch < 'a' || ch > 'z') && (ch < '0' || ch > '9')
+            && ch != '.' && ch != '-' && ch != '_')
+        {
+            return &sh->servers_other;
+        }
+
+        low[i] = ch;
+    }
+
+    hash = ngx_crc32_short(low, len) | 1;
+
+    for (n = 0; n < NGX_STREAM_NGINXCRAFT_METRICS_PROBES; n++) {
+        slot = &sh->servers[(hash + n) & (sh->nservers - 1)];
+
+        if (slot->hash == 0) {
+            if (!ngx_atomic_cmp_set(&slot->hash, 0, hash)) {
+                /* another worker took it, look at what it put there */
+                n--;
+                continue;
+            }
+
+            slot->len = len;
+            ngx_memcpy(slot->name, low, len);
+
+            ngx_memory_barrier();
+
+            slot->ready = 1;
+
+            return &slot->count;
+        }
+
+        if (slot->hash != hash) {
+            continue;
+        }
+
+        /* still being written, almost certainly the same name */
+
+        if (!slot->ready) {
+            return &slot->count;
+        }
+
+        if (slot->len == len && ngx_memcmp(slot->name, low, len) == 0) {
+            return &slot->count;
+        }
+    }
+
+    return &sh->servers_other;
+}
+
+static ngx_atomic_t *
+ngx_stream_nginxcraft_metrics_version(ngx_stream_nginxcraft_metrics_sh_t *sh,
+    int32_t protocol)
+{
+    ngx_uint_t                                n;
+    ngx_atomic_uint_t                         key;
+    ngx_stream_nginxcraft_metrics_version_t  *slot;
+
+    key = (ngx_atomic_uint_t) (uint32_t) protocol + 1;
+
+    if (key == 0) {
+        return &sh->versions_other;
+    }
+
+    for (n = 0; n < NGX_STREAM_NGINXCRAFT_METRICS_PROBES; n++) {
+        slot = &sh->versions[(key + n) % NGX_STREAM_NGINXCRAFT_METRICS_VERSIONS];
+
+        if (slot->key == key) {
+            return &slot->count;
+        }
+
+        if (slot->key == 0) {
+            if (ngx_atomic_cmp_set(&slot->key, 0, key)) {
+                return &slot->count;
+            }
+
+            n--;
+        }
+    }
+
+    return &sh->versions_other;
+}
+
+static void
+ngx_stream_nginxcraft_metrics_handler(ngx_stream_session_t *s)
+{
+    u_char                                  *p, *body;
+    size_t                                   len;
+    ngx_str_t                                packet;
+    ngx_uint_t                               i, j;
+    ngx_connection_t                        *c;
+    ngx_stream_nginxcraft_metrics_t         *metrics;
+    ngx_stream_nginxcraft_metrics_sh_t      *sh;
+    ngx_stream_nginxcraft_srv_conf_t        *nscf;
+    ngx_stream_nginxcraft_main_conf_t       *nmcf;
+    ngx_stream_nginxcraft_metrics_worker_t  *w;
+    ngx_stream_nginxcraft_metrics_totals_t   t;
+    u_char                                   header[NGX_STREAM_NGINXCRAFT_METRICS_HEADER];
+
+    c = s->connection;
+
+    c->log->action = "sending metrics";
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+    nmcf = ngx_stream_get_module_main_conf(s, ngx_stream_nginxcraft_module);
+
+    metrics = nmcf->metrics;
+    sh = metrics->sh;
+
+    ngx_memzero(&t, sizeof(ngx_stream_nginxcraft_metrics_totals_t));
+
+    for (i = 0; i < sh->nworkers; i++) {
+        w = (ngx_stream_nginxcraft_metrics_worker_t *)
+            (sh->workers + i * sh->worker_size);
+
+        for (j = 0; j < 3; j++) {
+            t.handshakes[j] += w->handshakes[j];
+        }
+
+        for (j = 0; j < 4; j++) {
+            t.intents[j] += w->intents[j];
+        }
+
+        for (j = 0; j < 5; j++) {
+            t.rejects[j] += w->rejects[j];
+        }
+
+        for (j = 0; j < NGX_STREAM_NGINXCRAFT_METRICS_BUCKETS; j++) {
+            t.preread[j] += w->preread[j];
+        }
+
+        t.preread_sum += w->preread_sum;
+    }
+
+    len = NGX_STREAM_NGINXCRAFT_METRICS_HEADER + 4096
+          + (sh->nservers + NGX_STREAM_NGINXCRAFT_METRICS_VERSIONS + 1)
+            * NGX_STREAM_NGINXCRAFT_METRICS_LINE;
+
+    p = ngx_pnalloc(c->pool, len);
+
+    if (p == NULL) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    body = p + NGX_STREAM_NGINXCRAFT_METRICS_HEADER;
+
+    if (nscf->metrics == NGX_STREAM_NGINXCRAFT_METRICS_JSON) {
+        p = ngx_stream_nginxcraft_metrics_json(body, sh, &t);
+
+    } else {
+        p = ngx_stream_nginxcraft_metrics_prometheus(body, sh, &t);
+    }
+
+    /* scrapers speak HTTP, the request itself is not looked at */
+
+    len = ngx_sprintf(header, "HTTP/1.0 200 OK" CRLF
+                      "Content-Type: %s" CRLF
+                      "Content-Length: %uz" CRLF
+                      "Connection: close" CRLF CRLF,
+                      nscf->metrics == NGX_STREAM_NGINXCRAFT_METRICS_JSON
+                      ? "application/json"
+                      : "text/plain; version=0.0.4",
+                      (size_t) (p - body))
+          - header;
+
+    packet.data = ngx_cpymem(body - len, header, len) - len;
+    packet.len = p - packet.data;
+
+    if (ngx_stream_nginxcraft_disconnect(s, &packet) != NGX_DONE) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+    }
+}
+
+static u_char *
+ngx_stream_nginxcraft_metrics_prometheus(u_char *p,
+    ngx_stream_nginxcraft_metrics_sh_t *sh,
+    ngx_stream_nginxcraft_metrics_totals_t *t)
+{
+    ngx_uint_t                                i;
+    ngx_atomic_uint_t                         count;
+    ngx_stream_nginxcraft_metrics_server_t   *server;
+    ngx_stream_nginxcraft_metrics_version_t  *version;
+
+    p = ngx_sprintf(p, "# HELP nginxcraft_handshakes_total "
+                       "Sessions by handshake parse result.\n"
+                       "# TYPE nginxcraft_handshakes_total counter\n");
+
+    for (i = 0; i < 3; i++) {
+        p = ngx_sprintf(p, "nginxcraft_handshakes_total{result=\"%s\"} %uA\n",
+                        ngx_stream_nginxcraft_metrics_results[i],
+                        t->handshakes[i]);
+    }
+
+    p = ngx_sprintf(p, "# HELP nginxcraft_sessions_total "
+                       "Handshakes by next state.\n"
+                       "# TYPE nginxcraft_sessions_total counter\n");
+
+    for (i = 0; i < 4; i++) {
+        p = ngx_sprintf(p, "nginxcraft_sessions_total{intent=\"%s\"} %uA\n",
+                        ngx_stream_nginxcraft_metrics_intents[i],
+                        t->intents[i]);
+    }
+
+    p = ngx_sprintf(p, "# HELP nginxcraft_rejects_total "
+                       "Sessions answered by nginx instead of an upstream.\n"
+                       "# TYPE nginxcraft_rejects_total counter\n");
+
+    for (i = 0; i < 5; i++) {
+        p = ngx_sprintf(p, "nginxcraft_rejects_total{reason=\"%s\"} %uA\n",
+                        ngx_stream_nginxcraft_metrics_reasons[i],
+                        t->rejects[i]);
+    }
+
+    p = ngx_sprintf(p, "# HELP nginxcraft_server_sessions_total "
+                       "Handshakes by $minecraft_server.\n"
+                       "# TYPE nginxcraft_server_sessions_total counter\n");
+
+    for (i = 0; i < sh->nservers; i++) {
+        server = &sh->servers[i];
+
+        if (!server->ready) {
+            continue;
+        }
+
+        p = ngx_sprintf(p, "nginxcraft_server_sessions_total{server=\"%*s\"} %uA\n",
+                        server->len, server->name, server->count);
+    }
+
+    p = ngx_sprintf(p, "nginxcraft_server_sessions_total{server=\"_other\"} %uA\n",
+                    sh->servers_other);
+
+    p = ngx_sprintf(p, "# HELP nginxcraft_protocol_sessions_total "
+                       "Handshakes by protocol version.\n"
+                       "# TYPE nginxcraft_protocol_sessions_total counter\n");
+
+    for (i = 0; i < NGX_STREAM_NGINXCRAFT_METRICS_VERSIONS; i++) {
+        version = &sh->versions[i];
+
+        if (version->key == 0) {
+            continue;
+        }
+
+        p = ngx_sprintf(p, "nginxcraft_protocol_sessions_total{protocol=\"%D\"} %uA\n",
+                        (int32_t) (uint32_t) (version->key - 1), version->count);
+    }
+
+    p = ngx_sprintf(p, "nginxcraft_protocol_sessions_total{protocol=\"_other\"} %uA\n",
+                    sh->versions_other);
+
+    p = ngx_sprintf(p, "# HELP nginxcraft_preread_seconds "
+                       "Time from accept to a complete handshake.\n"
+                       "# TYPE nginxcraft_preread_seconds histogram\n");
+
+    count = 0;
+
+    for (i = 0; i < NGX_STREAM_NGINXCRAFT_METRICS_BUCKETS - 1; i++) {
+        count += t->preread[i];
+
+        p = ngx_sprintf(p, "nginxcraft_preread_seconds_bucket{le=\"%M.%03M\"} %uA\n",
+                        ngx_stream_nginxcraft_metrics_bounds[i] / 1000,
+                        ngx_stream_nginxcraft_metrics_bounds[i] % 1000, count);
+    }
+
+    count += t->preread[i];
+
+    p = ngx_sprintf(p, "nginxcraft_preread_seconds_bucket{le=\"+Inf\"} %uA\n"
+                       "nginxcraft_preread_seconds_sum %uA.%03uA\n"
+                       "nginxcraft_preread_seconds_count %uA\n",
+                    count, t->preread_sum / 1000, t->preread_sum % 1000, count);
+
+    return p;
+}
+
+static u_char *
+ngx_stream_nginxcraft_metrics_json(u_char *p,
+    ngx_stream_nginxcraft_metrics_sh_t *sh,
+    ngx_stream_nginxcraft_metrics_totals_t *t)
+{
+    ngx_uint_t                                i;
+    ngx_atomic_uint_t                         count;
+    ngx_stream_nginxcraft_metrics_server_t   *server;
+    ngx_stream_nginxcraft_metrics_version_t  *version;
+
+    p = ngx_sprintf(p, "{\"handshakes\":{");
+
+    for (i = 0; i < 3; i++) {
+        p = ngx_sprintf(p, "%s\"%s\":%uA", i ? "," : "",
+                        ngx_stream_nginxcraft_metrics_results[i],
+                        t->handshakes[i]);
+    }
+
+    p = ngx_sprintf(p, "},\"sessions\":{");
+
+    for (i = 0; i < 4; i++) {
+        p = ngx_sprintf(p, "%s\"%s\":%uA", i ? "," : "",
+                        ngx_stream_nginxcraft_metrics_intents[i],
+                        t->intents[i]);
+    }
+
+    p = ngx_sprintf(p, "},\"rejects\":{");
+
+    for (i = 0; i < 5; i++) {
+        p = ngx_sprintf(p, "%s\"%s\":%uA", i ? "," : "",
+                        ngx_stream_nginxcraft_metrics_reasons[i],
+                        t->rejects[i]);
+    }
+
+    p = ngx_sprintf(p, "},\"servers\":{");
+
+    for (i = 0; i < sh->nservers; i++) {
+        server = &sh->servers[i];
+
+        if (server->ready) {
+            p = ngx_sprintf(p, "\"%*s\":%uA,", server->len, server->name,
+                            server->count);
+        }
+    }
+
+    p = ngx_sprintf(p, "\"_other\":%uA},\"protocols\":{", sh->servers_other);
+
+    for (i = 0; i < NGX_STREAM_NGINXCRAFT_METRICS_VERSIONS; i++) {
+        version = &sh->versions[i];
+
+        if (version->key) {
+            p = ngx_sprintf(p, "\"%D\":%uA,",
+                            (int32_t) (uint32_t) (version->key - 1),
+                            version->count);
+        }
+    }
+
+    p = ngx_sprintf(p, "\"_other\":%uA},\"preread_ms\":{\"buckets\":{",
+                    sh->versions_other);
+
+    count = 0;
+
+    for (i = 0; i < NGX_STREAM_NGINXCRAFT_METRICS_BUCKETS - 1; i++) {
+        count += t->preread[i];
+
+        p = ngx_sprintf(p, "\"%M\":%uA,",
+                        ngx_stream_nginxcraft_metrics_bounds[i], count);
+    }
+
+    count += t->preread[i];
+
+    p = ngx_sprintf(p, "\"+Inf\":%uA},\"sum\":%uA,\"count\":%uA}}\n",
+                    count, t->preread_sum, count);
+
+    return p;
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_metrics_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_stream_nginxcraft_metrics_t  *ometrics = data;
+
+    u_char                              *p;
+    size_t                               len;
+    ngx_core_conf_t                     *ccf;
+    ngx_stream_nginxcraft_metrics_t     *metrics;
+    ngx_stream_nginxcraft_metrics_sh_t  *sh;
+
+    metrics = shm_zone->data;
+
+    if (ometrics) {
+        metrics->sh = ometrics->sh;
+        metrics->shpool = ometrics->shpool;
+        return NGX_OK;
+    }
+
+    metrics->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        metrics->sh = metrics->shpool->data;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_calloc(metrics->shpool, sizeof(ngx_stream_nginxcraft_metrics_sh_t));
+
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    metrics->shpool->data = sh;
+    metrics->sh = sh;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(metrics->cycle->conf_ctx,
+                                           ngx_core_module);
+
+    sh->nworkers = ngx_max(ccf->worker_processes, 1);
+    sh->worker_size = ngx_align(sizeof(ngx_stream_nginxcraft_metrics_worker_t),
+                                ngx_cacheline_size);
+
+    p = ngx_slab_calloc(metrics->shpool,
+                        sh->nworkers * sh->worker_size + ngx_cacheline_size);
+
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    sh->workers = ngx_align_ptr(p, ngx_cacheline_size);
+
+    /* a quarter of the zone for hostnames, in a power of two slots */
+
+    len = shm_zone->shm.size / 4 / sizeof(ngx_stream_nginxcraft_metrics_server_t);
+
+    for (sh->nservers = 16; sh->nservers * 2 <= len; sh->nservers *= 2) {
+        /* void */
+    }
+
+    sh->servers = ngx_slab_calloc(metrics->shpool,
+                      sh->nservers * sizeof(ngx_stream_nginxcraft_metrics_server_t));
+
+    if (sh->servers == NULL) {
+        return NGX_ERROR;
+    }
+
+    len = sizeof(" in nginxcraft_metrics_zone \"\"") + shm_zone->shm.name.len;
+
+    metrics->shpool->log_ctx = ngx_slab_alloc(metrics->shpool, len);
+
+    if (metrics->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(metrics->shpool->log_ctx, " in nginxcraft_metrics_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+char *
+ngx_stream_nginxcraft_metrics_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_main_conf_t  *nmcf = conf;
+
+    u_char                           *p;
+    ssize_t                           size;
+    ngx_str_t                        *value, name, s;
+    ngx_shm_zone_t                   *shm_zone;
+    ngx_stream_nginxcraft_metrics_t  *metrics;
+
+    if (nmcf->metrics) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    name = value[1];
+
+    p = (u_char *) ngx_strchr(name.data, ':');
+
+    if (p == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\", size is required", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = p - name.data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR || name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    metrics = ngx_pcalloc(cf->pool, sizeof(ngx_stream_nginxcraft_metrics_t));
+
+    if (metrics == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_stream_nginxcraft_module);
+
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is already used", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the number of workers is only known once the whole file is read */
+    metrics->cycle = cf->cycle;
+    metrics->shm_zone = shm_zone;
+
+    shm_zone->init = ngx_stream_nginxcraft_metrics_init_zone;
+    shm_zone->data = metrics;
+
+    nmcf->metrics = metrics;
+
+    return NGX_CONF_OK;
+}
+
+char *
+ngx_stream_nginxcraft_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    ngx_str_t                          *value;
+    ngx_stream_core_srv_conf_t         *cscf;
+    ngx_stream_nginxcraft_main_conf_t  *nmcf;
+
+    if (nscf->metrics) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 1
+        || ngx_strcmp(value[1].data, "prometheus") == 0)
+    {
+        nscf->metrics = NGX_STREAM_NGINXCRAFT_METRICS_PROMETHEUS;
+
+    } else if (ngx_strcmp(value[1].data, "json") == 0) {
+        nscf->metrics = NGX_STREAM_NGINXCRAFT_METRICS_JSON;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid format \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    nmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_nginxcraft_module);
+    nmcf->metrics_used = 1;
+
+    cscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_core_module);
+
+    cscf->handler = ngx_stream_nginxcraft_metrics_handler;
+
+    return NGX_CONF_OK;
+}
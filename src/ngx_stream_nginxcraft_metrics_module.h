@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_metrics_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_METRICS_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_METRICS_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+/* handshake results */
+#define NGX_STREAM_NGINXCRAFT_METRICS_PARSED     0
+#define NGX_STREAM_NGINXCRAFT_METRICS_DECLINED   1
+#define NGX_STREAM_NGINXCRAFT_METRICS_ERROR      2
+
+/* why a session was answered by nginx instead of an upstream */
+#define NGX_STREAM_NGINXCRAFT_METRICS_RETURN     0
+#define NGX_STREAM_NGINXCRAFT_METRICS_LIMIT      1
+#define NGX_STREAM_NGINXCRAFT_METRICS_VERSION    2
+#define NGX_STREAM_NGINXCRAFT_METRICS_GUARD      3
+#define NGX_STREAM_NGINXCRAFT_METRICS_QUEUE      4
+
+/* longest $minecraft_server counted on its own */
+#define NGX_STREAM_NGINXCRAFT_METRICS_NAME_LEN   64
+#define NGX_STREAM_NGINXCRAFT_METRICS_VERSIONS   256
+#define NGX_STREAM_NGINXCRAFT_METRICS_BUCKETS    12
+
+/* counters written by one worker only, each on its own cache lines */
+typedef struct {
+    ngx_atomic_t                  handshakes[3];
+    /* status, login, transfer, other */
+    ngx_atomic_t                  intents[4];
+    ngx_atomic_t                  rejects[5];
+    ngx_atomic_t                  preread[NGX_STREAM_NGINXCRAFT_METRICS_BUCKETS];
+    ngx_atomic_t                  preread_sum;
+} ngx_stream_nginxcraft_metrics_worker_t;
+
+typedef struct {
+    /* 0 while the slot is free */
+    ngx_atomic_t                  hash;
+    /* set once name is written */
+    ngx_atomic_t                  ready;
+    ngx_atomic_t                  count;
+    size_t                        len;
+    u_char                        name[NGX_STREAM_NGINXCRAFT_METRICS_NAME_LEN];
+} ngx_stream_nginxcraft_metrics_server_t;
+
+typedef struct {
+    /* protocol version + 1, 0 while the slot is free */
+    ngx_atomic_t                  key;
+    ngx_atomic_t                  count;
+} ngx_stream_nginxcraft_metrics_version_t;
+
+typedef struct {
+    ngx_uint_t                               nworkers;
+    size_t                                   worker_size;
+    ngx_uint_t                               nservers;
+    ngx_stream_nginxcraft_metrics_server_t  *servers;
+    /* hostnames that did not fit or were not valid */
+    ngx_atomic_t                             servers_other;
+    ngx_stream_nginxcraft_metrics_version_t  versions[NGX_STREAM_NGINXCRAFT_METRICS_VERSIONS];
+    ngx_atomic_t                             versions_other;
+    u_char                                  *workers;
+} ngx_stream_nginxcraft_metrics_sh_t;
+
+struct ngx_stream_nginxcraft_metrics_s {
+    ngx_shm_zone_t                      *shm_zone;
+    ngx_stream_nginxcraft_metrics_sh_t  *sh;
+    ngx_slab_pool_t                     *shpool;
+    ngx_cycle_t                         *cycle;
+};
+
+char *ngx_stream_nginxcraft_metrics_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_stream_nginxcraft_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+void ngx_stream_nginxcraft_metrics_session(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx);
+void ngx_stream_nginxcraft_metrics_handshake(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx, ngx_uint_t result);
+void ngx_stream_nginxcraft_metrics_reject(ngx_stream_session_t *s, ngx_uint_t reason);
+
+#endif /* NGX_STREAM_NGINXCRAFT_METRICS_MODULE_H */
@@ -17,12 +17,31 @@
 
 #include "ngx_stream_nginxcraft_module.h"
 #include "ngx_stream_nginxcraft_return_module.h"
-
+#include "ngx_stream_nginxcraft_status_module.h"
+#include "ngx_stream_nginxcraft_limit_module.h"
+#include "ngx_stream_nginxcraft_map_module.h"
+#include "ngx_stream_nginxcraft_upstream_module.h"
+#include "ngx_stream_nginxcraft_version_module.h"
+#include "ngx_stream_nginxcraft_metrics_module.h"
+#include "ngx_stream_nginxcraft_legacy_module.h"
+#include "ngx_stream_nginxcraft_guard_module.h"
+#include "ngx_stream_nginxcraft_queue_module.h"
+#include "ngx_stream_nginxcraft_routes_module.h"
+#include "ngx_stream_nginxcraft_relay_module.h"
+#include "ngx_stream_nginxcraft_warm_module.h"
+#include "ngx_stream_nginxcraft_event_log_module.h"
+#include "ngx_stream_nginxcraft_forward_module.h"
+
+static void *ngx_stream_nginxcraft_create_main_conf(ngx_conf_t *cf);
 static void *ngx_stream_nginxcraft_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_nginxcraft_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child);
 static ngx_int_t ngx_stream_nginxcraft_servername(ngx_stream_session_t *s,
     ngx_str_t *servername);
 static ngx_int_t ngx_stream_nginxcraft_handler(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_nginxcraft_preread(ngx_stream_session_t *s);
 static ngx_int_t ngx_stream_nginxcraft_init(ngx_conf_t *cf);
+static ngx_int_t ngx_stream_nginxcraft_init_process(ngx_cycle_t *cycle);
 static ngx_int_t ngx_stream_nginxcraft_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_stream_servername_host_variable(ngx_stream_session_t *s,
     ngx_stream_variable_value_t *v, uintptr_t data);
@@ -36,6 +55,20 @@ static ngx_command_t ngx_stream_nginxcraft_commands[] = {
       offsetof(ngx_stream_nginxcraft_srv_conf_t, enabled),
       NULL },
 
+    { ngx_string("nginxcraft_preread_limit"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_nginxcraft_srv_conf_t, preread_limit),
+      NULL },
+
+    { ngx_string("nginxcraft_preread_timeout"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_nginxcraft_srv_conf_t, preread_timeout),
+      NULL },
+
     { ngx_string("nginxcraft_return"),
       NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
       ngx_stream_nginxcraft_return,
@@ -43,6 +76,146 @@ static ngx_command_t ngx_stream_nginxcraft_commands[] = {
       0,
       NULL },
 
+    { ngx_string("nginxcraft_login_preread"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_nginxcraft_srv_conf_t, login_preread),
+      NULL },
+
+    { ngx_string("nginxcraft_status"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
+      ngx_stream_nginxcraft_status,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_status_cache"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
+      ngx_stream_nginxcraft_status_cache,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_map"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE12,
+      ngx_stream_nginxcraft_map,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_version_map"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_BLOCK|NGX_CONF_NOARGS,
+      ngx_stream_nginxcraft_version_map,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_players"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+      ngx_stream_nginxcraft_players,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_check"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_ANY,
+      ngx_stream_nginxcraft_check,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_warm"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_1MORE,
+      ngx_stream_nginxcraft_warm,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_limit_zone"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
+      ngx_stream_nginxcraft_limit_zone,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_legacy_ping"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
+      ngx_stream_nginxcraft_legacy_ping,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_guard"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
+      ngx_stream_nginxcraft_guard,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_queue"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
+      ngx_stream_nginxcraft_queue,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_routes"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_nginxcraft_routes,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_routes_api"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_nginxcraft_routes_api,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_event_log"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_nginxcraft_event_log,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_event_log_drain"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_nginxcraft_event_log_drain,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_forward"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
+      ngx_stream_nginxcraft_forward,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_relay"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE12,
+      ngx_stream_nginxcraft_relay,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_metrics_zone"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_stream_nginxcraft_metrics_zone,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("nginxcraft_metrics"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_stream_nginxcraft_metrics,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -51,11 +224,11 @@ static ngx_stream_module_t ngx_stream_nginxcraft_module_ctx = {
     ngx_stream_nginxcraft_add_variables,     /* preconfiguration */
     ngx_stream_nginxcraft_init,              /* postconfiguration */
 
-    NULL,                                    /* create main configuration */
+    ngx_stream_nginxcraft_create_main_conf,  /* create main configuration */
     NULL,                                    /* init main configuration */
 
     ngx_stream_nginxcraft_create_srv_conf,   /* create server configuration */
-    NULL                                     /* merge server configuration */
+    ngx_stream_nginxcraft_merge_srv_conf     /* merge server configuration */
 };
 
 
@@ -66,7 +239,7 @@ ngx_module_t ngx_stream_nginxcraft_module = {
     NGX_STREAM_MODULE,                     /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_stream_nginxcraft_init_process,    /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -79,10 +252,54 @@ static ngx_stream_variable_t ngx_stream_nginxcraft_vars[] = {
     { ngx_string("minecraft_server"), NULL,
       ngx_stream_servername_host_variable, 0, 0, 0 },
 
+    { ngx_string("minecraft_upstream"), NULL,
+      ngx_stream_nginxcraft_upstream_variable, 0, 0, 0 },
+
+    { ngx_string("minecraft_version_upstream"), NULL,
+      ngx_stream_nginxcraft_version_upstream_variable, 0, 0, 0 },
+
+    { ngx_string("minecraft_version_name"), NULL,
+      ngx_stream_nginxcraft_version_name_variable, 0, 0, 0 },
+
       ngx_stream_null_variable
 };
 
 
+static void *
+ngx_stream_nginxcraft_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_nginxcraft_main_conf_t   *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_nginxcraft_main_conf_t));
+
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&conf->polls, cf->pool, 4,
+                       sizeof(ngx_stream_nginxcraft_poll_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&conf->queues, cf->pool, 4,
+                       sizeof(ngx_stream_nginxcraft_queue_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&conf->warms, cf->pool, 4,
+                       sizeof(ngx_stream_nginxcraft_warm_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return conf;
+}
+
 static void *
 ngx_stream_nginxcraft_create_srv_conf(ngx_conf_t *cf)
 {
@@ -95,49 +312,250 @@ ngx_stream_nginxcraft_create_srv_conf(ngx_conf_t *cf)
     }
 
     conf->enabled = NGX_CONF_UNSET;
+    conf->preread_limit = NGX_CONF_UNSET_SIZE;
+    conf->preread_timeout = NGX_CONF_UNSET_MSEC;
+    conf->login_preread = NGX_CONF_UNSET;
+    conf->status_cache = NGX_CONF_UNSET_PTR;
+    conf->status_cache_ttl = NGX_CONF_UNSET_MSEC;
+    conf->status_cache_lock = NGX_CONF_UNSET_MSEC;
+    conf->limit = NGX_CONF_UNSET_PTR;
+    conf->map = NGX_CONF_UNSET_PTR;
+    conf->poll = NGX_CONF_UNSET_PTR;
+    conf->warm = NGX_CONF_UNSET_PTR;
+    conf->version_map = NGX_CONF_UNSET_PTR;
+    conf->legacy = NGX_CONF_UNSET_PTR;
+    conf->guard = NGX_CONF_UNSET_PTR;
+    conf->queue = NGX_CONF_UNSET_PTR;
+    conf->routes = NGX_CONF_UNSET_PTR;
+    conf->event_log = NGX_CONF_UNSET_PTR;
+    conf->forward = NGX_CONF_UNSET_UINT;
+    conf->relay = NGX_CONF_UNSET_UINT;
+    conf->relay_timeout = NGX_CONF_UNSET_MSEC;
 
     return conf;
 }
 
+static char *
+ngx_stream_nginxcraft_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_stream_nginxcraft_srv_conf_t *prev = parent;
+    ngx_stream_nginxcraft_srv_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->enabled, prev->enabled, 0);
+    ngx_conf_merge_size_value(conf->preread_limit, prev->preread_limit, 2048);
+    ngx_conf_merge_msec_value(conf->preread_timeout, prev->preread_timeout, 0);
+    ngx_conf_merge_value(conf->login_preread, prev->login_preread, 0);
+
+    ngx_conf_merge_str_value(conf->status, prev->status, "");
+    ngx_conf_merge_ptr_value(conf->status_cache, prev->status_cache, NULL);
+    ngx_conf_merge_msec_value(conf->status_cache_ttl, prev->status_cache_ttl,
+                              10000);
+    ngx_conf_merge_msec_value(conf->status_cache_lock, prev->status_cache_lock,
+                              5000);
+
+    ngx_conf_merge_ptr_value(conf->limit, prev->limit, NULL);
+    ngx_conf_merge_ptr_value(conf->map, prev->map, NULL);
+    ngx_conf_merge_ptr_value(conf->version_map, prev->version_map, NULL);
+    ngx_conf_merge_ptr_value(conf->legacy, prev->legacy, NULL);
+    ngx_conf_merge_ptr_value(conf->guard, prev->guard, NULL);
+    ngx_conf_merge_ptr_value(conf->queue, prev->queue, NULL);
+    ngx_conf_merge_ptr_value(conf->routes, prev->routes, NULL);
+    ngx_conf_merge_ptr_value(conf->event_log, prev->event_log, NULL);
+    if (conf->forward == NGX_CONF_UNSET_UINT) {
+        conf->forward_uuid = prev->forward_uuid;
+    }
+
+    ngx_conf_merge_uint_value(conf->forward, prev->forward,
+                              NGX_STREAM_NGINXCRAFT_FORWARD_OFF);
+    ngx_conf_merge_uint_value(conf->relay, prev->relay,
+                              NGX_STREAM_NGINXCRAFT_RELAY_COPY);
+    ngx_conf_merge_msec_value(conf->relay_timeout, prev->relay_timeout, 600000);
+
+    if (conf->enabled && (conf->forward & NGX_STREAM_NGINXCRAFT_FORWARD_BUNGEECORD)
+        && !conf->login_preread)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"nginxcraft_forward\" requires \"nginxcraft_login_preread\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->queue && !conf->login_preread) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"nginxcraft_queue\" requires \"nginxcraft_login_preread\"");
+        return NGX_CONF_ERROR;
+    }
+
+    /* only meaningful in the upstream block it was set in */
+    if (conf->poll == NGX_CONF_UNSET_PTR) {
+        conf->poll = NULL;
+    }
+
+    if (conf->warm == NGX_CONF_UNSET_PTR) {
+        conf->warm = NULL;
+    }
+
+    return NGX_CONF_OK;
+}
+
 static ngx_int_t
 ngx_stream_nginxcraft_handler(ngx_stream_session_t *s)
 {
-    ngx_int_t                    rc;
-    ngx_connection_t            *c;
-    ngx_stream_nginxcraft_ctx_t *ctx;
+    ngx_int_t  rc;
+
+    rc = ngx_stream_nginxcraft_preread(s);
+
+    if (rc == NGX_OK) {
+        rc = ngx_stream_nginxcraft_forward_handler(s);
+    }
+
+    if (rc != NGX_AGAIN) {
+        /* no longer half-open, see nginxcraft_guard */
+        ngx_stream_nginxcraft_guard_done(s);
+
+        ngx_stream_nginxcraft_event_log_session(s, rc);
+    }
+
+    return rc;
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_preread(ngx_stream_session_t *s)
+{
+    ngx_int_t                         rc;
+    ngx_time_t                       *tp;
+    ngx_msec_int_t                    ms;
+    ngx_connection_t                 *c;
+    ngx_stream_nginxcraft_ctx_t      *ctx;
+    ngx_stream_nginxcraft_srv_conf_t *nscf;
 
     c = s->connection;
 
     ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0, "nginxcraft handler");
 
-    if (c->buffer == NULL) {
-        return NGX_AGAIN;
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+
+    /* scrapers send HTTP, route updates are text and drains send nothing */
+    if (nscf->metrics || nscf->routes_api || nscf->event_log_drain) {
+        return NGX_DECLINED;
     }
 
     ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
 
     if (ctx == NULL) {
+
+        if (c->buffer == NULL) {
+            return NGX_AGAIN;
+        }
+
+        /* scanners and other protocols are dropped before they cost more */
+
+        rc = ngx_stream_nginxcraft_guard_classify(s);
+
+        if (rc != NGX_OK) {
+            goto again;
+        }
+
         ctx = ngx_pcalloc(c->pool, sizeof(ngx_stream_nginxcraft_ctx_t));
 
         if (ctx == NULL) {
             return NGX_ERROR;
         }
 
+        /* the same clock as $session_time, moved to ngx_current_msec */
+
+        tp = ngx_timeofday();
+        ms = (ngx_msec_int_t) ((tp->sec - s->start_sec) * 1000
+                               + (tp->msec - s->start_msec));
+
         ctx->pool = c->pool;
         ctx->log = c->log;
+        ctx->start = ngx_current_msec - ngx_max(ms, 0);
         ngx_stream_set_ctx(s, ctx, ngx_stream_nginxcraft_module);
+
+        ngx_stream_nginxcraft_metrics_session(s, ctx);
     }
 
-    rc = ngx_stream_nginxcraft_parse(ctx, c->buffer);
+    /* for the access log, the debug log is too costly to leave on */
 
-    if (rc == NGX_OK) {
-        return ngx_stream_nginxcraft_servername(s, &ctx->host);
+    ctx->end = ngx_current_msec;
+
+    if ((size_t) (c->buffer->last - c->buffer->pos) > ctx->preread_bytes) {
+        ctx->preread_bytes = c->buffer->last - c->buffer->pos;
+        ctx->preread_reads++;
     }
 
+    if (!ctx->routed) {
+        rc = ngx_stream_nginxcraft_legacy_handler(s, ctx);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
+    rc = ngx_stream_nginxcraft_parse(ctx, c->buffer, nscf->preread_limit);
+
     if (rc == NGX_DECLINED) {
+        ctx->route = NGX_STREAM_NGINXCRAFT_ROUTE_DECLINED;
+        ngx_stream_nginxcraft_metrics_handshake(s, ctx,
+                                                NGX_STREAM_NGINXCRAFT_METRICS_DECLINED);
+        return NGX_OK;
+    }
+
+    if (rc != NGX_OK) {
+        goto again;
+    }
+
+    if (!ctx->routed) {
+        ctx->routed = 1;
+        ctx->handshake_bytes = ctx->preread_bytes;
+        ctx->route = NGX_STREAM_NGINXCRAFT_ROUTE_DEFAULT;
+
+        ngx_stream_nginxcraft_metrics_handshake(s, ctx,
+                                                NGX_STREAM_NGINXCRAFT_METRICS_PARSED);
+
+        rc = ngx_stream_nginxcraft_servername(s, &ctx->host);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        rc = ngx_stream_nginxcraft_limit_handler(s, ctx);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+
+        rc = ngx_stream_nginxcraft_version_handler(s, ctx);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
+    if (ctx->handshake.nextState == 1) {
+        return ngx_stream_nginxcraft_status_handler(s, ctx);
+    }
+
+    /* the session may have moved to another server */
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+
+    if (!nscf->login_preread) {
         return NGX_OK;
     }
 
+    rc = ngx_stream_nginxcraft_parse_login(ctx, c->buffer, nscf->preread_limit);
+
+    if (rc == NGX_OK) {
+        return ngx_stream_nginxcraft_queue_handler(s, ctx);
+    }
+
+again:
+
+    if (rc == NGX_AGAIN && nscf->preread_timeout && !c->read->timer_set) {
+        /* the preread phase keeps this timer instead of preread_timeout */
+        ngx_add_timer(c->read, nscf->preread_timeout);
+    }
+
     return rc;
 }
 
@@ -149,7 +567,9 @@ ngx_stream_nginxcraft_servername(ngx_stream_session_t *s,
     ngx_str_t                            host;
     ngx_connection_t                    *c;
     ngx_stream_core_srv_conf_t          *cscf;
+    ngx_stream_nginxcraft_ctx_t         *ctx;
     ngx_stream_nginxcraft_srv_conf_t    *nscf;
+    u_char                               low[NGX_STREAM_NGINXCRAFT_HOST_LEN];
 
     c = s->connection;
 
@@ -160,9 +580,18 @@ ngx_stream_nginxcraft_servername(ngx_stream_session_t *s,
         return NGX_OK;
     }
 
-    host = *servername;
+    if (servername->len > NGX_STREAM_NGINXCRAFT_HOST_LEN) {
+        return NGX_OK;
+    }
+
+    /* lowercased on the stack, the name is only needed for the lookup */
+
+    host.len = servername->len;
+    host.data = low;
 
-    rc = ngx_stream_validate_host(&host, c->pool, 1);
+    ngx_strlow(low, servername->data, servername->len);
+
+    rc = ngx_stream_validate_host(&host, c->pool, 0);
 
     if (rc == NGX_ERROR) {
         return NGX_ERROR;
@@ -194,6 +623,9 @@ ngx_stream_nginxcraft_servername(ngx_stream_session_t *s,
 
     s->srv_conf = cscf->ctx->srv_conf;
 
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+    ctx->route = NGX_STREAM_NGINXCRAFT_ROUTE_NAME;
+
     ngx_set_connection_log(c, cscf->error_log);
 
     return NGX_OK;
@@ -246,8 +678,17 @@ ngx_stream_nginxcraft_add_variables(ngx_conf_t *cf)
 static ngx_int_t
 ngx_stream_nginxcraft_init(ngx_conf_t *cf)
 {
-    ngx_stream_handler_pt       *h;
-    ngx_stream_core_main_conf_t *cmcf;
+    ngx_stream_handler_pt              *h;
+    ngx_stream_core_main_conf_t        *cmcf;
+    ngx_stream_nginxcraft_main_conf_t  *nmcf;
+
+    nmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_nginxcraft_module);
+
+    if (nmcf->metrics_used && nmcf->metrics == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"nginxcraft_metrics\" requires \"nginxcraft_metrics_zone\"");
+        return NGX_ERROR;
+    }
 
     cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
 
@@ -259,5 +700,120 @@ ngx_stream_nginxcraft_init(ngx_conf_t *cf)
 
     *h = ngx_stream_nginxcraft_handler;
 
-    return NGX_OK;
+    h = ngx_array_push(&cmcf->phases[NGX_STREAM_PREACCESS_PHASE].handlers);
+
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_stream_nginxcraft_guard_handler;
+
+    if (ngx_stream_nginxcraft_poll_init(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_stream_nginxcraft_queue_init(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_stream_nginxcraft_warm_init(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_stream_nginxcraft_relay_init(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_stream_nginxcraft_status_init(cf);
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_init_process(ngx_cycle_t *cycle)
+{
+    if (ngx_stream_nginxcraft_poll_init_process(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_stream_nginxcraft_warm_init_process(cycle);
+}
+
+/*
+ * zone=name:size, or zone=name for a zone sized elsewhere. The zone gets
+ * init and a zeroed data of the given size the first time it is named,
+ * other directives using the same name are an error.
+ */
+ngx_shm_zone_t *
+ngx_stream_nginxcraft_zone(ngx_conf_t *cf, ngx_str_t *value, ngx_uint_t sized,
+    ngx_shm_zone_init_pt init, size_t data)
+{
+    u_char          *p;
+    ssize_t          size;
+    ngx_str_t        name, s;
+    ngx_shm_zone_t  *shm_zone;
+
+    if (ngx_strncmp(value->data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", value);
+        return NULL;
+    }
+
+    name.data = value->data + 5;
+    name.len = value->len - 5;
+
+    size = 0;
+
+    p = (u_char *) ngx_strchr(name.data, ':');
+
+    if (p) {
+        name.len = p - name.data;
+
+        s.data = p + 1;
+        s.len = value->data + value->len - s.data;
+
+        size = ngx_parse_size(&s);
+
+        if (size == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid zone size \"%V\"", value);
+            return NULL;
+        }
+
+        if (size < (ssize_t) (32 * ngx_pagesize)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "zone \"%V\" is too small", value);
+            return NULL;
+        }
+    }
+
+    if (name.len == 0 || (sized && size == 0)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\"", value);
+        return NULL;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_stream_nginxcraft_module);
+
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->data && shm_zone->init != init) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is already used by another directive",
+                           &name);
+        return NULL;
+    }
+
+    if (shm_zone->data == NULL) {
+        shm_zone->data = ngx_pcalloc(cf->pool, data);
+
+        if (shm_zone->data == NULL) {
+            return NULL;
+        }
+
+        shm_zone->init = init;
+    }
+
+    return shm_zone;
 }
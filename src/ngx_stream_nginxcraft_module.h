@@ -18,23 +18,167 @@
 #include <ngx_core.h>
 #include <ngx_stream.h>
 
+#include "minecraft_funcs.h"
+
+#define NGX_STREAM_NGINXCRAFT_STATE_LENGTH   0
+#define NGX_STREAM_NGINXCRAFT_STATE_FRAME    1
+#define NGX_STREAM_NGINXCRAFT_STATE_DONE     2
+
+#define NGX_STREAM_NGINXCRAFT_STATUS_NONE    0
+#define NGX_STREAM_NGINXCRAFT_STATUS_WAIT    1
+#define NGX_STREAM_NGINXCRAFT_STATUS_FILL    2
+#define NGX_STREAM_NGINXCRAFT_STATUS_PROXY   3
+#define NGX_STREAM_NGINXCRAFT_STATUS_LOCAL   4
+
+/* how the server was chosen, see $minecraft_route_source */
+#define NGX_STREAM_NGINXCRAFT_ROUTE_NONE     0
+#define NGX_STREAM_NGINXCRAFT_ROUTE_NAME     1
+#define NGX_STREAM_NGINXCRAFT_ROUTE_DEFAULT  2
+#define NGX_STREAM_NGINXCRAFT_ROUTE_DECLINED 3
+
+/* longest DNS name */
+#define NGX_STREAM_NGINXCRAFT_HOST_LEN       255
+
+typedef struct ngx_stream_nginxcraft_limit_s  ngx_stream_nginxcraft_limit_t;
+typedef struct ngx_stream_nginxcraft_map_s    ngx_stream_nginxcraft_map_t;
+typedef struct ngx_stream_nginxcraft_legacy_s ngx_stream_nginxcraft_legacy_t;
+typedef struct ngx_stream_nginxcraft_guard_s  ngx_stream_nginxcraft_guard_t;
+typedef struct ngx_stream_nginxcraft_queue_s  ngx_stream_nginxcraft_queue_t;
+typedef struct ngx_stream_nginxcraft_queue_wait_s  ngx_stream_nginxcraft_queue_wait_t;
+typedef struct ngx_stream_nginxcraft_relay_s  ngx_stream_nginxcraft_relay_t;
+typedef struct ngx_stream_nginxcraft_metrics_s  ngx_stream_nginxcraft_metrics_t;
+typedef struct ngx_stream_nginxcraft_poll_s   ngx_stream_nginxcraft_poll_t;
+typedef struct ngx_stream_nginxcraft_warm_s   ngx_stream_nginxcraft_warm_t;
+typedef struct ngx_stream_nginxcraft_version_map_s    ngx_stream_nginxcraft_version_map_t;
+typedef struct ngx_stream_nginxcraft_version_range_s  ngx_stream_nginxcraft_version_range_t;
+
+typedef struct {
+    /* upstreams whose peers are polled, see ngx_stream_nginxcraft_upstream_module.c */
+    ngx_array_t                  polls;
+    ngx_stream_nginxcraft_metrics_t  *metrics;
+    /* a server has nginxcraft_metrics, checked against the zone */
+    ngx_flag_t                   metrics_used;
+    /* nginxcraft_queue with upstream=, resolved in postconfiguration */
+    ngx_array_t                  queues;
+    /* upstreams with nginxcraft_warm, see ngx_stream_nginxcraft_warm_module.c */
+    ngx_array_t                  warms;
+} ngx_stream_nginxcraft_main_conf_t;
+
 typedef struct {
     ngx_flag_t                   enabled;
+    size_t                       preread_limit;
+    ngx_msec_t                   preread_timeout;
+    ngx_flag_t                   login_preread;
     ngx_stream_complex_value_t   text;
+    ngx_str_t                    disconnect;
+    /* Status Response packet of nginxcraft_status */
+    ngx_str_t                    status;
+    ngx_shm_zone_t              *status_cache;
+    ngx_msec_t                   status_cache_ttl;
+    ngx_msec_t                   status_cache_lock;
+    ngx_stream_nginxcraft_limit_t  *limit;
+    ngx_stream_nginxcraft_map_t    *map;
+    ngx_stream_nginxcraft_poll_t   *poll;
+    ngx_stream_nginxcraft_warm_t   *warm;
+    ngx_stream_nginxcraft_version_map_t  *version_map;
+    ngx_stream_nginxcraft_legacy_t       *legacy;
+    ngx_stream_nginxcraft_guard_t        *guard;
+    ngx_stream_nginxcraft_queue_t        *queue;
+    /* nginxcraft_routes table, and the zone a control server updates */
+    ngx_shm_zone_t                      *routes;
+    ngx_shm_zone_t                      *routes_api;
+    /* nginxcraft_event_log ring, and the zone a drain server empties */
+    ngx_shm_zone_t                      *event_log;
+    ngx_shm_zone_t                      *event_log_drain;
+    /* nginxcraft_forward, and the UUID it sends */
+    ngx_uint_t                   forward;
+    ngx_uint_t                   forward_uuid;
+    /* nginxcraft_relay mode, and its idle timeout */
+    ngx_uint_t                   relay;
+    ngx_msec_t                   relay_timeout;
+    /* nginxcraft_metrics format, 0 when not a metrics server */
+    ngx_uint_t                   metrics;
 } ngx_stream_nginxcraft_srv_conf_t;
 
 
 typedef struct {
-    ngx_str_t        host;
-    ngx_log_t       *log;
-    ngx_pool_t      *pool;
-    void            *variables;
-    ngx_chain_t     *out;
+    /* preread state, kept between calls until the frame is complete */
+    ngx_uint_t           state;
+    size_t               offset;
+    VarInt               length;
+    minecraft_handshake  handshake;
+
+    /* frames of the preread buffer not handed out yet, from frame on */
+    minecraft_frames     frames;
+    ngx_uint_t           frame;
+
+    ngx_str_t            host;
+    ngx_log_t           *log;
+    ngx_pool_t          *pool;
+    ngx_chain_t         *out;
+
+    /* accept and the last call of the preread handler, cached time */
+    ngx_msec_t           start;
+    ngx_msec_t           end;
+
+    /* preread buffer length last seen, and when the handshake was complete */
+    size_t               preread_bytes;
+    size_t               handshake_bytes;
+    ngx_uint_t           preread_reads;
+    ngx_uint_t           route;
+
+    /* formatted on first use, see parse_minecraft.c */
+    u_char               port_text[sizeof("65535") - 1];
+    u_char               version_text[NGX_INT32_LEN];
+    u_char               next_state_text[NGX_INT32_LEN];
+    u_char               uuid_text[sizeof("00000000-0000-0000-0000-000000000000") - 1];
+    u_char               preread_time_text[NGX_TIME_T_LEN + 4];
+    u_char               handshake_bytes_text[NGX_SIZE_T_LEN];
+    u_char               preread_reads_text[NGX_INT_T_LEN];
+
+    /* Login Start, when nginxcraft_login_preread is on */
+    ngx_str_t            username;
+    const u_char        *uuid;
+
+    /* nginxcraft_version_map entry for the protocol version */
+    ngx_stream_nginxcraft_version_range_t  *version_range;
+
+    /* server list ping, see ngx_stream_nginxcraft_status_module.c */
+    ngx_uint_t           status;
+    ngx_str_t            status_key;
+    ngx_shm_zone_t      *status_zone;
+    ngx_event_t         *status_wait;
+    ngx_buf_t           *status_fill;
+
+    /* login queue, see ngx_stream_nginxcraft_queue_module.c */
+    ngx_stream_nginxcraft_queue_wait_t  *queue_wait;
+
+    /* splice relay, see ngx_stream_nginxcraft_relay_module.c */
+    ngx_stream_nginxcraft_relay_t       *relay;
+
+    /* a lone 0xFE or 0xFE 0x01, see ngx_stream_nginxcraft_legacy_module.c */
+    ngx_event_t         *legacy_wait;
+
+    unsigned             routed:1;
+    unsigned             login_done:1;
+    unsigned             status_sent:1;
+    unsigned             status_done:1;
+    unsigned             metrics_done:1;
+    unsigned             event_logged:1;
+    unsigned             forwarded:1;
+    unsigned             legacy_timedout:1;
 } ngx_stream_nginxcraft_ctx_t;
 
 extern ngx_module_t ngx_stream_nginxcraft_module;
 
-ngx_int_t ngx_stream_nginxcraft_parse(ngx_stream_nginxcraft_ctx_t *ctx, ngx_buf_t *buf);
+ngx_int_t ngx_stream_nginxcraft_parse(ngx_stream_nginxcraft_ctx_t *ctx, ngx_buf_t *buf,
+    size_t limit);
+ngx_int_t ngx_stream_nginxcraft_next_packet(ngx_stream_nginxcraft_ctx_t *ctx,
+    ngx_buf_t *buf, minecraft_packet *packet);
+ngx_int_t ngx_stream_nginxcraft_parse_login(ngx_stream_nginxcraft_ctx_t *ctx,
+    ngx_buf_t *buf, size_t limit);
 ngx_int_t submodule_nginxcraft_add_variables(ngx_conf_t *cf);
+ngx_shm_zone_t *ngx_stream_nginxcraft_zone(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_uint_t sized, ngx_shm_zone_init_pt init, size_t data);
 
 #endif /* NGX_STREAM_NGINXCRAFT_MODULE_H */
@@ -0,0 +1,1006 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_queue_module.c
+ *
+ * Holds logins in a queue per $minecraft_server while the server has no
+ * free slots, and lets them through in order as slots free up. Slots are
+ * either a number of sessions or the free player slots polled by
+ * nginxcraft_players.
+ *
+ * Every worker keeps its own waiting sessions. The order is kept in
+ * shared memory with tickets: a session takes the next ticket, whichever
+ * worker sees a free slot lets the oldest tickets in, and each session
+ * checks on a short timer whether its ticket was let in. Clients since
+ * 1.13 are sent a Login Plugin Request holding their position now and
+ * then, which keeps them from timing out; their answers are dropped so
+ * the upstream only ever sees the handshake and Login Start.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_queue_module.h"
+#include "ngx_stream_nginxcraft_return_module.h"
+#include "ngx_stream_nginxcraft_upstream_module.h"
+#include "ngx_stream_nginxcraft_metrics_module.h"
+#include "minecraft_funcs.h"
+
+/* how often a waiting session looks for its turn */
+#define NGX_STREAM_NGINXCRAFT_QUEUE_CHECK     250
+
+/* clients give up after 30 seconds without a packet */
+#define NGX_STREAM_NGINXCRAFT_QUEUE_SILENT    25000
+
+#define NGX_STREAM_NGINXCRAFT_QUEUE_NONE      0
+#define NGX_STREAM_NGINXCRAFT_QUEUE_WAIT      1
+#define NGX_STREAM_NGINXCRAFT_QUEUE_ADMITTED  2
+
+typedef struct {
+    ngx_rbtree_t                  rbtree;
+    ngx_rbtree_node_t             sentinel;
+} ngx_stream_nginxcraft_queue_shctx_t;
+
+typedef struct {
+    ngx_stream_nginxcraft_queue_shctx_t  *sh;
+    ngx_slab_pool_t                      *shpool;
+} ngx_stream_nginxcraft_queue_zone_t;
+
+typedef struct {
+    ngx_str_node_t     sn;
+    /* tickets before head may log in, tail is the next one handed out */
+    ngx_uint_t         head;
+    ngx_uint_t         tail;
+    /* let in but not gone through yet, and sessions that went through */
+    ngx_uint_t         granted;
+    ngx_uint_t         active;
+    /* a byte per ticket waiting, set when its session went away */
+    ngx_uint_t         max;
+    u_char            *gone;
+    u_char             key[1];
+} ngx_stream_nginxcraft_queue_node_t;
+
+struct ngx_stream_nginxcraft_queue_wait_s {
+    ngx_stream_session_t           *session;
+    ngx_stream_nginxcraft_queue_t  *queue;
+    ngx_str_t                       key;
+    ngx_uint_t                      state;
+    ngx_uint_t                      ticket;
+    ngx_uint_t                      position;
+    ngx_uint_t                      length;
+    ngx_msec_t                      start;
+    ngx_msec_t                      keepalive;
+    /* preread buffer up to the end of Login Start */
+    size_t                          login;
+    /* Login Plugin Requests sent and not answered yet */
+    int32_t                         message_id;
+    ngx_uint_t                      pending;
+    ngx_event_t                     event;
+    ngx_buf_t                       buf;
+    ngx_chain_t                     out;
+    u_char                          packet[64];
+};
+
+static ngx_int_t ngx_stream_nginxcraft_queue_enter(
+    ngx_stream_nginxcraft_queue_wait_t *qw);
+static ngx_int_t ngx_stream_nginxcraft_queue_claim(
+    ngx_stream_nginxcraft_queue_wait_t *qw,
+    ngx_stream_nginxcraft_queue_node_t *node);
+static void ngx_stream_nginxcraft_queue_pump(ngx_stream_nginxcraft_queue_t *queue,
+    ngx_stream_nginxcraft_queue_node_t *node);
+static void ngx_stream_nginxcraft_queue_leave(ngx_stream_nginxcraft_queue_wait_t *qw);
+static void ngx_stream_nginxcraft_queue_admit(ngx_stream_nginxcraft_queue_wait_t *qw);
+static ngx_int_t ngx_stream_nginxcraft_queue_keepalive(
+    ngx_stream_nginxcraft_queue_wait_t *qw);
+static ngx_int_t ngx_stream_nginxcraft_queue_answers(
+    ngx_stream_nginxcraft_queue_wait_t *qw, ngx_buf_t *b);
+static void ngx_stream_nginxcraft_queue_event_handler(ngx_event_t *ev);
+static void ngx_stream_nginxcraft_queue_read_handler(ngx_event_t *rev);
+static void ngx_stream_nginxcraft_queue_write_handler(ngx_event_t *wev);
+static void ngx_stream_nginxcraft_queue_cleanup(void *data);
+static ngx_int_t ngx_stream_nginxcraft_queue_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+static ngx_str_t  ngx_stream_nginxcraft_queue_channel =
+    ngx_string("nginxcraft:queue");
+
+static ngx_str_t  ngx_stream_nginxcraft_queue_message =
+    ngx_string("{\"text\":\"The server is full, try again in a moment\"}");
+
+/*
+ * Called once Login Start is read. NGX_OK lets the login through,
+ * NGX_DONE means the session waits or is being disconnected.
+ */
+ngx_int_t
+ngx_stream_nginxcraft_queue_handler(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx)
+{
+    ngx_int_t                            rc;
+    ngx_connection_t                    *c;
+    ngx_pool_cleanup_t                  *cln;
+    ngx_stream_nginxcraft_queue_t       *queue;
+    ngx_stream_nginxcraft_srv_conf_t    *nscf;
+    ngx_stream_nginxcraft_queue_wait_t  *qw;
+
+    c = s->connection;
+
+    if (ctx->queue_wait) {
+        /* the phases run again once the session was let in */
+        return (ctx->queue_wait->state == NGX_STREAM_NGINXCRAFT_QUEUE_WAIT)
+               ? NGX_DONE : NGX_OK;
+    }
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+    queue = nscf->queue;
+
+    if (queue == NULL || ctx->username.len == 0) {
+        return NGX_OK;
+    }
+
+    /* anything after Login Start would have to be kept for the upstream */
+
+    if ((size_t) (c->buffer->last - c->buffer->pos) != ctx->offset) {
+        return NGX_OK;
+    }
+
+    qw = ngx_pcalloc(c->pool, sizeof(ngx_stream_nginxcraft_queue_wait_t));
+
+    if (qw == NULL) {
+        return NGX_ERROR;
+    }
+
+    qw->key.len = ctx->host.len;
+    qw->key.data = ngx_pnalloc(c->pool, ctx->host.len);
+
+    if (qw->key.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_strlow(qw->key.data, ctx->host.data, ctx->host.len);
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_stream_nginxcraft_queue_cleanup;
+    cln->data = qw;
+
+    qw->session = s;
+    qw->queue = queue;
+    qw->login = ctx->offset;
+    qw->start = ngx_current_msec;
+
+    ctx->queue_wait = qw;
+
+    rc = ngx_stream_nginxcraft_queue_enter(qw);
+
+    if (rc == NGX_OK || rc == NGX_DECLINED) {
+        return NGX_OK;
+    }
+
+    if (rc == NGX_BUSY) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "login queue of \"%V\" is full", &qw->key);
+
+        ngx_stream_nginxcraft_metrics_reject(s, NGX_STREAM_NGINXCRAFT_METRICS_QUEUE);
+
+        return ngx_stream_nginxcraft_disconnect(s, &queue->disconnect);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "nginxcraft queue \"%V\" position: %ui",
+                   &qw->key, qw->position);
+
+    c->log->action = "waiting in the login queue";
+
+    qw->event.handler = ngx_stream_nginxcraft_queue_event_handler;
+    qw->event.data = qw;
+    qw->event.log = c->log;
+
+    c->read->handler = ngx_stream_nginxcraft_queue_read_handler;
+    c->write->handler = ngx_stream_nginxcraft_queue_write_handler;
+
+    if (ctx->handshake.protocolVersion >= MC_PROTOCOL_1_13
+        && ngx_stream_nginxcraft_queue_keepalive(qw) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_add_timer(&qw->event, NGX_STREAM_NGINXCRAFT_QUEUE_CHECK);
+
+    /* the preread phase removes its read timer once this returns */
+    return NGX_DONE;
+}
+
+/*
+ * NGX_OK if the ticket is let in at once, NGX_AGAIN if it waits,
+ * NGX_BUSY if the queue is full and NGX_DECLINED if the zone is.
+ */
+static ngx_int_t
+ngx_stream_nginxcraft_queue_enter(ngx_stream_nginxcraft_queue_wait_t *qw)
+{
+    size_t                               size;
+    uint32_t                             hash;
+    ngx_int_t                            rc;
+    ngx_stream_nginxcraft_queue_t       *queue;
+    ngx_stream_nginxcraft_queue_node_t  *node;
+    ngx_stream_nginxcraft_queue_zone_t  *zone;
+
+    queue = qw->queue;
+    zone = queue->shm_zone->data;
+
+    hash = ngx_crc32_short(qw->key.data, qw->key.len);
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    node = (ngx_stream_nginxcraft_queue_node_t *)
+               ngx_str_rbtree_lookup(&zone->sh->rbtree, &qw->key, hash);
+
+    if (node == NULL) {
+        size = offsetof(ngx_stream_nginxcraft_queue_node_t, key) + qw->key.len
+               + queue->max;
+
+        node = ngx_slab_alloc_locked(zone->shpool, size);
+
+        if (node == NULL) {
+            ngx_shmtx_unlock(&zone->shpool->mutex);
+
+            /* fail open, a full zone must not lock every player out */
+            return NGX_DECLINED;
+        }
+
+        node->sn.node.key = hash;
+        node->sn.str.len = qw->key.len;
+        node->sn.str.data = node->key;
+        node->head = 0;
+        node->tail = 0;
+        node->granted = 0;
+        node->active = 0;
+        node->max = queue->max;
+        node->gone = node->key + qw->key.len;
+
+        ngx_memcpy(node->key, qw->key.data, qw->key.len);
+
+        ngx_rbtree_insert(&zone->sh->rbtree, &node->sn.node);
+    }
+
+    /* the max of the node, a reload or another server may set another */
+    if (node->tail - node->head >= node->max) {
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+        return NGX_BUSY;
+    }
+
+    qw->ticket = node->tail++;
+    qw->state = NGX_STREAM_NGINXCRAFT_QUEUE_WAIT;
+
+    node->gone[qw->ticket % node->max] = 0;
+
+    rc = ngx_stream_nginxcraft_queue_claim(qw, node);
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    return rc;
+}
+
+/* with the zone locked */
+static ngx_int_t
+ngx_stream_nginxcraft_queue_claim(ngx_stream_nginxcraft_queue_wait_t *qw,
+    ngx_stream_nginxcraft_queue_node_t *node)
+{
+    ngx_stream_nginxcraft_queue_pump(qw->queue, node);
+
+    if (qw->ticket < node->head) {
+        node->granted--;
+        node->active++;
+
+        qw->state = NGX_STREAM_NGINXCRAFT_QUEUE_ADMITTED;
+
+        return NGX_OK;
+    }
+
+    qw->position = qw->ticket - node->head + 1;
+    qw->length = node->tail - node->head;
+
+    return NGX_AGAIN;
+}
+
+/* lets the oldest tickets in while there are free slots, zone locked */
+static void
+ngx_stream_nginxcraft_queue_pump(ngx_stream_nginxcraft_queue_t *queue,
+    ngx_stream_nginxcraft_queue_node_t *node)
+{
+    ngx_int_t   free;
+
+    if (queue->poll) {
+        free = ngx_stream_nginxcraft_poll_slots(queue->poll);
+
+        if (free < 0) {
+            /* nothing known about the peers, nothing to wait for */
+            free = node->tail - node->head;
+        }
+
+    } else {
+        free = (ngx_int_t) queue->slots - (ngx_int_t) node->active;
+    }
+
+    free -= node->granted;
+
+    for ( ;; ) {
+
+        while (node->head != node->tail && node->gone[node->head % node->max]) {
+            node->gone[node->head % node->max] = 0;
+            node->head++;
+        }
+
+        if (free <= 0 || node->head == node->tail) {
+            return;
+        }
+
+        node->head++;
+        node->granted++;
+        free--;
+    }
+}
+
+static void
+ngx_stream_nginxcraft_queue_leave(ngx_stream_nginxcraft_queue_wait_t *qw)
+{
+    ngx_stream_nginxcraft_queue_node_t  *node;
+    ngx_stream_nginxcraft_queue_zone_t  *zone;
+
+    if (qw->state == NGX_STREAM_NGINXCRAFT_QUEUE_NONE) {
+        return;
+    }
+
+    zone = qw->queue->shm_zone->data;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    node = (ngx_stream_nginxcraft_queue_node_t *)
+               ngx_str_rbtree_lookup(&zone->sh->rbtree, &qw->key,
+                                     ngx_crc32_short(qw->key.data, qw->key.len));
+
+    if (node) {
+
+        if (qw->state == NGX_STREAM_NGINXCRAFT_QUEUE_ADMITTED) {
+            node->active--;
+
+        } else if (qw->ticket < node->head) {
+            node->granted--;
+
+        } else {
+            node->gone[qw->ticket % node->max] = 1;
+        }
+
+        /* the slot goes to the next in line */
+        ngx_stream_nginxcraft_queue_pump(qw->queue, node);
+
+        if (node->head == node->tail && node->granted == 0 && node->active == 0) {
+            ngx_rbtree_delete(&zone->sh->rbtree, &node->sn.node);
+            ngx_slab_free_locked(zone->shpool, node);
+        }
+    }
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    qw->state = NGX_STREAM_NGINXCRAFT_QUEUE_NONE;
+}
+
+/* once the client has answered every Login Plugin Request */
+static void
+ngx_stream_nginxcraft_queue_admit(ngx_stream_nginxcraft_queue_wait_t *qw)
+{
+    ngx_connection_t  *c;
+
+    c = qw->session->connection;
+
+    if (qw->pending || c->buffered) {
+        if (!qw->event.timer_set) {
+            ngx_add_timer(&qw->event, NGX_STREAM_NGINXCRAFT_QUEUE_CHECK);
+        }
+
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "nginxcraft queue \"%V\" done after %M ms",
+                   &qw->key, (ngx_msec_t) (ngx_current_msec - qw->start));
+
+    if (qw->event.timer_set) {
+        ngx_del_timer(&qw->event);
+    }
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    c->read->handler = ngx_stream_session_handler;
+
+    ngx_stream_core_run_phases(qw->session);
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_queue_keepalive(ngx_stream_nginxcraft_queue_wait_t *qw)
+{
+    u_char            *p;
+    size_t             len;
+    ngx_connection_t  *c;
+    u_char             data[2 * MC_VARINT_MAX_SIZE];
+
+    c = qw->session->connection;
+
+    qw->keepalive = ngx_current_msec;
+
+    if (c->buffered) {
+        /* the last one is still on its way */
+        return NGX_OK;
+    }
+
+    /* position and queue length, for mods that show them */
+
+    p = data;
+    writeVarInt(p, (int32_t) qw->position);
+    p += get_VarInt_size((int32_t) qw->position);
+    writeVarInt(p, (int32_t) qw->length);
+    p += get_VarInt_size((int32_t) qw->length);
+
+    len = get_login_plugin_request_size(qw->message_id,
+                                        ngx_stream_nginxcraft_queue_channel.len,
+                                        p - data);
+
+    create_login_plugin_request(qw->packet, qw->message_id,
+                                ngx_stream_nginxcraft_queue_channel.data,
+                                ngx_stream_nginxcraft_queue_channel.len,
+                                data, p - data);
+
+    qw->message_id++;
+    qw->pending++;
+
+    qw->buf.memory = 1;
+    qw->buf.flush = 1;
+    qw->buf.pos = qw->packet;
+    qw->buf.last = qw->packet + len;
+
+    qw->out.buf = &qw->buf;
+    qw->out.next = NULL;
+
+    if (ngx_stream_top_filter(qw->session, &qw->out, 1) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (c->buffered && ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/* drops Login Plugin Responses after Login Start, NGX_ERROR on anything else */
+static ngx_int_t
+ngx_stream_nginxcraft_queue_answers(ngx_stream_nginxcraft_queue_wait_t *qw,
+    ngx_buf_t *b)
+{
+    u_char            *p, *start;
+    ngx_int_t          rc;
+    minecraft_packet   packet;
+
+    start = b->pos + qw->login;
+    p = start;
+
+    while (p < b->last) {
+        rc = parse_packet(p, b->last - p, &packet);
+
+        if (rc == NGX_AGAIN) {
+            break;
+        }
+
+        if (rc != NGX_OK || packet.packetId.value != MC_LOGIN_PLUGIN_RESPONSE
+            || qw->pending == 0)
+        {
+            return NGX_ERROR;
+        }
+
+        qw->pending--;
+        p += packet.length.length + packet.length.value;
+    }
+
+    b->last = ngx_movemem(start, p, b->last - p);
+
+    return NGX_OK;
+}
+
+static void
+ngx_stream_nginxcraft_queue_event_handler(ngx_event_t *ev)
+{
+    ngx_int_t                            rc;
+    ngx_msec_t                           limit;
+    ngx_connection_t                    *c;
+    ngx_stream_session_t                *s;
+    ngx_stream_nginxcraft_ctx_t         *ctx;
+    ngx_stream_nginxcraft_queue_t       *queue;
+    ngx_stream_nginxcraft_queue_node_t  *node;
+    ngx_stream_nginxcraft_queue_zone_t  *zone;
+    ngx_stream_nginxcraft_queue_wait_t  *qw;
+
+    qw = ev->data;
+    s = qw->session;
+    c = s->connection;
+    queue = qw->queue;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+
+    if (qw->state == NGX_STREAM_NGINXCRAFT_QUEUE_WAIT) {
+        zone = queue->shm_zone->data;
+
+        ngx_shmtx_lock(&zone->shpool->mutex);
+
+        node = (ngx_stream_nginxcraft_queue_node_t *)
+                   ngx_str_rbtree_lookup(&zone->sh->rbtree, &qw->key,
+                                         ngx_crc32_short(qw->key.data,
+                                                         qw->key.len));
+
+        rc = node ? ngx_stream_nginxcraft_queue_claim(qw, node) : NGX_AGAIN;
+
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    } else {
+        rc = NGX_OK;
+    }
+
+    limit = queue->timeout;
+
+    if (ctx->handshake.protocolVersion < MC_PROTOCOL_1_13) {
+        limit = ngx_min(limit, NGX_STREAM_NGINXCRAFT_QUEUE_SILENT);
+    }
+
+    if (rc == NGX_OK && (qw->pending == 0 || ngx_current_msec - qw->start < limit)) {
+        ngx_stream_nginxcraft_queue_admit(qw);
+        return;
+    }
+
+    if (ngx_current_msec - qw->start >= limit) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "login queue of \"%V\" timed out at position %ui",
+                      &qw->key, qw->position);
+
+        ngx_stream_nginxcraft_metrics_reject(s, NGX_STREAM_NGINXCRAFT_METRICS_QUEUE);
+
+        ngx_stream_nginxcraft_queue_leave(qw);
+
+        if (ngx_stream_nginxcraft_disconnect(s, &queue->disconnect) == NGX_ERROR) {
+            ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        }
+
+        return;
+    }
+
+    if (ctx->handshake.protocolVersion >= MC_PROTOCOL_1_13
+        && ngx_current_msec - qw->keepalive >= queue->interval
+        && ngx_stream_nginxcraft_queue_keepalive(qw) != NGX_OK)
+    {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_add_timer(ev, NGX_STREAM_NGINXCRAFT_QUEUE_CHECK);
+}
+
+static void
+ngx_stream_nginxcraft_queue_read_handler(ngx_event_t *rev)
+{
+    ssize_t                              n;
+    ngx_buf_t                           *b;
+    ngx_connection_t                    *c;
+    ngx_stream_session_t                *s;
+    ngx_stream_nginxcraft_ctx_t         *ctx;
+    ngx_stream_nginxcraft_queue_wait_t  *qw;
+
+    c = rev->data;
+    s = c->data;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+    qw = ctx->queue_wait;
+    b = c->buffer;
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "nginxcraft queue buffer full");
+            ngx_stream_finalize_session(s, NGX_STREAM_BAD_REQUEST);
+            return;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_stream_finalize_session(s, NGX_STREAM_OK);
+            return;
+        }
+
+        b->last += n;
+
+        if (ngx_stream_nginxcraft_queue_answers(qw, b) != NGX_OK) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "unexpected packet in the login queue");
+            ngx_stream_finalize_session(s, NGX_STREAM_BAD_REQUEST);
+            return;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (qw->state == NGX_STREAM_NGINXCRAFT_QUEUE_ADMITTED && qw->pending == 0) {
+        ngx_stream_nginxcraft_queue_admit(qw);
+    }
+}
+
+static void
+ngx_stream_nginxcraft_queue_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t      *c;
+    ngx_stream_session_t  *s;
+
+    c = wev->data;
+    s = c->data;
+
+    if (ngx_stream_top_filter(s, NULL, 1) == NGX_ERROR) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (c->buffered && ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+    }
+}
+
+static void
+ngx_stream_nginxcraft_queue_cleanup(void *data)
+{
+    ngx_stream_nginxcraft_queue_wait_t  *qw = data;
+
+    if (qw->event.timer_set) {
+        ngx_del_timer(&qw->event);
+    }
+
+    ngx_stream_nginxcraft_queue_leave(qw);
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_queue_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_stream_nginxcraft_queue_zone_t  *ozone = data;
+
+    size_t                               len;
+    ngx_stream_nginxcraft_queue_zone_t  *zone;
+
+    zone = shm_zone->data;
+
+    if (ozone) {
+        zone->sh = ozone->sh;
+        zone->shpool = ozone->shpool;
+        return NGX_OK;
+    }
+
+    zone->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        zone->sh = zone->shpool->data;
+        return NGX_OK;
+    }
+
+    zone->sh = ngx_slab_alloc(zone->shpool,
+                              sizeof(ngx_stream_nginxcraft_queue_shctx_t));
+
+    if (zone->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    zone->shpool->data = zone->sh;
+
+    ngx_rbtree_init(&zone->sh->rbtree, &zone->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    len = sizeof(" in nginxcraft_queue zone \"\"") + shm_zone->shm.name.len;
+
+    zone->shpool->log_ctx = ngx_slab_alloc(zone->shpool, len);
+
+    if (zone->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(zone->shpool->log_ctx, " in nginxcraft_queue zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+/* finds the upstreams given with upstream=, once they are all known */
+ngx_int_t
+ngx_stream_nginxcraft_queue_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                           i, j;
+    ngx_stream_nginxcraft_queue_t      **queuep, *queue;
+    ngx_stream_upstream_srv_conf_t     **uscfp;
+    ngx_stream_nginxcraft_srv_conf_t    *nscf;
+    ngx_stream_upstream_main_conf_t     *umcf;
+    ngx_stream_nginxcraft_main_conf_t   *nmcf;
+
+    nmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_nginxcraft_module);
+    umcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_upstream_module);
+
+    queuep = nmcf->queues.elts;
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < nmcf->queues.nelts; i++) {
+        queue = queuep[i];
+
+        if (queue->upstream.len == 0) {
+            continue;
+        }
+
+        for (j = 0; j < umcf->upstreams.nelts; j++) {
+
+            if (uscfp[j]->srv_conf == NULL
+                || uscfp[j]->host.len != queue->upstream.len
+                || ngx_strncmp(uscfp[j]->host.data, queue->upstream.data,
+                               queue->upstream.len) != 0)
+            {
+                continue;
+            }
+
+            nscf = ngx_stream_conf_upstream_srv_conf(uscfp[j],
+                                                     ngx_stream_nginxcraft_module);
+
+            /* both modes keep the player counts of the peers */
+            queue->poll = nscf->poll;
+
+            break;
+        }
+
+        if (queue->poll == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "upstream \"%V\" of \"nginxcraft_queue\" "
+                               "has neither \"nginxcraft_players\" "
+                               "nor \"nginxcraft_check\"",
+                               &queue->upstream);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+char *
+ngx_stream_nginxcraft_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t    *nscf = conf;
+
+    u_char                              *p;
+    ssize_t                              size;
+    ngx_int_t                            n;
+    ngx_str_t                           *value, name, s, message;
+    ngx_uint_t                           i;
+    ngx_shm_zone_t                      *shm_zone;
+    ngx_stream_nginxcraft_queue_t       *queue, **queuep;
+    ngx_stream_nginxcraft_queue_zone_t  *zone;
+    ngx_stream_nginxcraft_main_conf_t   *nmcf;
+
+    if (nscf->queue != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        nscf->queue = NULL;
+        return NGX_CONF_OK;
+    }
+
+    queue = ngx_pcalloc(cf->pool, sizeof(ngx_stream_nginxcraft_queue_t));
+
+    if (queue == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    size = 0;
+    queue->max = 1000;
+    queue->timeout = 60000;
+    queue->interval = 5000;
+    message = ngx_stream_nginxcraft_queue_message;
+    ngx_str_null(&name);
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+            name.len = value[i].len - 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p) {
+                name.len = p - name.data;
+
+                s.data = p + 1;
+                s.len = value[i].data + value[i].len - s.data;
+
+                size = ngx_parse_size(&s);
+
+                if (size == NGX_ERROR) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "invalid zone size \"%V\"", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+
+                if (size < (ssize_t) (8 * ngx_pagesize)) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "zone \"%V\" is too small", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+            }
+
+            if (name.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone name \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "slots=", 6) == 0) {
+
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+
+            if (n <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid slots value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            queue->slots = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "upstream=", 9) == 0) {
+            queue->upstream.data = value[i].data + 9;
+            queue->upstream.len = value[i].len - 9;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+
+            n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+
+            if (n <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            queue->max = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+
+            queue->timeout = ngx_parse_time(&s, 0);
+
+            if (queue->timeout == (ngx_msec_t) NGX_ERROR || queue->timeout == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid timeout \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.data = value[i].data + 9;
+            s.len = value[i].len - 9;
+
+            queue->interval = ngx_parse_time(&s, 0);
+
+            if (queue->interval == (ngx_msec_t) NGX_ERROR
+                || queue->interval == 0
+                || queue->interval > NGX_STREAM_NGINXCRAFT_QUEUE_SILENT)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid interval \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "message=", 8) == 0) {
+            message.data = value[i].data + 8;
+            message.len = value[i].len - 8;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if ((queue->slots == 0) == (queue->upstream.len == 0)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have either \"slots\" or \"upstream\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_stream_nginxcraft_disconnect_packet(cf->pool, &message,
+                                                &queue->disconnect)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_stream_nginxcraft_module);
+
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data && shm_zone->init != ngx_stream_nginxcraft_queue_init_zone) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is already used by another directive",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data == NULL) {
+        zone = ngx_pcalloc(cf->pool, sizeof(ngx_stream_nginxcraft_queue_zone_t));
+
+        if (zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        shm_zone->init = ngx_stream_nginxcraft_queue_init_zone;
+        shm_zone->data = zone;
+    }
+
+    queue->shm_zone = shm_zone;
+
+    nmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_nginxcraft_module);
+
+    queuep = ngx_array_push(&nmcf->queues);
+
+    if (queuep == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *queuep = queue;
+    nscf->queue = queue;
+
+    return NGX_CONF_OK;
+}
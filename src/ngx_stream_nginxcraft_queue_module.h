@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_queue_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_QUEUE_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_QUEUE_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+struct ngx_stream_nginxcraft_queue_s {
+    ngx_shm_zone_t                  *shm_zone;
+    /* logins let through at once, or the free slots polled from upstream */
+    ngx_uint_t                       slots;
+    ngx_str_t                        upstream;
+    ngx_stream_nginxcraft_poll_t    *poll;
+    /* logins waiting per server */
+    ngx_uint_t                       max;
+    ngx_msec_t                       timeout;
+    ngx_msec_t                       interval;
+    ngx_str_t                        disconnect;
+};
+
+char *ngx_stream_nginxcraft_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_stream_nginxcraft_queue_init(ngx_conf_t *cf);
+ngx_int_t ngx_stream_nginxcraft_queue_handler(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx);
+
+#endif /* NGX_STREAM_NGINXCRAFT_QUEUE_MODULE_H */
@@ -0,0 +1,514 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_relay_module.c
+ *
+ * Relays routed sessions with splice() once the proxy has sent what was
+ * preread. Past the handshake the stream is opaque, usually compressed
+ * and encrypted, so there is nothing to gain from reading it into user
+ * space: each direction is moved from one socket into a pipe and from
+ * the pipe into the other socket, and the bytes stay in the kernel.
+ *
+ * The proxy module does not know about this. Its writes are watched
+ * through a stream filter, and once it has connected and nothing is left
+ * in its buffers the event handlers of both connections are taken over.
+ * Sessions it cannot take, TLS on either side or rate limited, are left
+ * to the proxy, as are sessions when pipes cannot be created.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_relay_module.h"
+
+#if (NGX_LINUX)
+
+/* at most a default pipe at a time */
+#define NGX_STREAM_NGINXCRAFT_RELAY_CHUNK    65536
+
+#define NGX_STREAM_NGINXCRAFT_RELAY_PENDING  0
+#define NGX_STREAM_NGINXCRAFT_RELAY_ACTIVE   1
+#define NGX_STREAM_NGINXCRAFT_RELAY_OFF      2
+
+typedef struct {
+    ngx_connection_t              *src;
+    ngx_connection_t              *dst;
+    int                            pipe[2];
+    /* bytes read from src and not yet written to dst */
+    size_t                         pending;
+    off_t                         *received;
+    unsigned                       from_upstream:1;
+} ngx_stream_nginxcraft_relay_half_t;
+
+struct ngx_stream_nginxcraft_relay_s {
+    ngx_stream_session_t                *session;
+    ngx_uint_t                           state;
+    ngx_event_t                          event;
+    /* to the upstream, and to the client */
+    ngx_stream_nginxcraft_relay_half_t   half[2];
+};
+
+static ngx_int_t ngx_stream_nginxcraft_relay_filter(ngx_stream_session_t *s,
+    ngx_chain_t *in, ngx_uint_t from_upstream);
+static void ngx_stream_nginxcraft_relay_start(ngx_event_t *ev);
+static void ngx_stream_nginxcraft_relay_handler(ngx_event_t *ev);
+static void ngx_stream_nginxcraft_relay_process(ngx_stream_nginxcraft_relay_t *relay);
+static ngx_int_t ngx_stream_nginxcraft_relay_splice(ngx_stream_nginxcraft_relay_t *relay,
+    ngx_stream_nginxcraft_relay_half_t *half);
+static void ngx_stream_nginxcraft_relay_finalize(ngx_stream_session_t *s,
+    ngx_uint_t rc);
+static void ngx_stream_nginxcraft_relay_cleanup(void *data);
+
+static ngx_stream_filter_pt  ngx_stream_next_filter;
+
+static ngx_int_t
+ngx_stream_nginxcraft_relay_filter(ngx_stream_session_t *s, ngx_chain_t *in,
+    ngx_uint_t from_upstream)
+{
+    ngx_int_t                          rc;
+    ngx_connection_t                  *c;
+    ngx_pool_cleanup_t                *cln;
+    ngx_stream_nginxcraft_ctx_t       *ctx;
+    ngx_stream_nginxcraft_relay_t     *relay;
+    ngx_stream_nginxcraft_srv_conf_t  *nscf;
+
+    rc = ngx_stream_next_filter(s, in, from_upstream);
+
+    if (rc == NGX_ERROR) {
+        return rc;
+    }
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+
+    if (nscf->relay != NGX_STREAM_NGINXCRAFT_RELAY_SPLICE) {
+        return rc;
+    }
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+
+    /* status pings are over before a relay would pay off */
+
+    if (ctx == NULL || !ctx->routed || ctx->handshake.nextState == 1) {
+        return rc;
+    }
+
+    relay = ctx->relay;
+    c = s->connection;
+
+    if (relay == NULL) {
+        relay = ngx_pcalloc(c->pool, sizeof(ngx_stream_nginxcraft_relay_t));
+
+        if (relay == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln = ngx_pool_cleanup_add(c->pool, 0);
+
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        relay->session = s;
+        relay->half[0].pipe[0] = -1;
+        relay->half[0].pipe[1] = -1;
+        relay->half[1].pipe[0] = -1;
+        relay->half[1].pipe[1] = -1;
+
+        relay->event.handler = ngx_stream_nginxcraft_relay_start;
+        relay->event.data = relay;
+        relay->event.log = c->log;
+
+        cln->handler = ngx_stream_nginxcraft_relay_cleanup;
+        cln->data = relay;
+
+        ctx->relay = relay;
+    }
+
+    /* the proxy is still in the middle of this write, take over after it */
+
+    if (relay->state == NGX_STREAM_NGINXCRAFT_RELAY_PENDING && !relay->event.posted) {
+        ngx_post_event(&relay->event, &ngx_posted_events);
+    }
+
+    return rc;
+}
+
+static void
+ngx_stream_nginxcraft_relay_start(ngx_event_t *ev)
+{
+    ngx_uint_t                      i;
+    ngx_event_t                    *events[4];
+    ngx_connection_t               *c, *pc;
+    ngx_stream_upstream_t          *u;
+    ngx_stream_session_t           *s;
+    ngx_stream_nginxcraft_relay_t  *relay;
+
+    relay = ev->data;
+    s = relay->session;
+    c = s->connection;
+    u = s->upstream;
+
+    if (relay->state != NGX_STREAM_NGINXCRAFT_RELAY_PENDING
+        || u == NULL || !u->connected || u->peer.connection == NULL)
+    {
+        return;
+    }
+
+    pc = u->peer.connection;
+
+    /* a rate not hit yet still has to be kept to, not only a delayed read */
+
+    if (c->type != SOCK_STREAM
+        || u->upload_rate || u->download_rate
+        || c->read->delayed || pc->read->delayed
+        || c->read->eof || pc->read->eof
+#if (NGX_SSL)
+        || c->ssl || pc->ssl
+#endif
+       )
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "nginxcraft relay left to the proxy");
+
+        relay->state = NGX_STREAM_NGINXCRAFT_RELAY_OFF;
+        return;
+    }
+
+    /* the next write of the proxy tries again */
+
+    if (u->upstream_out || u->upstream_busy
+        || u->downstream_out || u->downstream_busy
+        || u->upstream_buf.pos != u->upstream_buf.last
+        || u->downstream_buf.pos != u->downstream_buf.last
+        || c->buffered || pc->buffered)
+    {
+        return;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (pipe2(relay->half[i].pipe, O_NONBLOCK|O_CLOEXEC) == -1) {
+            ngx_log_error(NGX_LOG_WARN, c->log, ngx_errno,
+                          "pipe2() failed, relaying without splice");
+
+            relay->state = NGX_STREAM_NGINXCRAFT_RELAY_OFF;
+            return;
+        }
+    }
+
+    relay->half[0].src = c;
+    relay->half[0].dst = pc;
+    relay->half[0].received = &s->received;
+
+    relay->half[1].src = pc;
+    relay->half[1].dst = c;
+    relay->half[1].received = &u->received;
+    relay->half[1].from_upstream = 1;
+
+    events[0] = c->read;
+    events[1] = c->write;
+    events[2] = pc->read;
+    events[3] = pc->write;
+
+    for (i = 0; i < 4; i++) {
+        if (events[i]->timer_set) {
+            ngx_del_timer(events[i]);
+        }
+
+        events[i]->handler = ngx_stream_nginxcraft_relay_handler;
+    }
+
+    relay->state = NGX_STREAM_NGINXCRAFT_RELAY_ACTIVE;
+
+    c->log->action = "splicing connection";
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0, "nginxcraft relay started");
+
+    ngx_stream_nginxcraft_relay_process(relay);
+}
+
+static void
+ngx_stream_nginxcraft_relay_handler(ngx_event_t *ev)
+{
+    ngx_connection_t             *c;
+    ngx_stream_session_t         *s;
+    ngx_stream_nginxcraft_ctx_t  *ctx;
+
+    c = ev->data;
+    s = c->data;
+
+    if (ev->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
+        ngx_stream_nginxcraft_relay_finalize(s, NGX_STREAM_OK);
+        return;
+    }
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+
+    ngx_stream_nginxcraft_relay_process(ctx->relay);
+}
+
+static void
+ngx_stream_nginxcraft_relay_process(ngx_stream_nginxcraft_relay_t *relay)
+{
+    ngx_int_t                          rc;
+    ngx_uint_t                         i;
+    ngx_connection_t                  *c, *pc;
+    ngx_stream_session_t              *s;
+    ngx_stream_upstream_t             *u;
+    ngx_stream_nginxcraft_srv_conf_t  *nscf;
+
+    s = relay->session;
+    c = s->connection;
+    u = s->upstream;
+    pc = u->peer.connection;
+
+    for (i = 0; i < 2; i++) {
+        rc = ngx_stream_nginxcraft_relay_splice(relay, &relay->half[i]);
+
+        if (rc == NGX_AGAIN) {
+            continue;
+        }
+
+        /* as the proxy does, either side closing ends the session */
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "%s disconnected, bytes from/to client:%O/%O"
+                      ", bytes from/to upstream:%O/%O",
+                      relay->half[i].from_upstream ? "upstream" : "client",
+                      s->received, c->sent, u->received, pc->sent);
+
+        ngx_stream_nginxcraft_relay_finalize(s, NGX_STREAM_OK);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK
+        || ngx_handle_read_event(pc->read, 0) != NGX_OK
+        || ngx_handle_write_event(c->write, 0) != NGX_OK
+        || ngx_handle_write_event(pc->write, 0) != NGX_OK)
+    {
+        ngx_stream_nginxcraft_relay_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+
+    ngx_add_timer(c->read, nscf->relay_timeout);
+}
+
+/*
+ * Moves what there is from one side to the other. NGX_AGAIN when either
+ * socket would block, NGX_DONE when src has closed and everything it
+ * sent is written, NGX_ERROR if a socket failed.
+ */
+static ngx_int_t
+ngx_stream_nginxcraft_relay_splice(ngx_stream_nginxcraft_relay_t *relay,
+    ngx_stream_nginxcraft_relay_half_t *half)
+{
+    ssize_t                 n;
+    ngx_err_t               err;
+    ngx_stream_upstream_t  *u;
+
+    for ( ;; ) {
+
+        if (half->pending) {
+            n = splice(half->pipe[0], NULL, half->dst->fd, NULL, half->pending,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EAGAIN) {
+                    half->dst->write->ready = 0;
+                    return NGX_AGAIN;
+                }
+
+                half->dst->write->error = 1;
+                ngx_connection_error(half->dst, err, "splice() to socket failed");
+                return NGX_ERROR;
+            }
+
+            half->pending -= n;
+            half->dst->sent += n;
+
+            continue;
+        }
+
+        if (half->src->read->eof) {
+            return NGX_DONE;
+        }
+
+        /* the pipe is empty here, so blocking can only be the socket */
+
+        n = splice(half->src->fd, NULL, half->pipe[1], NULL,
+                   NGX_STREAM_NGINXCRAFT_RELAY_CHUNK,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        if (n == 0) {
+            half->src->read->eof = 1;
+            return NGX_DONE;
+        }
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EAGAIN) {
+                half->src->read->ready = 0;
+                return NGX_AGAIN;
+            }
+
+            half->src->read->eof = 1;
+            half->src->read->error = 1;
+            ngx_connection_error(half->src, err, "splice() from socket failed");
+            return NGX_ERROR;
+        }
+
+        if (half->from_upstream) {
+            u = relay->session->upstream;
+
+            if (u->state && u->state->first_byte_time == (ngx_msec_t) -1) {
+                u->state->first_byte_time = ngx_current_msec - u->start_time;
+            }
+        }
+
+        half->pending += n;
+        *half->received += n;
+    }
+}
+
+/* what ngx_stream_proxy_finalize() does for a connected TCP upstream */
+static void
+ngx_stream_nginxcraft_relay_finalize(ngx_stream_session_t *s, ngx_uint_t rc)
+{
+    ngx_connection_t       *pc;
+    ngx_stream_upstream_t  *u;
+
+    u = s->upstream;
+    pc = u->peer.connection;
+
+    if (u->state) {
+        if (u->state->response_time == (ngx_msec_t) -1) {
+            u->state->response_time = ngx_current_msec - u->start_time;
+        }
+
+        if (pc) {
+            u->state->bytes_received = u->received;
+            u->state->bytes_sent = pc->sent;
+        }
+    }
+
+    if (u->peer.free && u->peer.sockaddr) {
+        u->peer.free(&u->peer, u->peer.data, 0);
+        u->peer.sockaddr = NULL;
+    }
+
+    if (pc) {
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                       "close nginxcraft relay upstream connection: %d",
+                       pc->fd);
+
+        ngx_close_connection(pc);
+        u->peer.connection = NULL;
+    }
+
+    ngx_stream_finalize_session(s, rc);
+}
+
+static void
+ngx_stream_nginxcraft_relay_cleanup(void *data)
+{
+    ngx_stream_nginxcraft_relay_t  *relay = data;
+
+    ngx_uint_t  i;
+
+    if (relay->event.posted) {
+        ngx_delete_posted_event(&relay->event);
+    }
+
+    for (i = 0; i < 4; i++) {
+        if (relay->half[i / 2].pipe[i % 2] != -1) {
+            (void) close(relay->half[i / 2].pipe[i % 2]);
+        }
+    }
+}
+
+ngx_int_t
+ngx_stream_nginxcraft_relay_init(ngx_conf_t *cf)
+{
+    ngx_stream_next_filter = ngx_stream_top_filter;
+    ngx_stream_top_filter = ngx_stream_nginxcraft_relay_filter;
+
+    return NGX_OK;
+}
+
+#else
+
+ngx_int_t
+ngx_stream_nginxcraft_relay_init(ngx_conf_t *cf)
+{
+    return NGX_OK;
+}
+
+#endif
+
+char *
+ngx_stream_nginxcraft_relay(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+
+    if (nscf->relay != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "copy") == 0) {
+        nscf->relay = NGX_STREAM_NGINXCRAFT_RELAY_COPY;
+
+    } else if (ngx_strcmp(value[1].data, "splice") == 0) {
+#if (NGX_LINUX)
+        nscf->relay = NGX_STREAM_NGINXCRAFT_RELAY_SPLICE;
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"splice\" is only supported on Linux");
+        return NGX_CONF_ERROR;
+#endif
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+
+            nscf->relay_timeout = ngx_parse_time(&s, 0);
+
+            if (nscf->relay_timeout == (ngx_msec_t) NGX_ERROR
+                || nscf->relay_timeout == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid timeout \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_relay_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_RELAY_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_RELAY_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+#define NGX_STREAM_NGINXCRAFT_RELAY_COPY     0
+#define NGX_STREAM_NGINXCRAFT_RELAY_SPLICE   1
+
+char *ngx_stream_nginxcraft_relay(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_stream_nginxcraft_relay_init(ngx_conf_t *cf);
+
+#endif /* NGX_STREAM_NGINXCRAFT_RELAY_MODULE_H */
@@ -12,29 +12,58 @@
 
 #include "ngx_stream_nginxcraft_module.h"
 #include "ngx_stream_nginxcraft_return_module.h"
+#include "ngx_stream_nginxcraft_metrics_module.h"
 #include "minecraft_funcs.h"
 
+#define NGX_STREAM_NGINXCRAFT_RETURN_CACHE    64
+#define NGX_STREAM_NGINXCRAFT_RETURN_LINGER   2000
+#define NGX_STREAM_NGINXCRAFT_RETURN_DISCARD  512
+
+/*
+ * Disconnect packet built for a rendered text, shared by every session
+ * sending it. The per worker cache holds one reference and each session
+ * holds another until its pool is destroyed.
+ */
+typedef struct {
+    ngx_uint_t     refs;
+    uint32_t       hash;
+    ngx_str_t      text;
+    ngx_str_t      packet;
+} ngx_stream_nginxcraft_return_packet_t;
+
 static void ngx_stream_return_handler(ngx_stream_session_t *s);
 static void ngx_stream_return_write_handler(ngx_event_t *ev);
-static ngx_int_t ngx_stream_nginxcraft_create_disconnect_packet(ngx_connection_t *c,
-    const ngx_str_t *value, ngx_str_t *minecraft_str);
+static void ngx_stream_return_linger_handler(ngx_event_t *rev);
+static ngx_int_t ngx_stream_nginxcraft_return_prepare(ngx_stream_session_t *s,
+    u_char *packet, size_t len);
+static ngx_int_t ngx_stream_nginxcraft_return_cached(ngx_stream_session_t *s,
+    ngx_str_t *text, ngx_str_t *packet);
+static void ngx_stream_nginxcraft_return_release(void *data);
+
+static ngx_stream_nginxcraft_return_packet_t
+    *ngx_stream_nginxcraft_return_cache[NGX_STREAM_NGINXCRAFT_RETURN_CACHE];
 
 static void
 ngx_stream_return_handler(ngx_stream_session_t *s)
 {
-    ngx_str_t                      text;
-    ngx_str_t                      minecraft_str;
-    ngx_buf_t                     *b;
-    ngx_connection_t              *c;
-    ngx_stream_nginxcraft_ctx_t       *ctx;
+    ngx_str_t                          text;
+    ngx_str_t                          packet;
+    ngx_connection_t                  *c;
     ngx_stream_nginxcraft_srv_conf_t  *nscf;
 
     c = s->connection;
 
     c->log->action = "returning text";
 
+    ngx_stream_nginxcraft_metrics_reject(s, NGX_STREAM_NGINXCRAFT_METRICS_RETURN);
+
     nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
 
+    if (nscf->disconnect.data) {
+        packet = nscf->disconnect;
+        goto send;
+    }
+
     if (ngx_stream_complex_value(s, &nscf->text, &text) != NGX_OK) {
         ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return;
@@ -48,34 +77,83 @@ ngx_stream_return_handler(ngx_stream_session_t *s)
         return;
     }
 
-    ctx = ngx_pcalloc(c->pool, sizeof(ngx_stream_nginxcraft_ctx_t));
-    if (ctx == NULL) {
+    if (ngx_stream_nginxcraft_return_cached(s, &text, &packet) != NGX_OK) {
         ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return;
     }
 
-    ngx_stream_set_ctx(s, ctx, ngx_stream_nginxcraft_module);
+send:
 
-    b = ngx_calloc_buf(c->pool);
-    if (b == NULL) {
+    if (ngx_stream_nginxcraft_return_prepare(s, packet.data, packet.len) != NGX_OK) {
         ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return;
     }
 
-    if (ngx_stream_nginxcraft_create_disconnect_packet(c, &text, &minecraft_str) != NGX_OK) {
-        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
-        return;
+    ngx_stream_return_write_handler(c->write);
+}
+
+/*
+ * Sends a prebuilt disconnect packet and closes the session, for use from
+ * the preread phase. The packet must outlive the session.
+ */
+ngx_int_t
+ngx_stream_nginxcraft_disconnect(ngx_stream_session_t *s, ngx_str_t *packet)
+{
+    ngx_connection_t  *c;
+
+    c = s->connection;
+
+    c->log->action = "returning text";
+
+    if (ngx_stream_nginxcraft_return_prepare(s, packet->data, packet->len) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* the preread phase removes its read timer once this returns */
+    ngx_post_event(c->write, &ngx_posted_events);
+
+    return NGX_DONE;
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_return_prepare(ngx_stream_session_t *s, u_char *packet,
+    size_t len)
+{
+    ngx_buf_t                    *b;
+    ngx_connection_t             *c;
+    ngx_stream_nginxcraft_ctx_t  *ctx;
+
+    c = s->connection;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(c->pool, sizeof(ngx_stream_nginxcraft_ctx_t));
+
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->pool = c->pool;
+        ctx->log = c->log;
+        ngx_stream_set_ctx(s, ctx, ngx_stream_nginxcraft_module);
+    }
+
+    b = ngx_calloc_buf(c->pool);
+
+    if (b == NULL) {
+        return NGX_ERROR;
     }
 
     b->memory = 1;
-    b->pos = minecraft_str.data;
-    b->last = minecraft_str.data + minecraft_str.len;
+    b->pos = packet;
+    b->last = packet + len;
     b->last_buf = 1;
 
     ctx->out = ngx_alloc_chain_link(c->pool);
+
     if (ctx->out == NULL) {
-        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
-        return;
+        return NGX_ERROR;
     }
 
     ctx->out->buf = b;
@@ -83,7 +161,13 @@ ngx_stream_return_handler(ngx_stream_session_t *s)
 
     c->write->handler = ngx_stream_return_write_handler;
 
-    ngx_stream_return_write_handler(c->write);
+    /*
+     * Whatever the client sends while the disconnect is pending is
+     * discarded, it must not run the phases again.
+     */
+    c->read->handler = ngx_stream_return_linger_handler;
+
+    return NGX_OK;
 }
 
 
@@ -115,7 +199,21 @@ ngx_stream_return_write_handler(ngx_event_t *ev)
     if (!c->buffered) {
         ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
                        "stream return done sending");
-        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+
+        if (ev->timer_set) {
+            ngx_del_timer(ev);
+        }
+
+        /*
+         * Clients close the connection once they have read the disconnect,
+         * waiting for that leaves TIME_WAIT on their side instead of ours.
+         */
+
+        c->read->handler = ngx_stream_return_linger_handler;
+
+        ngx_add_timer(c->read, NGX_STREAM_NGINXCRAFT_RETURN_LINGER);
+
+        ngx_stream_return_linger_handler(c->read);
         return;
     }
 
@@ -124,7 +222,52 @@ ngx_stream_return_write_handler(ngx_event_t *ev)
         return;
     }
 
-    ngx_add_timer(ev, 5000);
+    if (!ev->timer_set) {
+        ngx_add_timer(ev, 5000);
+    }
+}
+
+static void
+ngx_stream_return_linger_handler(ngx_event_t *rev)
+{
+    ssize_t                n;
+    struct linger          linger;
+    ngx_connection_t      *c;
+    ngx_stream_session_t  *s;
+    u_char                 buffer[NGX_STREAM_NGINXCRAFT_RETURN_DISCARD];
+
+    c = rev->data;
+    s = c->data;
+
+    if (rev->timedout) {
+        /* the client did not close in time, reset rather than linger */
+        linger.l_onoff = 1;
+        linger.l_linger = 0;
+
+        if (setsockopt(c->fd, SOL_SOCKET, SO_LINGER,
+                       (const void *) &linger, sizeof(struct linger)) == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                          "setsockopt(SO_LINGER) failed");
+        }
+
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    do {
+        n = c->recv(c, buffer, NGX_STREAM_NGINXCRAFT_RETURN_DISCARD);
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_stream_finalize_session(s, NGX_STREAM_OK);
+            return;
+        }
+
+    } while (rev->ready);
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+    }
 }
 
 char *
@@ -152,6 +295,16 @@ ngx_stream_nginxcraft_return(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (nscf->text.lengths == NULL && value[1].len) {
+        /* no variables, the packet is the same for every session */
+        if (ngx_stream_nginxcraft_disconnect_packet(cf->pool, &value[1],
+                                                    &nscf->disconnect)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     cscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_core_module);
 
     cscf->handler = ngx_stream_return_handler;
@@ -159,13 +312,13 @@ ngx_stream_nginxcraft_return(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     return NGX_CONF_OK;
 }
 
-static ngx_int_t
-ngx_stream_nginxcraft_create_disconnect_packet(ngx_connection_t *c, const ngx_str_t *value,
+ngx_int_t
+ngx_stream_nginxcraft_disconnect_packet(ngx_pool_t *pool, const ngx_str_t *value,
     ngx_str_t *minecraft_str)
 {
 
     minecraft_str->len = get_disconnect_packet_size(value->len);
-    minecraft_str->data = ngx_pcalloc(c->pool, minecraft_str->len);
+    minecraft_str->data = ngx_pnalloc(pool, minecraft_str->len);
 
     if (minecraft_str->data == NULL) {
         return NGX_ERROR;
@@ -175,3 +328,76 @@ ngx_stream_nginxcraft_create_disconnect_packet(ngx_connection_t *c, const ngx_st
 
     return NGX_OK;
 }
+
+/*
+ * Looks the rendered text up in the per worker cache, building and
+ * storing the packet on a miss.
+ */
+static ngx_int_t
+ngx_stream_nginxcraft_return_cached(ngx_stream_session_t *s, ngx_str_t *text,
+    ngx_str_t *packet)
+{
+    size_t                                  len;
+    uint32_t                                hash;
+    ngx_pool_cleanup_t                     *cln;
+    ngx_stream_nginxcraft_return_packet_t  *rp, **slot;
+
+    hash = ngx_crc32_short(text->data, text->len);
+    slot = &ngx_stream_nginxcraft_return_cache[hash % NGX_STREAM_NGINXCRAFT_RETURN_CACHE];
+
+    rp = *slot;
+
+    if (rp == NULL || rp->hash != hash || rp->text.len != text->len
+        || ngx_memcmp(rp->text.data, text->data, text->len) != 0)
+    {
+        len = get_disconnect_packet_size(text->len);
+
+        rp = ngx_alloc(sizeof(ngx_stream_nginxcraft_return_packet_t)
+                       + text->len + len, s->connection->log);
+
+        if (rp == NULL) {
+            return NGX_ERROR;
+        }
+
+        rp->refs = 1;
+        rp->hash = hash;
+        rp->text.len = text->len;
+        rp->text.data = (u_char *) rp + sizeof(ngx_stream_nginxcraft_return_packet_t);
+        rp->packet.len = len;
+        rp->packet.data = rp->text.data + text->len;
+
+        ngx_memcpy(rp->text.data, text->data, text->len);
+        create_disconnect_packet(rp->packet.data, text->data, text->len);
+
+        if (*slot) {
+            ngx_stream_nginxcraft_return_release(*slot);
+        }
+
+        *slot = rp;
+    }
+
+    cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    rp->refs++;
+
+    cln->handler = ngx_stream_nginxcraft_return_release;
+    cln->data = rp;
+
+    *packet = rp->packet;
+
+    return NGX_OK;
+}
+
+static void
+ngx_stream_nginxcraft_return_release(void *data)
+{
+    ngx_stream_nginxcraft_return_packet_t  *rp = data;
+
+    if (--rp->refs == 0) {
+        ngx_free(rp);
+    }
+}
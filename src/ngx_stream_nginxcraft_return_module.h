@@ -13,5 +13,8 @@
 #include <ngx_stream.h>
 
 char *ngx_stream_nginxcraft_return(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_stream_nginxcraft_disconnect(ngx_stream_session_t *s, ngx_str_t *packet);
+ngx_int_t ngx_stream_nginxcraft_disconnect_packet(ngx_pool_t *pool, const ngx_str_t *value,
+    ngx_str_t *minecraft_str);
 
 #endif /* NGX_STREAM_NGINXCRAFT_RETURN_MODULE_H */
@@ -0,0 +1,928 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_routes_module.c
+ *
+ * A table of hostnames and upstreams in shared memory that is changed at
+ * run time through a control server and consulted by $minecraft_upstream
+ * before nginxcraft_map.
+ *
+ * The zone holds two copies of the table. An update copies the current
+ * one into the other with the change applied, makes it current and bumps
+ * the version; updates are serialized by the zone mutex. Lookups take no
+ * lock: they read the version, look in the current copy and read the
+ * version again, and start over if it moved, as a copy can only be
+ * rewritten after the version it was current in has passed.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_routes_module.h"
+#include "minecraft_funcs.h"
+
+/* longest upstream name, as for hostnames */
+#define NGX_STREAM_NGINXCRAFT_ROUTES_NAME_LEN  255
+
+/* longest command line, and how long the control connection may be idle */
+#define NGX_STREAM_NGINXCRAFT_ROUTES_LINE      1024
+#define NGX_STREAM_NGINXCRAFT_ROUTES_TIMEOUT   60000
+
+typedef struct {
+    /* 0 if free */
+    uint32_t           hash;
+    u_short            host_len;
+    u_short            upstream_len;
+    /* hostname and upstream, one after the other in the heap */
+    uint32_t           offset;
+} ngx_stream_nginxcraft_routes_slot_t;
+
+typedef struct {
+    /* fixed when the zone is created, a power of two */
+    ngx_uint_t                            nslots;
+    size_t                                size;
+    ngx_stream_nginxcraft_routes_slot_t  *slots;
+    u_char                               *heap;
+
+    ngx_uint_t                            entries;
+    size_t                                used;
+} ngx_stream_nginxcraft_routes_table_t;
+
+typedef struct {
+    ngx_atomic_t                          version;
+    ngx_atomic_t                          current;
+    ngx_stream_nginxcraft_routes_table_t  table[2];
+} ngx_stream_nginxcraft_routes_sh_t;
+
+typedef struct {
+    ngx_stream_nginxcraft_routes_sh_t    *sh;
+    ngx_slab_pool_t                      *shpool;
+} ngx_stream_nginxcraft_routes_zone_t;
+
+static ngx_stream_nginxcraft_routes_slot_t *ngx_stream_nginxcraft_routes_find(
+    ngx_stream_nginxcraft_routes_table_t *table, ngx_str_t *host, uint32_t hash,
+    ngx_stream_nginxcraft_routes_slot_t *copy);
+static ngx_int_t ngx_stream_nginxcraft_routes_insert(
+    ngx_stream_nginxcraft_routes_table_t *table, ngx_str_t *host, uint32_t hash,
+    ngx_str_t *upstream);
+static ngx_int_t ngx_stream_nginxcraft_routes_update(
+    ngx_stream_nginxcraft_routes_zone_t *zone, ngx_str_t *host,
+    ngx_str_t *upstream, ngx_atomic_uint_t *version);
+static uint32_t ngx_stream_nginxcraft_routes_hash(ngx_str_t *host);
+static void ngx_stream_nginxcraft_routes_api_handler(ngx_stream_session_t *s);
+static void ngx_stream_nginxcraft_routes_api_read_handler(ngx_event_t *rev);
+static void ngx_stream_nginxcraft_routes_api_write_handler(ngx_event_t *wev);
+static ngx_chain_t *ngx_stream_nginxcraft_routes_api_command(
+    ngx_stream_session_t *s, u_char *line, size_t len);
+static ngx_chain_t *ngx_stream_nginxcraft_routes_api_reply(ngx_pool_t *pool,
+    const char *fmt, ...);
+static ngx_chain_t *ngx_stream_nginxcraft_routes_api_list(ngx_pool_t *pool,
+    ngx_stream_nginxcraft_routes_zone_t *zone, ngx_str_t *host);
+static ngx_int_t ngx_stream_nginxcraft_routes_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+/*
+ * Looks up a lowercased hostname. NGX_DECLINED if it has no route, the
+ * upstream is copied into the pool otherwise.
+ */
+ngx_int_t
+ngx_stream_nginxcraft_routes_lookup(ngx_shm_zone_t *shm_zone, ngx_pool_t *pool,
+    ngx_str_t *host, ngx_str_t *upstream)
+{
+    size_t                                 len;
+    uint32_t                               hash;
+    ngx_uint_t                             found;
+    ngx_atomic_uint_t                      version;
+    ngx_stream_nginxcraft_routes_sh_t     *sh;
+    ngx_stream_nginxcraft_routes_slot_t    slot;
+    ngx_stream_nginxcraft_routes_zone_t   *zone;
+    ngx_stream_nginxcraft_routes_table_t  *table;
+    u_char                                 buf[NGX_STREAM_NGINXCRAFT_ROUTES_NAME_LEN];
+
+    zone = shm_zone->data;
+    sh = zone->sh;
+
+    hash = ngx_stream_nginxcraft_routes_hash(host);
+
+    for ( ;; ) {
+        version = sh->version;
+
+        ngx_memory_barrier();
+
+        table = &sh->table[sh->current & 1];
+
+        /*
+         * the copy may be rewritten under us, nothing read is trusted yet,
+         * and the slot is only used through the snapshot find took of it
+         */
+
+        found = (ngx_stream_nginxcraft_routes_find(table, host, hash, &slot)
+                 != NULL);
+        len = 0;
+
+        if (found) {
+            len = ngx_min(slot.upstream_len, NGX_STREAM_NGINXCRAFT_ROUTES_NAME_LEN);
+
+            if ((size_t) slot.offset + slot.host_len + len <= table->size) {
+                ngx_memcpy(buf, table->heap + slot.offset + slot.host_len, len);
+            }
+        }
+
+        ngx_memory_barrier();
+
+        if (sh->version == version) {
+            break;
+        }
+    }
+
+    if (!found) {
+        return NGX_DECLINED;
+    }
+
+    upstream->data = ngx_pnalloc(pool, len);
+
+    if (upstream->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(upstream->data, buf, len);
+    upstream->len = len;
+
+    return NGX_OK;
+}
+
+/*
+ * Each slot probed is read once into copy, which the checks and the
+ * caller use, as lookups run without the lock while it may change.
+ */
+static ngx_stream_nginxcraft_routes_slot_t *
+ngx_stream_nginxcraft_routes_find(ngx_stream_nginxcraft_routes_table_t *table,
+    ngx_str_t *host, uint32_t hash, ngx_stream_nginxcraft_routes_slot_t *copy)
+{
+    ngx_uint_t                                     i, n;
+    volatile ngx_stream_nginxcraft_routes_slot_t  *slot;
+
+    i = hash & (table->nslots - 1);
+
+    for (n = 0; n < table->nslots; n++) {
+        slot = &table->slots[i];
+
+        copy->hash = slot->hash;
+        copy->host_len = slot->host_len;
+        copy->upstream_len = slot->upstream_len;
+        copy->offset = slot->offset;
+
+        if (copy->hash == 0) {
+            return NULL;
+        }
+
+        if (copy->hash == hash
+            && copy->host_len == host->len
+            && (size_t) copy->offset + copy->host_len <= table->size
+            && ngx_memcmp(table->heap + copy->offset, host->data, host->len) == 0)
+        {
+            return &table->slots[i];
+        }
+
+        i = (i + 1) & (table->nslots - 1);
+    }
+
+    return NULL;
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_routes_insert(ngx_stream_nginxcraft_routes_table_t *table,
+    ngx_str_t *host, uint32_t hash, ngx_str_t *upstream)
+{
+    u_char                               *p;
+    ngx_uint_t                            i;
+    ngx_stream_nginxcraft_routes_slot_t  *slot;
+
+    /* at most three quarters full, so that misses stop early */
+
+    if (table->entries >= table->nslots / 4 * 3
+        || table->used + host->len + upstream->len > table->size)
+    {
+        return NGX_BUSY;
+    }
+
+    i = hash & (table->nslots - 1);
+
+    while (table->slots[i].hash) {
+        i = (i + 1) & (table->nslots - 1);
+    }
+
+    slot = &table->slots[i];
+
+    slot->host_len = (u_short) host->len;
+    slot->upstream_len = (u_short) upstream->len;
+    slot->offset = (uint32_t) table->used;
+
+    p = ngx_cpymem(table->heap + table->used, host->data, host->len);
+    p = ngx_cpymem(p, upstream->data, upstream->len);
+
+    slot->hash = hash;
+
+    table->used = p - table->heap;
+    table->entries++;
+
+    return NGX_OK;
+}
+
+/*
+ * Sets the upstream of a hostname, removes it if upstream is NULL, or
+ * removes every route if host is NULL. NGX_DECLINED if there is nothing
+ * to remove, NGX_BUSY if the table is full.
+ */
+static ngx_int_t
+ngx_stream_nginxcraft_routes_update(ngx_stream_nginxcraft_routes_zone_t *zone,
+    ngx_str_t *host, ngx_str_t *upstream, ngx_atomic_uint_t *version)
+{
+    uint32_t                               hash;
+    ngx_str_t                              h, u;
+    ngx_uint_t                             i;
+    ngx_stream_nginxcraft_routes_sh_t     *sh;
+    ngx_stream_nginxcraft_routes_slot_t   *slot, copy;
+    ngx_stream_nginxcraft_routes_table_t  *from, *to;
+
+    sh = zone->sh;
+    hash = host ? ngx_stream_nginxcraft_routes_hash(host) : 0;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    from = &sh->table[sh->current & 1];
+    to = &sh->table[(sh->current + 1) & 1];
+
+    if (host && upstream == NULL
+        && ngx_stream_nginxcraft_routes_find(from, host, hash, &copy) == NULL)
+    {
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    ngx_memzero(to->slots, to->nslots * sizeof(ngx_stream_nginxcraft_routes_slot_t));
+    to->entries = 0;
+    to->used = 0;
+
+    for (i = 0; host && i < from->nslots; i++) {
+        slot = &from->slots[i];
+
+        if (slot->hash == 0) {
+            continue;
+        }
+
+        h.len = slot->host_len;
+        h.data = from->heap + slot->offset;
+
+        if (slot->hash == hash && h.len == host->len
+            && ngx_memcmp(h.data, host->data, h.len) == 0)
+        {
+            continue;
+        }
+
+        u.len = slot->upstream_len;
+        u.data = h.data + h.len;
+
+        /* both copies are the same size, what fit in one fits the other */
+        (void) ngx_stream_nginxcraft_routes_insert(to, &h, slot->hash, &u);
+    }
+
+    if (upstream
+        && ngx_stream_nginxcraft_routes_insert(to, host, hash, upstream) != NGX_OK)
+    {
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+        return NGX_BUSY;
+    }
+
+    /* the copy must be complete before it is current */
+
+    ngx_memory_barrier();
+
+    sh->current++;
+
+    ngx_memory_barrier();
+
+    *version = ++sh->version;
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    return NGX_OK;
+}
+
+static uint32_t
+ngx_stream_nginxcraft_routes_hash(ngx_str_t *host)
+{
+    uint32_t  hash;
+
+    hash = ngx_crc32_short(host->data, host->len);
+
+    return hash ? hash : 1;
+}
+
+/*
+ * The control server reads commands a line at a time and answers each
+ * with "ok <version>" or "err <reason>", after the routes for "get" and
+ * "list":
+ *
+ *     set <hostname> <upstream>
+ *     del <hostname>
+ *     get <hostname>
+ *     list
+ *     flush
+ */
+static void
+ngx_stream_nginxcraft_routes_api_handler(ngx_stream_session_t *s)
+{
+    ngx_connection_t  *c;
+
+    c = s->connection;
+
+    c->log->action = "updating routes";
+
+    if (c->buffer == NULL) {
+        c->buffer = ngx_create_temp_buf(c->pool, NGX_STREAM_NGINXCRAFT_ROUTES_LINE);
+
+        if (c->buffer == NULL) {
+            ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+    c->read->handler = ngx_stream_nginxcraft_routes_api_read_handler;
+    c->write->handler = ngx_stream_nginxcraft_routes_api_write_handler;
+
+    ngx_stream_nginxcraft_routes_api_read_handler(c->read);
+}
+
+static void
+ngx_stream_nginxcraft_routes_api_read_handler(ngx_event_t *rev)
+{
+    u_char                *p, *line;
+    ssize_t                n;
+    ngx_buf_t             *b;
+    ngx_chain_t           *out, **ll, *cl;
+    ngx_connection_t      *c;
+    ngx_stream_session_t  *s;
+
+    c = rev->data;
+    s = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    b = c->buffer;
+    out = NULL;
+    ll = &out;
+
+    while (!rev->eof) {
+
+        if (b->last == b->end) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0, "routes command too long");
+            ngx_stream_finalize_session(s, NGX_STREAM_BAD_REQUEST);
+            return;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_stream_finalize_session(s, NGX_STREAM_OK);
+            return;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        b->last += n;
+
+        for ( ;; ) {
+            line = b->pos;
+            p = ngx_strlchr(line, b->last, '\n');
+
+            if (p == NULL) {
+                break;
+            }
+
+            b->pos = p + 1;
+
+            if (p > line && p[-1] == '\r') {
+                p--;
+            }
+
+            if (p == line) {
+                continue;
+            }
+
+            cl = ngx_stream_nginxcraft_routes_api_command(s, line, p - line);
+
+            if (cl == NULL) {
+                ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
+            *ll = cl;
+
+            while (cl->next) {
+                cl = cl->next;
+            }
+
+            ll = &cl->next;
+        }
+
+        b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+        b->pos = b->start;
+    }
+
+    /* the last command may end with the connection instead of a newline */
+
+    if (rev->eof && b->last > b->pos) {
+        cl = ngx_stream_nginxcraft_routes_api_command(s, b->pos, b->last - b->pos);
+
+        if (cl == NULL) {
+            ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        *ll = cl;
+        b->pos = b->last;
+    }
+
+    if (ngx_stream_top_filter(s, out, 1) == NGX_ERROR) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (rev->eof && !c->buffered) {
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    if (c->buffered) {
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+            ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        ngx_add_timer(c->write, NGX_STREAM_NGINXCRAFT_ROUTES_TIMEOUT);
+    }
+
+    if (rev->eof) {
+        return;
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_add_timer(rev, NGX_STREAM_NGINXCRAFT_ROUTES_TIMEOUT);
+}
+
+static void
+ngx_stream_nginxcraft_routes_api_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t      *c;
+    ngx_stream_session_t  *s;
+
+    c = wev->data;
+    s = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    if (ngx_stream_top_filter(s, NULL, 1) == NGX_ERROR) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (c->buffered) {
+        if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+            ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        ngx_add_timer(wev, NGX_STREAM_NGINXCRAFT_ROUTES_TIMEOUT);
+        return;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    if (c->read->eof) {
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+    }
+}
+
+static ngx_chain_t *
+ngx_stream_nginxcraft_routes_api_command(ngx_stream_session_t *s, u_char *line,
+    size_t len)
+{
+    u_char                               *p, *last;
+    ngx_int_t                             rc;
+    ngx_str_t                             args[3], *host, *upstream;
+    ngx_uint_t                            nargs;
+    ngx_connection_t                     *c;
+    ngx_atomic_uint_t                     version;
+    ngx_stream_nginxcraft_srv_conf_t     *nscf;
+    ngx_stream_nginxcraft_routes_zone_t  *zone;
+
+    c = s->connection;
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+    zone = nscf->routes_api->data;
+
+    /* the command and up to two arguments, separated by blanks */
+
+    nargs = 0;
+    last = line + len;
+
+    for (p = line; p < last; ) {
+
+        if (*p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+
+        if (nargs == 3) {
+            return ngx_stream_nginxcraft_routes_api_reply(c->pool,
+                                                          "err too many arguments\n");
+        }
+
+        args[nargs].data = p;
+
+        while (p < last && *p != ' ' && *p != '\t') {
+            p++;
+        }
+
+        args[nargs].len = p - args[nargs].data;
+        nargs++;
+    }
+
+    if (nargs == 0) {
+        return ngx_stream_nginxcraft_routes_api_reply(c->pool,
+                                                      "err unknown command\n");
+    }
+
+    host = NULL;
+    upstream = NULL;
+
+    if (nargs > 1) {
+        host = &args[1];
+
+        /* keys are matched as handshakes are, lowercased without the dot */
+
+        ngx_strlow(host->data, host->data, host->len);
+
+        if (host->len > 1 && host->data[host->len - 1] == '.') {
+            host->len--;
+        }
+
+        if (host->len == 0 || host->len > NGX_STREAM_NGINXCRAFT_HOST_LEN) {
+            return ngx_stream_nginxcraft_routes_api_reply(c->pool,
+                                                          "err invalid hostname\n");
+        }
+    }
+
+    if (nargs > 2) {
+        upstream = &args[2];
+
+        if (upstream->len > NGX_STREAM_NGINXCRAFT_ROUTES_NAME_LEN) {
+            return ngx_stream_nginxcraft_routes_api_reply(c->pool,
+                                                          "err invalid upstream\n");
+        }
+    }
+
+    if (args[0].len == 3 && ngx_strncmp(args[0].data, "set", 3) == 0
+        && nargs == 3)
+    {
+        rc = ngx_stream_nginxcraft_routes_update(zone, host, upstream, &version);
+
+        if (rc == NGX_BUSY) {
+            return ngx_stream_nginxcraft_routes_api_reply(c->pool,
+                                                          "err table is full\n");
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, c->log, 0,
+                      "route \"%V\" set to \"%V\", version %uA",
+                      host, upstream, version);
+
+        return ngx_stream_nginxcraft_routes_api_reply(c->pool, "ok %uA\n",
+                                                      version);
+    }
+
+    if (args[0].len == 3 && ngx_strncmp(args[0].data, "del", 3) == 0
+        && nargs == 2)
+    {
+        rc = ngx_stream_nginxcraft_routes_update(zone, host, NULL, &version);
+
+        if (rc == NGX_DECLINED) {
+            return ngx_stream_nginxcraft_routes_api_reply(c->pool,
+                                                          "err not found\n");
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, c->log, 0,
+                      "route \"%V\" removed, version %uA", host, version);
+
+        return ngx_stream_nginxcraft_routes_api_reply(c->pool, "ok %uA\n",
+                                                      version);
+    }
+
+    if (args[0].len == 3 && ngx_strncmp(args[0].data, "get", 3) == 0
+        && nargs == 2)
+    {
+        return ngx_stream_nginxcraft_routes_api_list(c->pool, zone, host);
+    }
+
+    if (args[0].len == 4 && ngx_strncmp(args[0].data, "list", 4) == 0
+        && nargs == 1)
+    {
+        return ngx_stream_nginxcraft_routes_api_list(c->pool, zone, NULL);
+    }
+
+    if (args[0].len == 5 && ngx_strncmp(args[0].data, "flush", 5) == 0
+        && nargs == 1)
+    {
+        (void) ngx_stream_nginxcraft_routes_update(zone, NULL, NULL, &version);
+
+        ngx_log_error(NGX_LOG_NOTICE, c->log, 0,
+                      "routes flushed, version %uA", version);
+
+        return ngx_stream_nginxcraft_routes_api_reply(c->pool, "ok %uA\n",
+                                                      version);
+    }
+
+    return ngx_stream_nginxcraft_routes_api_reply(c->pool, "err unknown command\n");
+}
+
+static ngx_chain_t *
+ngx_stream_nginxcraft_routes_api_reply(ngx_pool_t *pool, const char *fmt, ...)
+{
+    va_list       args;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    b = ngx_create_temp_buf(pool, sizeof("ok \n") + NGX_ATOMIC_T_LEN + 32);
+
+    if (b == NULL) {
+        return NULL;
+    }
+
+    va_start(args, fmt);
+    b->last = ngx_vslprintf(b->last, b->end, fmt, args);
+    va_end(args);
+
+    b->flush = 1;
+
+    cl = ngx_alloc_chain_link(pool);
+
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    return cl;
+}
+
+/* the route of host, or every route if it is NULL, read under the lock */
+static ngx_chain_t *
+ngx_stream_nginxcraft_routes_api_list(ngx_pool_t *pool,
+    ngx_stream_nginxcraft_routes_zone_t *zone, ngx_str_t *host)
+{
+    u_char                                *p;
+    size_t                                 len;
+    ngx_uint_t                             i;
+    ngx_buf_t                             *b;
+    ngx_chain_t                           *cl;
+    ngx_stream_nginxcraft_routes_slot_t   *slot, copy;
+    ngx_stream_nginxcraft_routes_table_t  *table;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    table = &zone->sh->table[zone->sh->current & 1];
+
+    slot = NULL;
+
+    if (host) {
+        slot = ngx_stream_nginxcraft_routes_find(table, host,
+                                                 ngx_stream_nginxcraft_routes_hash(host),
+                                                 &copy);
+
+        if (slot == NULL) {
+            ngx_shmtx_unlock(&zone->shpool->mutex);
+            return ngx_stream_nginxcraft_routes_api_reply(pool, "err not found\n");
+        }
+
+        len = slot->host_len + slot->upstream_len + 2;
+
+    } else {
+        len = table->used + 2 * table->entries;
+    }
+
+    len += sizeof("ok \n") + NGX_ATOMIC_T_LEN;
+
+    b = ngx_create_temp_buf(pool, len);
+
+    if (b == NULL) {
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+        return NULL;
+    }
+
+    for (i = 0; i < table->nslots; i++) {
+
+        if (slot) {
+            i = slot - table->slots;
+
+        } else if (table->slots[i].hash == 0) {
+            continue;
+        }
+
+        p = table->heap + table->slots[i].offset;
+
+        b->last = ngx_cpymem(b->last, p, table->slots[i].host_len);
+        *b->last++ = ' ';
+        p += table->slots[i].host_len;
+        b->last = ngx_cpymem(b->last, p, table->slots[i].upstream_len);
+        *b->last++ = '\n';
+
+        if (slot) {
+            break;
+        }
+    }
+
+    b->last = ngx_sprintf(b->last, "ok %uA\n", zone->sh->version);
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    b->flush = 1;
+
+    cl = ngx_alloc_chain_link(pool);
+
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    return cl;
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_routes_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_stream_nginxcraft_routes_zone_t  *ozone = data;
+
+    u_char                                *p;
+    size_t                                 len;
+    ngx_uint_t                             i, nslots;
+    ngx_stream_nginxcraft_routes_zone_t   *zone;
+    ngx_stream_nginxcraft_routes_table_t  *table;
+
+    zone = shm_zone->data;
+
+    /* the routes are kept across reloads */
+
+    if (ozone) {
+        zone->sh = ozone->sh;
+        zone->shpool = ozone->shpool;
+        return NGX_OK;
+    }
+
+    zone->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        zone->sh = zone->shpool->data;
+        return NGX_OK;
+    }
+
+    zone->sh = ngx_slab_calloc(zone->shpool,
+                               sizeof(ngx_stream_nginxcraft_routes_sh_t));
+
+    if (zone->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    zone->shpool->data = zone->sh;
+
+    /*
+     * Each copy takes whole pages, a little under half the zone. Slots
+     * are sized for hostnames and upstreams of about 64 bytes together.
+     */
+
+    len = (shm_zone->shm.size / 2 - 8 * ngx_pagesize) & ~(ngx_pagesize - 1);
+
+    for (nslots = 1;
+         nslots * 2 * (sizeof(ngx_stream_nginxcraft_routes_slot_t) + 64) <= len;
+         nslots *= 2)
+    {
+        /* void */
+    }
+
+    for (i = 0; i < 2; i++) {
+        table = &zone->sh->table[i];
+
+        p = ngx_slab_calloc(zone->shpool, len);
+
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        table->nslots = nslots;
+        table->slots = (ngx_stream_nginxcraft_routes_slot_t *) p;
+        table->heap = p + nslots * sizeof(ngx_stream_nginxcraft_routes_slot_t);
+        table->size = len - nslots * sizeof(ngx_stream_nginxcraft_routes_slot_t);
+    }
+
+    len = sizeof(" in nginxcraft_routes zone \"\"") + shm_zone->shm.name.len;
+
+    zone->shpool->log_ctx = ngx_slab_alloc(zone->shpool, len);
+
+    if (zone->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(zone->shpool->log_ctx, " in nginxcraft_routes zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+char *
+ngx_stream_nginxcraft_routes(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    ngx_str_t       *value;
+    ngx_shm_zone_t  *shm_zone;
+
+    if (nscf->routes != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        nscf->routes = NULL;
+        return NGX_CONF_OK;
+    }
+
+    shm_zone = ngx_stream_nginxcraft_zone(cf, &value[1], 1,
+                   ngx_stream_nginxcraft_routes_init_zone,
+                   sizeof(ngx_stream_nginxcraft_routes_zone_t));
+
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    nscf->routes = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+char *
+ngx_stream_nginxcraft_routes_api(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    ngx_str_t                   *value;
+    ngx_shm_zone_t              *shm_zone;
+    ngx_stream_core_srv_conf_t  *cscf;
+
+    if (nscf->routes_api) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    shm_zone = ngx_stream_nginxcraft_zone(cf, &value[1], 0,
+                   ngx_stream_nginxcraft_routes_init_zone,
+                   sizeof(ngx_stream_nginxcraft_routes_zone_t));
+
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    nscf->routes_api = shm_zone;
+
+    cscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_core_module);
+
+    cscf->handler = ngx_stream_nginxcraft_routes_api_handler;
+
+    return NGX_CONF_OK;
+}
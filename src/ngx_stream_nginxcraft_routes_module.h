@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_routes_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_ROUTES_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_ROUTES_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+char *ngx_stream_nginxcraft_routes(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_stream_nginxcraft_routes_api(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+ngx_int_t ngx_stream_nginxcraft_routes_lookup(ngx_shm_zone_t *shm_zone,
+    ngx_pool_t *pool, ngx_str_t *host, ngx_str_t *upstream);
+
+#endif /* NGX_STREAM_NGINXCRAFT_ROUTES_MODULE_H */
@@ -0,0 +1,1134 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_status_module.c
+ *
+ * Answers server list pings (handshakes with nextState 1) from a Status
+ * Response kept in shared memory per $minecraft_server. On a miss one
+ * session per hostname is proxied and the Status Response it receives
+ * from the upstream is stored, concurrent pings for the same hostname
+ * wait for it instead of opening their own upstream connection.
+ *
+ * nginxcraft_status answers them from a response framed when the
+ * configuration is read instead, without an upstream at all.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_status_module.h"
+#include "ngx_stream_nginxcraft_return_module.h"
+#include "minecraft_funcs.h"
+
+#define NGX_STREAM_NGINXCRAFT_STATUS_MAX_SIZE   65536
+#define NGX_STREAM_NGINXCRAFT_STATUS_WAIT_TIME  50
+
+/* longest string clients read, the favicon included */
+#define NGX_STREAM_NGINXCRAFT_STATUS_MAX_JSON   32767
+
+/* favicons are 64x64, anything this large is not one */
+#define NGX_STREAM_NGINXCRAFT_FAVICON_MAX_SIZE  16384
+
+typedef struct {
+    ngx_rbtree_t                  rbtree;
+    ngx_rbtree_node_t             sentinel;
+    ngx_queue_t                   queue;
+} ngx_stream_nginxcraft_status_shctx_t;
+
+typedef struct {
+    ngx_stream_nginxcraft_status_shctx_t  *sh;
+    ngx_slab_pool_t                       *shpool;
+} ngx_stream_nginxcraft_status_cache_t;
+
+typedef struct {
+    ngx_str_node_t     sn;
+    ngx_queue_t        queue;
+    ngx_msec_t         expire;
+    ngx_msec_t         lock;
+    ngx_uint_t         updating;
+    u_char            *data;
+    size_t             size;
+    u_char             key[1];
+} ngx_stream_nginxcraft_status_node_t;
+
+static ngx_int_t ngx_stream_nginxcraft_status_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_stream_nginxcraft_status_key(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx, ngx_stream_nginxcraft_srv_conf_t *nscf);
+static ngx_int_t ngx_stream_nginxcraft_status_lookup(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx, ngx_str_t *response, ngx_uint_t update);
+static void ngx_stream_nginxcraft_status_store(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx, u_char *data, size_t size);
+static void ngx_stream_nginxcraft_status_unlock(ngx_stream_nginxcraft_ctx_t *ctx);
+static ngx_stream_nginxcraft_status_node_t *ngx_stream_nginxcraft_status_node(
+    ngx_stream_nginxcraft_status_cache_t *cache, ngx_str_t *key, uint32_t hash);
+static void *ngx_stream_nginxcraft_status_alloc(
+    ngx_stream_nginxcraft_status_cache_t *cache, size_t size);
+static void ngx_stream_nginxcraft_status_wait_handler(ngx_event_t *ev);
+static void ngx_stream_nginxcraft_status_cleanup(void *data);
+static void ngx_stream_nginxcraft_status_read_handler(ngx_event_t *rev);
+static void ngx_stream_nginxcraft_status_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_stream_nginxcraft_status_process(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx);
+static ngx_int_t ngx_stream_nginxcraft_status_filter(ngx_stream_session_t *s,
+    ngx_chain_t *in, ngx_uint_t from_upstream);
+static ngx_int_t ngx_stream_nginxcraft_status_favicon(ngx_conf_t *cf,
+    ngx_str_t *name, ngx_str_t *favicon);
+
+static ngx_stream_filter_pt  ngx_stream_next_filter;
+
+ngx_int_t
+ngx_stream_nginxcraft_status_handler(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx)
+{
+    ngx_int_t                          rc;
+    ngx_str_t                          response;
+    ngx_event_t                       *ev;
+    ngx_connection_t                  *c;
+    ngx_pool_cleanup_t                *cln;
+    ngx_stream_nginxcraft_srv_conf_t  *nscf;
+
+    switch (ctx->status) {
+
+    case NGX_STREAM_NGINXCRAFT_STATUS_WAIT:
+    case NGX_STREAM_NGINXCRAFT_STATUS_LOCAL:
+        return NGX_DONE;
+
+    case NGX_STREAM_NGINXCRAFT_STATUS_FILL:
+    case NGX_STREAM_NGINXCRAFT_STATUS_PROXY:
+        return NGX_OK;
+    }
+
+    c = s->connection;
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+
+    if (nscf->status.len) {
+        return ngx_stream_nginxcraft_status_respond(s, ctx, nscf->status.data,
+                                                    nscf->status.len);
+    }
+
+    if (nscf->status_cache == NULL || ctx->host.len == 0) {
+        ctx->status = NGX_STREAM_NGINXCRAFT_STATUS_PROXY;
+        return NGX_OK;
+    }
+
+    if (ngx_stream_nginxcraft_status_key(s, ctx, nscf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_stream_nginxcraft_status_cleanup;
+    cln->data = ctx;
+
+    rc = ngx_stream_nginxcraft_status_lookup(s, ctx, &response, 1);
+
+    if (rc == NGX_OK) {
+        return ngx_stream_nginxcraft_status_respond(s, ctx, response.data,
+                                                    response.len);
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "nginxcraft status cache miss: \"%V\"", &ctx->status_key);
+
+        ctx->status = NGX_STREAM_NGINXCRAFT_STATUS_FILL;
+        return NGX_OK;
+    }
+
+    if (rc == NGX_ERROR) {
+        ctx->status = NGX_STREAM_NGINXCRAFT_STATUS_PROXY;
+        return NGX_OK;
+    }
+
+    /* NGX_BUSY, another session is fetching the status */
+
+    ev = ngx_pcalloc(c->pool, sizeof(ngx_event_t));
+
+    if (ev == NULL) {
+        return NGX_ERROR;
+    }
+
+    ev->handler = ngx_stream_nginxcraft_status_wait_handler;
+    ev->data = s;
+    ev->log = c->log;
+
+    ctx->status_wait = ev;
+    ctx->status = NGX_STREAM_NGINXCRAFT_STATUS_WAIT;
+
+    ngx_add_timer(ev, NGX_STREAM_NGINXCRAFT_STATUS_WAIT_TIME);
+
+    return NGX_DONE;
+}
+
+/*
+ * Serves the cached response if there is one, without taking the lock
+ * or waiting for it on a miss.
+ */
+ngx_int_t
+ngx_stream_nginxcraft_status_cached(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx)
+{
+    ngx_int_t                          rc;
+    ngx_str_t                          response;
+    ngx_stream_nginxcraft_srv_conf_t  *nscf;
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+
+    if (nscf->status_cache == NULL || ctx->host.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    if (ctx->status_key.data == NULL
+        && ngx_stream_nginxcraft_status_key(s, ctx, nscf) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_stream_nginxcraft_status_lookup(s, ctx, &response, 0);
+
+    if (rc != NGX_OK) {
+        return (rc == NGX_ERROR) ? NGX_ERROR : NGX_DECLINED;
+    }
+
+    return ngx_stream_nginxcraft_status_respond(s, ctx, response.data,
+                                                response.len);
+}
+
+ngx_int_t
+ngx_stream_nginxcraft_status_respond(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx, u_char *response, size_t len)
+{
+    ngx_buf_t         *b;
+    ngx_connection_t  *c;
+
+    c = s->connection;
+
+    b = ngx_calloc_buf(c->pool);
+
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->memory = 1;
+    b->flush = 1;
+    b->pos = response;
+    b->last = response + len;
+
+    ctx->out = ngx_alloc_chain_link(c->pool);
+
+    if (ctx->out == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->out->buf = b;
+    ctx->out->next = NULL;
+
+    ctx->status = NGX_STREAM_NGINXCRAFT_STATUS_LOCAL;
+
+    c->log->action = "answering server list ping";
+
+    c->read->handler = ngx_stream_nginxcraft_status_read_handler;
+    c->write->handler = ngx_stream_nginxcraft_status_write_handler;
+
+    /* the preread phase removes its read timer once this returns */
+    ngx_post_event(c->read, &ngx_posted_events);
+
+    return NGX_DONE;
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_status_key(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx, ngx_stream_nginxcraft_srv_conf_t *nscf)
+{
+    ctx->status_zone = nscf->status_cache;
+    ctx->status_key.len = ctx->host.len;
+    ctx->status_key.data = ngx_pnalloc(s->connection->pool, ctx->host.len);
+
+    if (ctx->status_key.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_strlow(ctx->status_key.data, ctx->host.data, ctx->host.len);
+
+    return NGX_OK;
+}
+
+static void
+ngx_stream_nginxcraft_status_wait_handler(ngx_event_t *ev)
+{
+    ngx_int_t                     rc;
+    ngx_str_t                     response;
+    ngx_stream_session_t         *s;
+    ngx_stream_nginxcraft_ctx_t  *ctx;
+
+    s = ev->data;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+
+    rc = ngx_stream_nginxcraft_status_lookup(s, ctx, &response, 1);
+
+    if (rc == NGX_BUSY) {
+        ngx_add_timer(ev, NGX_STREAM_NGINXCRAFT_STATUS_WAIT_TIME);
+        return;
+    }
+
+    if (rc == NGX_OK) {
+        rc = ngx_stream_nginxcraft_status_respond(s, ctx, response.data,
+                                                  response.len);
+
+        if (rc == NGX_ERROR) {
+            ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        }
+
+        return;
+    }
+
+    /* the lock has expired, this session fetches the status itself */
+
+    ctx->status = (rc == NGX_DECLINED) ? NGX_STREAM_NGINXCRAFT_STATUS_FILL
+                                       : NGX_STREAM_NGINXCRAFT_STATUS_PROXY;
+
+    ngx_stream_core_run_phases(s);
+}
+
+static void
+ngx_stream_nginxcraft_status_cleanup(void *data)
+{
+    ngx_stream_nginxcraft_ctx_t  *ctx = data;
+
+    if (ctx->status_wait && ctx->status_wait->timer_set) {
+        ngx_del_timer(ctx->status_wait);
+    }
+
+    if (ctx->status == NGX_STREAM_NGINXCRAFT_STATUS_FILL) {
+        ngx_stream_nginxcraft_status_unlock(ctx);
+    }
+}
+
+static void
+ngx_stream_nginxcraft_status_read_handler(ngx_event_t *rev)
+{
+    ssize_t                       n;
+    ngx_int_t                     rc;
+    ngx_buf_t                    *b;
+    ngx_connection_t             *c;
+    ngx_stream_session_t         *s;
+    ngx_stream_nginxcraft_ctx_t  *ctx;
+    ngx_stream_core_srv_conf_t   *cscf;
+
+    c = rev->data;
+    s = c->data;
+
+    if (rev->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+    b = c->buffer;
+
+    for ( ;; ) {
+        rc = ngx_stream_nginxcraft_status_process(s, ctx);
+
+        if (rc == NGX_ERROR) {
+            ngx_stream_finalize_session(s, NGX_STREAM_BAD_REQUEST);
+            return;
+        }
+
+        if (rc == NGX_DONE) {
+            if (rev->timer_set) {
+                ngx_del_timer(rev);
+            }
+
+            ngx_stream_nginxcraft_status_write_handler(c->write);
+            return;
+        }
+
+        if (b->last == b->end) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "nginxcraft status buffer full");
+            ngx_stream_finalize_session(s, NGX_STREAM_BAD_REQUEST);
+            return;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_stream_finalize_session(s, NGX_STREAM_OK);
+            return;
+        }
+
+        b->last += n;
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    cscf = ngx_stream_get_module_srv_conf(s, ngx_stream_core_module);
+
+    ngx_add_timer(rev, cscf->preread_timeout);
+}
+
+static void
+ngx_stream_nginxcraft_status_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t             *c;
+    ngx_stream_session_t         *s;
+    ngx_stream_nginxcraft_ctx_t  *ctx;
+
+    c = wev->data;
+    s = c->data;
+
+    if (wev->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+
+    if (ngx_stream_top_filter(s, NULL, 1) == NGX_ERROR) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (!c->buffered) {
+        if (wev->timer_set) {
+            ngx_del_timer(wev);
+        }
+
+        if (ctx->status_done) {
+            ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "nginxcraft status done sending");
+            ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        }
+
+        return;
+    }
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_add_timer(wev, 5000);
+}
+
+/*
+ * Reads the Status Request and Ping packets that follow the handshake,
+ * the Status Response is sent for the first and the Ping is echoed back
+ * as the Pong.
+ */
+static ngx_int_t
+ngx_stream_nginxcraft_status_process(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx)
+{
+    u_char            *p;
+    size_t             size;
+    ngx_int_t          rc;
+    ngx_buf_t         *b, *pong;
+    ngx_chain_t       *out;
+    minecraft_packet   packet;
+
+    b = s->connection->buffer;
+
+    for ( ;; ) {
+        rc = ngx_stream_nginxcraft_next_packet(ctx, b, &packet);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        size = packet.length.length + packet.length.value;
+        p = (u_char *) packet.data - packet.packetId.length - packet.length.length;
+
+        if (packet.packetId.value == 0x00 && packet.data_length == 0
+            && !ctx->status_sent)
+        {
+            ctx->status_sent = 1;
+
+            out = ctx->out;
+            ctx->out = NULL;
+
+            if (ngx_stream_top_filter(s, out, 1) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        if (packet.packetId.value == 0x01 && packet.data_length == 8) {
+            pong = ngx_calloc_buf(s->connection->pool);
+
+            if (pong == NULL) {
+                return NGX_ERROR;
+            }
+
+            pong->memory = 1;
+            pong->last_buf = 1;
+            pong->pos = p;
+            pong->last = p + size;
+
+            out = ngx_alloc_chain_link(s->connection->pool);
+
+            if (out == NULL) {
+                return NGX_ERROR;
+            }
+
+            out->buf = pong;
+            out->next = NULL;
+
+            ctx->status_done = 1;
+
+            if (ngx_stream_top_filter(s, out, 1) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            return NGX_DONE;
+        }
+
+        return NGX_ERROR;
+    }
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_status_filter(ngx_stream_session_t *s, ngx_chain_t *in,
+    ngx_uint_t from_upstream)
+{
+    size_t                        n;
+    ngx_int_t                     rc;
+    ngx_buf_t                    *b;
+    ngx_chain_t                  *cl;
+    minecraft_packet              packet;
+    ngx_stream_nginxcraft_ctx_t  *ctx;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+
+    if (ctx == NULL || !from_upstream
+        || ctx->status != NGX_STREAM_NGINXCRAFT_STATUS_FILL)
+    {
+        return ngx_stream_next_filter(s, in, from_upstream);
+    }
+
+    b = ctx->status_fill;
+
+    if (b == NULL) {
+        b = ngx_create_temp_buf(s->connection->pool,
+                                NGX_STREAM_NGINXCRAFT_STATUS_MAX_SIZE);
+
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->status_fill = b;
+    }
+
+    for (cl = in; cl; cl = cl->next) {
+        n = ngx_min((size_t) ngx_buf_size(cl->buf), (size_t) (b->end - b->last));
+        b->last = ngx_cpymem(b->last, cl->buf->pos, n);
+    }
+
+    rc = parse_packet(b->pos, b->last - b->pos, &packet);
+
+    if (rc == NGX_OK) {
+        if (packet.packetId.value == 0x00
+            && read_mc_string(packet.data, packet.data_length).valid)
+        {
+            ngx_stream_nginxcraft_status_store(s, ctx, b->pos,
+                                packet.length.length + packet.length.value);
+
+        } else {
+            ngx_stream_nginxcraft_status_unlock(ctx);
+        }
+
+    } else if (rc == NGX_ERROR || b->last == b->end) {
+        ngx_stream_nginxcraft_status_unlock(ctx);
+
+    } else {
+        return ngx_stream_next_filter(s, in, from_upstream);
+    }
+
+    ctx->status = NGX_STREAM_NGINXCRAFT_STATUS_PROXY;
+    ctx->status_fill = NULL;
+
+    ngx_pfree(s->connection->pool, b->start);
+
+    return ngx_stream_next_filter(s, in, from_upstream);
+}
+
+/*
+ * Returns NGX_OK with a copy of the response, NGX_BUSY while another
+ * session is fetching it, or NGX_DECLINED on a miss, in which case the
+ * caller owns the lock when update is set.
+ */
+static ngx_int_t
+ngx_stream_nginxcraft_status_lookup(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx, ngx_str_t *response, ngx_uint_t update)
+{
+    uint32_t                               hash;
+    ngx_msec_t                             now;
+    ngx_stream_nginxcraft_srv_conf_t      *nscf;
+    ngx_stream_nginxcraft_status_node_t   *node;
+    ngx_stream_nginxcraft_status_cache_t  *cache;
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+    cache = ctx->status_zone->data;
+
+    hash = ngx_crc32_short(ctx->status_key.data, ctx->status_key.len);
+    now = ngx_current_msec;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_stream_nginxcraft_status_node(cache, &ctx->status_key, hash);
+
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    if (node->data && (ngx_msec_int_t) (node->expire - now) > 0) {
+        goto found;
+    }
+
+    if (node->updating && (ngx_msec_int_t) (node->lock - now) > 0) {
+
+        if (node->data) {
+            /* stale while another session updates it */
+            goto found;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_BUSY;
+    }
+
+    if (!update) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    node->updating = 1;
+    node->lock = now + nscf->status_cache_lock;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_DECLINED;
+
+found:
+
+    response->len = node->size;
+    response->data = ngx_pnalloc(s->connection->pool, node->size);
+
+    if (response->data == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(response->data, node->data, node->size);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_OK;
+}
+
+static void
+ngx_stream_nginxcraft_status_store(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx, u_char *data, size_t size)
+{
+    u_char                                *p;
+    uint32_t                               hash;
+    ngx_stream_nginxcraft_srv_conf_t      *nscf;
+    ngx_stream_nginxcraft_status_node_t   *node;
+    ngx_stream_nginxcraft_status_cache_t  *cache;
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+    cache = ctx->status_zone->data;
+
+    hash = ngx_crc32_short(ctx->status_key.data, ctx->status_key.len);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "nginxcraft status cache store: \"%V\" %uz",
+                   &ctx->status_key, size);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    p = ngx_stream_nginxcraft_status_alloc(cache, size);
+
+    node = ngx_stream_nginxcraft_status_node(cache, &ctx->status_key, hash);
+
+    if (node == NULL) {
+        if (p) {
+            ngx_slab_free_locked(cache->shpool, p);
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
+
+    node->updating = 0;
+
+    if (p == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
+
+    if (node->data) {
+        ngx_slab_free_locked(cache->shpool, node->data);
+    }
+
+    ngx_memcpy(p, data, size);
+
+    node->data = p;
+    node->size = size;
+    node->expire = ngx_current_msec + nscf->status_cache_ttl;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+static void
+ngx_stream_nginxcraft_status_unlock(ngx_stream_nginxcraft_ctx_t *ctx)
+{
+    uint32_t                               hash;
+    ngx_stream_nginxcraft_status_node_t   *node;
+    ngx_stream_nginxcraft_status_cache_t  *cache;
+
+    cache = ctx->status_zone->data;
+
+    hash = ngx_crc32_short(ctx->status_key.data, ctx->status_key.len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = (ngx_stream_nginxcraft_status_node_t *)
+               ngx_str_rbtree_lookup(&cache->sh->rbtree, &ctx->status_key, hash);
+
+    if (node) {
+        node->updating = 0;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/* Finds or creates the node for key and marks it as recently used. */
+static ngx_stream_nginxcraft_status_node_t *
+ngx_stream_nginxcraft_status_node(ngx_stream_nginxcraft_status_cache_t *cache,
+    ngx_str_t *key, uint32_t hash)
+{
+    ngx_stream_nginxcraft_status_node_t  *node;
+
+    node = (ngx_stream_nginxcraft_status_node_t *)
+               ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+
+    if (node) {
+        ngx_queue_remove(&node->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+        return node;
+    }
+
+    node = ngx_stream_nginxcraft_status_alloc(cache,
+               offsetof(ngx_stream_nginxcraft_status_node_t, key) + key->len);
+
+    if (node == NULL) {
+        return NULL;
+    }
+
+    node->sn.node.key = hash;
+    node->sn.str.len = key->len;
+    node->sn.str.data = node->key;
+    node->expire = 0;
+    node->lock = 0;
+    node->updating = 0;
+    node->data = NULL;
+    node->size = 0;
+
+    ngx_memcpy(node->key, key->data, key->len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->sn.node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    return node;
+}
+
+/* Allocates from the zone, evicting least recently used entries if full. */
+static void *
+ngx_stream_nginxcraft_status_alloc(ngx_stream_nginxcraft_status_cache_t *cache,
+    size_t size)
+{
+    void                                 *p;
+    ngx_queue_t                          *q;
+    ngx_stream_nginxcraft_status_node_t  *node;
+
+    for ( ;; ) {
+        p = ngx_slab_alloc_locked(cache->shpool, size);
+
+        if (p != NULL) {
+            return p;
+        }
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            return NULL;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        node = ngx_queue_data(q, ngx_stream_nginxcraft_status_node_t, queue);
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
+
+        if (node->data) {
+            ngx_slab_free_locked(cache->shpool, node->data);
+        }
+
+        ngx_slab_free_locked(cache->shpool, node);
+    }
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_status_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_stream_nginxcraft_status_cache_t  *ocache = data;
+
+    size_t                                 len;
+    ngx_stream_nginxcraft_status_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_stream_nginxcraft_status_shctx_t));
+
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in nginxcraft_status_cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in nginxcraft_status_cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+char *
+ngx_stream_nginxcraft_status_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t    *nscf = conf;
+
+    ngx_int_t                              ttl, lock;
+    ngx_str_t                             *value, *zone, s;
+    ngx_uint_t                             i;
+    ngx_shm_zone_t                        *shm_zone;
+
+    if (nscf->status_cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        nscf->status_cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    ttl = 10000;
+    lock = 5000;
+    zone = NULL;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            zone = &value[i];
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ttl=", 4) == 0) {
+
+            s.data = value[i].data + 4;
+            s.len = value[i].len - 4;
+
+            ttl = ngx_parse_time(&s, 0);
+
+            if (ttl == NGX_ERROR || ttl == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ttl \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "lock_timeout=", 13) == 0) {
+
+            s.data = value[i].data + 13;
+            s.len = value[i].len - 13;
+
+            lock = ngx_parse_time(&s, 0);
+
+            if (lock == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lock_timeout \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_stream_nginxcraft_zone(cf, zone, 0,
+                   ngx_stream_nginxcraft_status_init_zone,
+                   sizeof(ngx_stream_nginxcraft_status_cache_t));
+
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    nscf->status_cache = shm_zone;
+    nscf->status_cache_ttl = ttl;
+    nscf->status_cache_lock = lock;
+
+    return NGX_CONF_OK;
+}
+
+char *
+ngx_stream_nginxcraft_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    u_char      *p, *open, *close;
+    ngx_str_t   *value, json, name, favicon;
+    ngx_uint_t   i;
+
+    if (nscf->status.data) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        ngx_str_set(&nscf->status, "");
+        return NGX_CONF_OK;
+    }
+
+    ngx_str_null(&name);
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "favicon=", 8) == 0) {
+            name.data = value[i].data + 8;
+            name.len = value[i].len - 8;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    json = value[1];
+
+    if (name.len) {
+        open = ngx_strlchr(json.data, json.data + json.len, '{');
+
+        for (close = json.data + json.len; close > json.data; close--) {
+            if (close[-1] == '}') {
+                break;
+            }
+        }
+
+        if (open == NULL || close == json.data || close - 1 < open) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"%V\" is not a JSON object", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        close--;
+
+        if (ngx_stream_nginxcraft_status_favicon(cf, &name, &favicon) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        json.data = ngx_pnalloc(cf->pool, value[1].len + favicon.len
+                                + sizeof(",\"favicon\":\"data:image/png;base64,\""));
+
+        if (json.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        /* added as the last member, with a comma unless it is the only one */
+
+        p = ngx_cpymem(json.data, value[1].data, close - value[1].data);
+
+        for (open++; open < close; open++) {
+            if (*open != ' ' && *open != '\t' && *open != CR && *open != LF) {
+                *p++ = ',';
+                break;
+            }
+        }
+
+        p = ngx_sprintf(p, "\"favicon\":\"data:image/png;base64,%V\"", &favicon);
+        p = ngx_cpymem(p, close, value[1].data + value[1].len - close);
+
+        json.len = p - json.data;
+    }
+
+    if (json.len > NGX_STREAM_NGINXCRAFT_STATUS_MAX_JSON) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "status response is too long, %uz bytes", json.len);
+        return NGX_CONF_ERROR;
+    }
+
+    /* a Status Response is framed like a Disconnect, packet 0 and a string */
+
+    if (ngx_stream_nginxcraft_disconnect_packet(cf->pool, &json, &nscf->status)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* reads a PNG and encodes it in base64 */
+static ngx_int_t
+ngx_stream_nginxcraft_status_favicon(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_str_t *favicon)
+{
+    ssize_t          n;
+    ngx_str_t        png;
+    ngx_file_t       file;
+    ngx_file_info_t  fi;
+
+    if (ngx_conf_full_name(cf->cycle, name, 1) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = *name;
+    file.log = cf->log;
+
+    file.fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%V\" failed", name);
+        return NGX_ERROR;
+    }
+
+    png.data = NULL;
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_fd_info_n " \"%V\" failed", name);
+        goto failed;
+    }
+
+    png.len = ngx_file_size(&fi);
+
+    if (png.len < 8 || png.len > NGX_STREAM_NGINXCRAFT_FAVICON_MAX_SIZE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "favicon \"%V\" is not a 64x64 PNG", name);
+        goto failed;
+    }
+
+    png.data = ngx_pnalloc(cf->temp_pool, png.len);
+
+    if (png.data == NULL) {
+        goto failed;
+    }
+
+    n = ngx_read_file(&file, png.data, png.len, 0);
+
+    if (n != (ssize_t) png.len) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           ngx_read_file_n " \"%V\" returned only %z bytes",
+                           name, n);
+        goto failed;
+    }
+
+    if (ngx_memcmp(png.data, "\x89PNG\r\n\x1a\n", 8) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "favicon \"%V\" is not a 64x64 PNG", name);
+        goto failed;
+    }
+
+    favicon->len = ngx_base64_encoded_length(png.len);
+    favicon->data = ngx_pnalloc(cf->pool, favicon->len);
+
+    if (favicon->data == NULL) {
+        goto failed;
+    }
+
+    ngx_encode_base64(favicon, &png);
+
+    ngx_close_file(file.fd);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_close_file(file.fd);
+
+    return NGX_ERROR;
+}
+
+ngx_int_t
+ngx_stream_nginxcraft_status_init(ngx_conf_t *cf)
+{
+    ngx_stream_next_filter = ngx_stream_top_filter;
+    ngx_stream_top_filter = ngx_stream_nginxcraft_status_filter;
+
+    return NGX_OK;
+}
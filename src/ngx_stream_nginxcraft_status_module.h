@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_status_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_STATUS_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_STATUS_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+char *ngx_stream_nginxcraft_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_stream_nginxcraft_status_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_stream_nginxcraft_status_handler(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx);
+ngx_int_t ngx_stream_nginxcraft_status_cached(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx);
+ngx_int_t ngx_stream_nginxcraft_status_respond(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx, u_char *response, size_t len);
+ngx_int_t ngx_stream_nginxcraft_status_init(ngx_conf_t *cf);
+
+#endif /* NGX_STREAM_NGINXCRAFT_STATUS_MODULE_H */
@@ -0,0 +1,1140 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_upstream_module.c
+ *
+ * Polls the status of every peer of an upstream with a server list ping
+ * from a worker timer, keeps the player counts in shared memory, and
+ * balances sessions to the peer with the most free slots.
+ *
+ * With nginxcraft_check the same polls mark peers down after a number of
+ * failed or invalid answers in a row and up again after a number of good
+ * ones, for any balancer. Each worker copies the state into its peers on
+ * its own timer.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_upstream_module.h"
+#include "minecraft_funcs.h"
+
+/* a Status Response with a favicon easily takes tens of kilobytes */
+#define NGX_STREAM_NGINXCRAFT_POLL_BUFFER  65536
+
+struct ngx_stream_nginxcraft_poll_peer_s {
+    ngx_stream_nginxcraft_poll_t        *poll;
+    ngx_uint_t                           index;
+    struct sockaddr                     *sockaddr;
+    socklen_t                            socklen;
+    ngx_str_t                           *name;
+    ngx_str_t                            request;
+    ngx_peer_connection_t                pc;
+    ngx_buf_t                           *buffer;
+    size_t                               sent;
+
+    ngx_stream_upstream_rr_peers_t      *peers;
+    ngx_stream_upstream_rr_peer_t       *peer;
+    /* down in the configuration */
+    ngx_uint_t                           down;
+};
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_stream_upstream_rr_peer_data_t   rrp;
+    ngx_stream_nginxcraft_poll_t        *poll;
+    ngx_uint_t                           base;
+    /* the peer counted as pending by get_peer, and in which round */
+    ngx_stream_nginxcraft_peer_stat_t   *pending;
+    ngx_atomic_uint_t                    round;
+} ngx_stream_nginxcraft_players_peer_data_t;
+
+static ngx_stream_nginxcraft_poll_t *ngx_stream_nginxcraft_poll_conf(
+    ngx_conf_t *cf, ngx_stream_nginxcraft_srv_conf_t *nscf);
+static ngx_int_t ngx_stream_nginxcraft_poll_param(ngx_conf_t *cf,
+    ngx_stream_nginxcraft_poll_t *poll, ngx_str_t *value);
+static ngx_int_t ngx_stream_nginxcraft_poll_register(ngx_conf_t *cf,
+    ngx_stream_nginxcraft_poll_t *poll);
+static ngx_int_t ngx_stream_nginxcraft_players_init(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_nginxcraft_players_init_peer(
+    ngx_stream_session_t *s, ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_nginxcraft_players_get_peer(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_stream_nginxcraft_players_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static ngx_int_t ngx_stream_nginxcraft_poll_free(ngx_stream_nginxcraft_poll_t *poll,
+    ngx_uint_t index);
+static ngx_int_t ngx_stream_nginxcraft_poll_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_stream_nginxcraft_poll_init_peer(ngx_cycle_t *cycle,
+    ngx_stream_nginxcraft_poll_t *poll, ngx_stream_nginxcraft_poll_peer_t *pp,
+    ngx_stream_upstream_rr_peer_t *peer);
+static void ngx_stream_nginxcraft_poll_handler(ngx_event_t *ev);
+static void ngx_stream_nginxcraft_poll_start(ngx_stream_nginxcraft_poll_peer_t *pp);
+static void ngx_stream_nginxcraft_poll_write_handler(ngx_event_t *wev);
+static void ngx_stream_nginxcraft_poll_read_handler(ngx_event_t *rev);
+static void ngx_stream_nginxcraft_poll_done(ngx_stream_nginxcraft_poll_peer_t *pp,
+    ngx_int_t rc, int32_t online, int32_t max);
+static void ngx_stream_nginxcraft_check_update(ngx_stream_nginxcraft_poll_peer_t *pp,
+    ngx_uint_t ok);
+static void ngx_stream_nginxcraft_check_sync(ngx_stream_nginxcraft_poll_peer_t *pp);
+
+char *
+ngx_stream_nginxcraft_players(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    ngx_int_t                          rc;
+    ngx_str_t                         *value;
+    ngx_uint_t                         i;
+    ngx_stream_nginxcraft_poll_t      *poll;
+    ngx_stream_upstream_srv_conf_t    *uscf;
+
+    poll = ngx_stream_nginxcraft_poll_conf(cf, nscf);
+
+    if (poll == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (poll->players) {
+        return "is duplicate";
+    }
+
+    uscf = poll->upstream;
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        rc = ngx_stream_nginxcraft_poll_param(cf, poll, &value[i]);
+
+        if (rc == NGX_OK) {
+            continue;
+        }
+
+        if (rc == NGX_DECLINED) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[i]);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    uscf->peer.init_upstream = ngx_stream_nginxcraft_players_init;
+
+    uscf->flags = NGX_STREAM_UPSTREAM_CREATE
+                  |NGX_STREAM_UPSTREAM_WEIGHT
+                  |NGX_STREAM_UPSTREAM_MAX_CONNS
+                  |NGX_STREAM_UPSTREAM_MAX_FAILS
+                  |NGX_STREAM_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_STREAM_UPSTREAM_DOWN
+                  |NGX_STREAM_UPSTREAM_BACKUP;
+
+    poll->players = 1;
+
+    return NGX_CONF_OK;
+}
+
+char *
+ngx_stream_nginxcraft_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    ngx_int_t                          rc, n;
+    ngx_str_t                         *value;
+    ngx_uint_t                         i;
+    ngx_stream_nginxcraft_poll_t      *poll;
+
+    poll = ngx_stream_nginxcraft_poll_conf(cf, nscf);
+
+    if (poll == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (poll->check) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        rc = ngx_stream_nginxcraft_poll_param(cf, poll, &value[i]);
+
+        if (rc == NGX_OK) {
+            continue;
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_strncmp(value[i].data, "rise=", 5) == 0) {
+            n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            poll->rise = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fall=", 5) == 0) {
+            n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            poll->fall = n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    poll->check = 1;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+static ngx_stream_nginxcraft_poll_t *
+ngx_stream_nginxcraft_poll_conf(ngx_conf_t *cf,
+    ngx_stream_nginxcraft_srv_conf_t *nscf)
+{
+    ngx_stream_nginxcraft_poll_t  *poll;
+
+    if (nscf->poll != NGX_CONF_UNSET_PTR) {
+        return nscf->poll;
+    }
+
+    poll = ngx_pcalloc(cf->pool, sizeof(ngx_stream_nginxcraft_poll_t));
+
+    if (poll == NULL) {
+        return NULL;
+    }
+
+    poll->upstream = ngx_stream_conf_get_module_srv_conf(cf,
+                                                         ngx_stream_upstream_module);
+    poll->interval = 5000;
+    poll->timeout = 2000;
+    poll->rise = 2;
+    poll->fall = 3;
+
+    nscf->poll = poll;
+
+    return poll;
+}
+
+/* interval= and timeout=, shared by both directives */
+static ngx_int_t
+ngx_stream_nginxcraft_poll_param(ngx_conf_t *cf, ngx_stream_nginxcraft_poll_t *poll,
+    ngx_str_t *value)
+{
+    ngx_str_t  s;
+
+    if (ngx_strncmp(value->data, "interval=", 9) == 0) {
+        s.data = value->data + 9;
+        s.len = value->len - 9;
+
+        poll->interval = ngx_parse_time(&s, 0);
+
+        if (poll->interval == (ngx_msec_t) NGX_ERROR || poll->interval == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid interval \"%V\"", value);
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    if (ngx_strncmp(value->data, "timeout=", 8) == 0) {
+        s.data = value->data + 8;
+        s.len = value->len - 8;
+
+        poll->timeout = ngx_parse_time(&s, 0);
+
+        if (poll->timeout == (ngx_msec_t) NGX_ERROR || poll->timeout == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid timeout \"%V\"", value);
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_players_init(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_nginxcraft_srv_conf_t   *nscf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, cf->log, 0, "init nginxcraft players");
+
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_stream_nginxcraft_players_init_peer;
+
+    nscf = ngx_stream_conf_upstream_srv_conf(us, ngx_stream_nginxcraft_module);
+
+    return ngx_stream_nginxcraft_poll_register(cf, nscf->poll);
+}
+
+/*
+ * Upstreams with nginxcraft_check only are set up once every balancer
+ * has built its peers, those with nginxcraft_players already are.
+ */
+ngx_int_t
+ngx_stream_nginxcraft_poll_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                          i;
+    ngx_stream_nginxcraft_poll_t       *poll;
+    ngx_stream_upstream_srv_conf_t    **uscfp;
+    ngx_stream_nginxcraft_srv_conf_t   *nscf;
+    ngx_stream_upstream_main_conf_t    *umcf;
+
+    umcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        nscf = ngx_stream_conf_upstream_srv_conf(uscfp[i],
+                                                 ngx_stream_nginxcraft_module);
+        poll = nscf->poll;
+
+        if (poll == NGX_CONF_UNSET_PTR || poll == NULL || poll->shm_zone) {
+            continue;
+        }
+
+        if (ngx_stream_nginxcraft_poll_register(cf, poll) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_poll_register(ngx_conf_t *cf,
+    ngx_stream_nginxcraft_poll_t *poll)
+{
+    size_t                              size;
+    ngx_str_t                           name;
+    ngx_stream_nginxcraft_poll_t      **pollp;
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_upstream_srv_conf_t     *us;
+    ngx_stream_nginxcraft_main_conf_t  *nmcf;
+
+    us = poll->upstream;
+    peers = us->peer.data;
+    poll->npeers = peers->number + (peers->next ? peers->next->number : 0);
+
+    name.len = sizeof("nginxcraft_players_") - 1 + us->host.len;
+    name.data = ngx_pnalloc(cf->pool, name.len);
+
+    if (name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(name.data, "nginxcraft_players_%V", &us->host);
+
+    size = sizeof(ngx_stream_nginxcraft_poll_sh_t)
+           + poll->npeers * sizeof(ngx_stream_nginxcraft_peer_stat_t);
+
+    size = ngx_align(size, ngx_pagesize) + 8 * ngx_pagesize;
+
+    poll->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                           &ngx_stream_nginxcraft_module);
+
+    if (poll->shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (poll->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate upstream \"%V\"", &us->host);
+        return NGX_ERROR;
+    }
+
+    poll->shm_zone->init = ngx_stream_nginxcraft_poll_init_zone;
+    poll->shm_zone->data = poll;
+
+    nmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_nginxcraft_module);
+
+    pollp = ngx_array_push(&nmcf->polls);
+
+    if (pollp == NULL) {
+        return NGX_ERROR;
+    }
+
+    *pollp = poll;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_players_init_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_nginxcraft_srv_conf_t           *nscf;
+    ngx_stream_nginxcraft_players_peer_data_t  *pd;
+
+    pd = ngx_palloc(s->connection->pool,
+                    sizeof(ngx_stream_nginxcraft_players_peer_data_t));
+
+    if (pd == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.data = &pd->rrp;
+
+    if (ngx_stream_upstream_init_round_robin_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    nscf = ngx_stream_conf_upstream_srv_conf(us, ngx_stream_nginxcraft_module);
+
+    pd->poll = nscf->poll;
+    pd->base = 0;
+    pd->pending = NULL;
+
+    s->upstream->peer.get = ngx_stream_nginxcraft_players_get_peer;
+    s->upstream->peer.free = ngx_stream_nginxcraft_players_free_peer;
+
+    return NGX_OK;
+}
+
+/*
+ * Like least_conn, but the peer with the most free player slots wins.
+ * Peers reported full are skipped, peers that did not answer the last
+ * poll are only used when no peer with known free slots is left.
+ */
+static ngx_int_t
+ngx_stream_nginxcraft_players_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_nginxcraft_players_peer_data_t  *pd = data;
+
+    time_t                           now;
+    uintptr_t                        m;
+    ngx_int_t                        slots, best_slots;
+    ngx_uint_t                       i, n, p;
+    ngx_stream_upstream_rr_peer_t   *peer, *best;
+    ngx_stream_upstream_rr_peers_t  *peers;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get nginxcraft players peer, try: %ui", pc->tries);
+
+    pc->connection = NULL;
+
+    peers = pd->rrp.peers;
+
+    ngx_stream_upstream_rr_peers_wlock(peers);
+
+    now = ngx_time();
+
+    best = NULL;
+    best_slots = -2;
+    p = 0;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (pd->rrp.tried[n] & m) {
+            continue;
+        }
+
+        if (peer->down) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
+        slots = ngx_stream_nginxcraft_poll_free(pd->poll, pd->base + i);
+
+        if (slots == 0) {
+            continue;
+        }
+
+        if (slots > best_slots) {
+            best = peer;
+            best_slots = slots;
+            p = i;
+        }
+    }
+
+    if (best == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "get nginxcraft players peer, no peer found");
+        goto failed;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get nginxcraft players peer: %V, slots: %i, index: %ui",
+                   &best->name, best_slots, p);
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    best->conns++;
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    pd->rrp.current = best;
+
+    n = p / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+    pd->rrp.tried[n] |= m;
+
+    /* counted until the session closes or the next poll shows the player */
+    if (pd->poll->sh) {
+        pd->pending = &pd->poll->sh->peer[pd->base + p];
+        pd->round = pd->pending->round;
+
+        (void) ngx_atomic_fetch_add(&pd->pending->pending, 1);
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+
+failed:
+
+    if (peers->next) {
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "get nginxcraft players peer, backup servers");
+
+        pd->rrp.peers = peers->next;
+        pd->base = peers->number;
+
+        n = (pd->rrp.peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        for (i = 0; i < n; i++) {
+            pd->rrp.tried[i] = 0;
+        }
+
+        ngx_stream_upstream_rr_peers_unlock(peers);
+
+        return ngx_stream_nginxcraft_players_get_peer(pc, pd);
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+static void
+ngx_stream_nginxcraft_players_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_stream_nginxcraft_players_peer_data_t  *pd = data;
+
+    ngx_atomic_uint_t                   n;
+    ngx_stream_nginxcraft_peer_stat_t  *stat;
+
+    stat = pd->pending;
+
+    if (stat) {
+        pd->pending = NULL;
+
+        /* a poll since then has cleared it already */
+
+        while (stat->round == pd->round) {
+            n = stat->pending;
+
+            if (n == 0 || ngx_atomic_cmp_set(&stat->pending, n, n - 1)) {
+                break;
+            }
+        }
+    }
+
+    ngx_stream_upstream_free_round_robin_peer(pc, &pd->rrp, state);
+}
+
+/* free slots of a peer, 0 if it is full and -1 if unknown */
+static ngx_int_t
+ngx_stream_nginxcraft_poll_free(ngx_stream_nginxcraft_poll_t *poll,
+    ngx_uint_t index)
+{
+    ngx_int_t                           slots, online, max;
+    ngx_msec_t                          updated;
+    ngx_msec_int_t                      age;
+    ngx_atomic_uint_t                   seq;
+    ngx_stream_nginxcraft_peer_stat_t  *stat;
+
+    if (poll->sh == NULL || index >= poll->sh->npeers) {
+        return -1;
+    }
+
+    stat = &poll->sh->peer[index];
+
+    /* another worker may be storing a poll, its fields are read together */
+
+    for ( ;; ) {
+        seq = stat->seq;
+
+        ngx_memory_barrier();
+
+        online = (ngx_int_t) stat->online;
+        max = (ngx_int_t) stat->max;
+        updated = stat->updated;
+
+        ngx_memory_barrier();
+
+        if (!(seq & 1) && stat->seq == seq) {
+            break;
+        }
+
+        ngx_cpu_pause();
+    }
+
+    if (updated == 0) {
+        return -1;
+    }
+
+    /* results of polls that stopped coming are not trusted */
+
+    age = (ngx_msec_int_t) (ngx_current_msec - updated);
+
+    if (age > (ngx_msec_int_t) (3 * poll->interval + poll->timeout)) {
+        return -1;
+    }
+
+    slots = max - online - (ngx_int_t) stat->pending;
+
+    return ngx_max(slots, 0);
+}
+
+/*
+ * Free slots over the peers not marked down, for nginxcraft_queue,
+ * -1 if no peer answered recently.
+ */
+ngx_int_t
+ngx_stream_nginxcraft_poll_slots(ngx_stream_nginxcraft_poll_t *poll)
+{
+    ngx_int_t   slots, total;
+    ngx_uint_t  i;
+
+    total = -1;
+
+    for (i = 0; i < poll->npeers; i++) {
+
+        if (poll->sh && poll->sh->peer[i].down) {
+            continue;
+        }
+
+        slots = ngx_stream_nginxcraft_poll_free(poll, i);
+
+        if (slots >= 0) {
+            total = ngx_max(total, 0) + slots;
+        }
+    }
+
+    return total;
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_poll_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_stream_nginxcraft_poll_t  *opoll = data;
+
+    size_t                         size;
+    ngx_stream_nginxcraft_poll_t  *poll;
+
+    poll = shm_zone->data;
+    poll->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (opoll && opoll->npeers == poll->npeers) {
+        poll->sh = opoll->sh;
+        return NGX_OK;
+    }
+
+    if (shm_zone->shm.exists) {
+        poll->sh = poll->shpool->data;
+        return NGX_OK;
+    }
+
+    size = sizeof(ngx_stream_nginxcraft_poll_sh_t)
+           + poll->npeers * sizeof(ngx_stream_nginxcraft_peer_stat_t);
+
+    poll->sh = ngx_slab_calloc(poll->shpool, size);
+
+    if (poll->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    poll->shpool->data = poll->sh;
+    poll->sh->npeers = poll->npeers;
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_stream_nginxcraft_poll_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                          i, j;
+    ngx_stream_nginxcraft_poll_t      **polls, *poll;
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_nginxcraft_main_conf_t  *nmcf;
+
+    nmcf = ngx_stream_cycle_get_module_main_conf(cycle, ngx_stream_nginxcraft_module);
+
+    if (nmcf == NULL) {
+        return NGX_OK;
+    }
+
+    polls = nmcf->polls.elts;
+
+    for (i = 0; i < nmcf->polls.nelts; i++) {
+        poll = polls[i];
+
+        poll->peers = ngx_pcalloc(cycle->pool,
+                          poll->npeers * sizeof(ngx_stream_nginxcraft_poll_peer_t));
+
+        if (poll->peers == NULL) {
+            return NGX_ERROR;
+        }
+
+        j = 0;
+
+        for (peers = poll->upstream->peer.data; peers; peers = peers->next) {
+            for (peer = peers->peer; peer && j < poll->npeers; peer = peer->next) {
+
+                if (ngx_stream_nginxcraft_poll_init_peer(cycle, poll,
+                                                         &poll->peers[j], peer)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                poll->peers[j].index = j;
+                poll->peers[j].peers = peers;
+                j++;
+            }
+        }
+
+        poll->npeers = j;
+
+        poll->event.handler = ngx_stream_nginxcraft_poll_handler;
+        poll->event.data = poll;
+        poll->event.log = cycle->log;
+        poll->event.cancelable = 1;
+
+        /* spread the workers, one of them polls each interval */
+        ngx_add_timer(&poll->event, ngx_random() % 1000);
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_poll_init_peer(ngx_cycle_t *cycle,
+    ngx_stream_nginxcraft_poll_t *poll, ngx_stream_nginxcraft_poll_peer_t *pp,
+    ngx_stream_upstream_rr_peer_t *peer)
+{
+    u_char     *p, *last;
+    size_t      size;
+    ngx_str_t   host;
+
+    pp->poll = poll;
+    pp->peer = peer;
+    pp->down = peer->down;
+    pp->sockaddr = peer->sockaddr;
+    pp->socklen = peer->socklen;
+    pp->name = &peer->name;
+
+    /* the configured name without the port goes into the handshake */
+
+    host = peer->server.len ? peer->server : peer->name;
+
+    last = host.data + host.len;
+
+    if (host.len && host.data[0] == '[') {
+        p = ngx_strlchr(host.data, last, ']');
+        host.data++;
+        host.len = p ? (size_t) (p - host.data) : host.len - 1;
+
+    } else {
+        p = ngx_strlchr(host.data, last, ':');
+
+        if (p && ngx_strlchr(p + 1, last, ':') == NULL) {
+            host.len = p - host.data;
+        }
+    }
+
+    host.len = ngx_min(host.len, NGX_STREAM_NGINXCRAFT_HOST_LEN);
+
+    size = get_handshake_packet_size(-1, host.len, 1) + 2;
+
+    pp->request.data = ngx_pnalloc(cycle->pool, size);
+
+    if (pp->request.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    pp->request.len = size;
+
+    create_handshake_packet(pp->request.data, -1, host.data, host.len,
+                            ngx_inet_get_port(peer->sockaddr), 1);
+
+    /* Status Request */
+    pp->request.data[size - 2] = 0x01;
+    pp->request.data[size - 1] = 0x00;
+
+    return NGX_OK;
+}
+
+static void
+ngx_stream_nginxcraft_poll_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                     i, start;
+    ngx_msec_t                     now;
+    ngx_stream_nginxcraft_poll_t  *poll;
+
+    poll = ev->data;
+
+    if (ngx_terminate || ngx_exiting) {
+        return;
+    }
+
+    now = ngx_current_msec;
+
+    ngx_shmtx_lock(&poll->shpool->mutex);
+
+    start = ((ngx_msec_int_t) (now - poll->sh->next) >= 0);
+
+    if (start) {
+        poll->sh->next = now + poll->interval;
+    }
+
+    ngx_shmtx_unlock(&poll->shpool->mutex);
+
+    if (start) {
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                       "nginxcraft poll \"%V\"", &poll->upstream->host);
+
+        for (i = 0; i < poll->npeers; i++) {
+            ngx_stream_nginxcraft_poll_start(&poll->peers[i]);
+        }
+    }
+
+    if (poll->check) {
+        for (i = 0; i < poll->npeers; i++) {
+            ngx_stream_nginxcraft_check_sync(&poll->peers[i]);
+        }
+    }
+
+    ngx_add_timer(ev, poll->interval);
+}
+
+static void
+ngx_stream_nginxcraft_poll_start(ngx_stream_nginxcraft_poll_peer_t *pp)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    if (pp->pc.connection) {
+        /* the last poll has not finished */
+        return;
+    }
+
+    if (pp->buffer == NULL) {
+        pp->buffer = ngx_create_temp_buf(ngx_cycle->pool,
+                                         NGX_STREAM_NGINXCRAFT_POLL_BUFFER);
+
+        if (pp->buffer == NULL) {
+            return;
+        }
+    }
+
+    pp->buffer->pos = pp->buffer->start;
+    pp->buffer->last = pp->buffer->start;
+    pp->sent = 0;
+
+    ngx_memzero(&pp->pc, sizeof(ngx_peer_connection_t));
+
+    pp->pc.sockaddr = pp->sockaddr;
+    pp->pc.socklen = pp->socklen;
+    pp->pc.name = pp->name;
+    pp->pc.get = ngx_event_get_peer;
+    pp->pc.log = ngx_cycle->log;
+    pp->pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&pp->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_DECLINED || rc == NGX_BUSY) {
+        ngx_stream_nginxcraft_poll_done(pp, NGX_ERROR, 0, 0);
+        return;
+    }
+
+    c = pp->pc.connection;
+    c->data = pp;
+
+    c->read->handler = ngx_stream_nginxcraft_poll_read_handler;
+    c->write->handler = ngx_stream_nginxcraft_poll_write_handler;
+
+    /* one timer for the whole exchange */
+    ngx_add_timer(c->write, pp->poll->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_stream_nginxcraft_poll_write_handler(c->write);
+    }
+}
+
+static void
+ngx_stream_nginxcraft_poll_write_handler(ngx_event_t *wev)
+{
+    ssize_t                             n;
+    ngx_connection_t                   *c;
+    ngx_stream_nginxcraft_poll_peer_t  *pp;
+
+    c = wev->data;
+    pp = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_WARN, c->log, NGX_ETIMEDOUT,
+                      "nginxcraft poll of %V timed out", pp->name);
+        ngx_stream_nginxcraft_poll_done(pp, NGX_ERROR, 0, 0);
+        return;
+    }
+
+    while (pp->sent < pp->request.len) {
+        n = c->send(c, pp->request.data + pp->sent,
+                    pp->request.len - pp->sent);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_stream_nginxcraft_poll_done(pp, NGX_ERROR, 0, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_stream_nginxcraft_poll_done(pp, NGX_ERROR, 0, 0);
+            return;
+        }
+
+        pp->sent += n;
+    }
+
+    if (c->read->ready) {
+        ngx_stream_nginxcraft_poll_read_handler(c->read);
+    }
+}
+
+static void
+ngx_stream_nginxcraft_poll_read_handler(ngx_event_t *rev)
+{
+    int32_t                             online, max;
+    ssize_t                             n;
+    ngx_int_t                           rc;
+    ngx_buf_t                          *b;
+    mc_string                           json;
+    minecraft_packet                    packet;
+    ngx_connection_t                   *c;
+    ngx_stream_nginxcraft_poll_peer_t  *pp;
+
+    c = rev->data;
+    pp = c->data;
+    b = pp->buffer;
+
+    for ( ;; ) {
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_stream_nginxcraft_poll_done(pp, NGX_ERROR, 0, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_stream_nginxcraft_poll_done(pp, NGX_ERROR, 0, 0);
+            return;
+        }
+
+        b->last += n;
+
+        rc = parse_packet(b->pos, b->last - b->pos, &packet);
+
+        if (rc == NGX_AGAIN) {
+            if (b->last == b->end) {
+                ngx_stream_nginxcraft_poll_done(pp, NGX_ERROR, 0, 0);
+                return;
+            }
+
+            continue;
+        }
+
+        break;
+    }
+
+    if (rc == NGX_OK && packet.packetId.value == 0x00) {
+        json = read_mc_string(packet.data, packet.data_length);
+
+        if (json.valid
+            && mc_status_players(json.data, json.data_length, &online, &max)
+               == NGX_OK)
+        {
+            ngx_stream_nginxcraft_poll_done(pp, NGX_OK, online, max);
+            return;
+        }
+
+        /* alive, but hides its player count */
+
+        if (json.valid && mc_json_object(json.data, json.data_length) == NGX_OK) {
+            ngx_stream_nginxcraft_poll_done(pp, NGX_DECLINED, 0, 0);
+            return;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                  "nginxcraft poll of %V: invalid status response", pp->name);
+
+    ngx_stream_nginxcraft_poll_done(pp, NGX_ERROR, 0, 0);
+}
+
+static void
+ngx_stream_nginxcraft_poll_done(ngx_stream_nginxcraft_poll_peer_t *pp,
+    ngx_int_t rc, int32_t online, int32_t max)
+{
+    ngx_stream_nginxcraft_peer_stat_t  *stat;
+
+    if (pp->pc.connection) {
+        ngx_close_connection(pp->pc.connection);
+        pp->pc.connection = NULL;
+    }
+
+    stat = &pp->poll->sh->peer[pp->index];
+
+    ngx_log_debug4(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
+                   "nginxcraft poll of %V: %i, players %D/%D",
+                   pp->name, rc, online, max);
+
+    if (pp->poll->check) {
+        ngx_stream_nginxcraft_check_update(pp, rc != NGX_ERROR);
+    }
+
+    (void) ngx_atomic_fetch_add(&stat->seq, 1);
+    ngx_memory_barrier();
+
+    if (rc != NGX_OK) {
+        stat->updated = 0;
+
+    } else {
+        stat->online = online;
+        stat->max = max;
+        stat->updated = ngx_current_msec ? ngx_current_msec : 1;
+
+        /* the players of these sessions are in online now */
+        (void) ngx_atomic_fetch_add(&stat->round, 1);
+        stat->pending = 0;
+    }
+
+    ngx_memory_barrier();
+    (void) ngx_atomic_fetch_add(&stat->seq, 1);
+}
+
+static void
+ngx_stream_nginxcraft_check_update(ngx_stream_nginxcraft_poll_peer_t *pp,
+    ngx_uint_t ok)
+{
+    ngx_stream_nginxcraft_poll_t       *poll;
+    ngx_stream_nginxcraft_peer_stat_t  *stat;
+
+    poll = pp->poll;
+    stat = &poll->sh->peer[pp->index];
+
+    if (ok) {
+        stat->falls = 0;
+
+        if (stat->down && ++stat->rises >= poll->rise) {
+            stat->down = 0;
+            stat->rises = 0;
+
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "nginxcraft check: %V in upstream \"%V\" is up",
+                          pp->name, &poll->upstream->host);
+        }
+
+    } else {
+        stat->rises = 0;
+
+        if (!stat->down && ++stat->falls >= poll->fall) {
+            stat->down = 1;
+            stat->falls = 0;
+
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "nginxcraft check: %V in upstream \"%V\" is down",
+                          pp->name, &poll->upstream->host);
+        }
+    }
+
+    ngx_stream_nginxcraft_check_sync(pp);
+}
+
+/* peers marked down in the configuration stay down */
+static void
+ngx_stream_nginxcraft_check_sync(ngx_stream_nginxcraft_poll_peer_t *pp)
+{
+    ngx_uint_t  down;
+
+    down = pp->down || pp->poll->sh->peer[pp->index].down;
+
+    if (pp->peer->down == down) {
+        return;
+    }
+
+    ngx_stream_upstream_rr_peers_wlock(pp->peers);
+
+    pp->peer->down = down;
+
+    ngx_stream_upstream_rr_peers_unlock(pp->peers);
+}
@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_upstream_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_UPSTREAM_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_UPSTREAM_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+/* what the last status poll of a peer returned, shared by all workers */
+typedef struct {
+    /* odd while online, max and updated are written */
+    ngx_atomic_t                  seq;
+    ngx_atomic_t                  online;
+    ngx_atomic_t                  max;
+    /*
+     * sessions sent to the peer since the poll and not closed yet, round
+     * counts the polls that cleared it
+     */
+    ngx_atomic_t                  pending;
+    ngx_atomic_t                  round;
+    /* 0 if the peer did not answer */
+    ngx_msec_t                    updated;
+    /* nginxcraft_check, polls in a row that changed nothing yet */
+    ngx_atomic_t                  down;
+    ngx_atomic_t                  rises;
+    ngx_atomic_t                  falls;
+} ngx_stream_nginxcraft_peer_stat_t;
+
+typedef struct {
+    ngx_msec_t                          next;
+    ngx_uint_t                          npeers;
+    ngx_stream_nginxcraft_peer_stat_t   peer[1];
+} ngx_stream_nginxcraft_poll_sh_t;
+
+typedef struct ngx_stream_nginxcraft_poll_peer_s  ngx_stream_nginxcraft_poll_peer_t;
+
+struct ngx_stream_nginxcraft_poll_s {
+    ngx_stream_upstream_srv_conf_t      *upstream;
+    ngx_shm_zone_t                      *shm_zone;
+    ngx_stream_nginxcraft_poll_sh_t     *sh;
+    ngx_slab_pool_t                     *shpool;
+    ngx_msec_t                           interval;
+    ngx_msec_t                           timeout;
+    ngx_uint_t                           npeers;
+
+    /* set by nginxcraft_players and nginxcraft_check */
+    unsigned                             players:1;
+    unsigned                             check:1;
+    ngx_uint_t                           rise;
+    ngx_uint_t                           fall;
+
+    /* per worker */
+    ngx_event_t                          event;
+    ngx_stream_nginxcraft_poll_peer_t   *peers;
+};
+
+char *ngx_stream_nginxcraft_players(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_stream_nginxcraft_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_stream_nginxcraft_poll_init(ngx_conf_t *cf);
+ngx_int_t ngx_stream_nginxcraft_poll_init_process(ngx_cycle_t *cycle);
+ngx_int_t ngx_stream_nginxcraft_poll_slots(ngx_stream_nginxcraft_poll_t *poll);
+
+#endif /* NGX_STREAM_NGINXCRAFT_UPSTREAM_MODULE_H */
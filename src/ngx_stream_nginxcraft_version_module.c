@@ -0,0 +1,441 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_version_module.c
+ *
+ * Routes by protocol version: nginxcraft_version_map compiles ranges of
+ * protocol numbers into a sorted table that is searched once per session,
+ * sets $minecraft_version_upstream from it and disconnects logins from
+ * rejected versions with a packet built at configuration time.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_version_module.h"
+#include "ngx_stream_nginxcraft_return_module.h"
+#include "ngx_stream_nginxcraft_metrics_module.h"
+
+/* snapshots set bit 30 of the protocol number */
+#define NGX_STREAM_NGINXCRAFT_SNAPSHOT  0x40000000
+
+typedef struct {
+    int32_t       protocol;
+    ngx_str_t     name;
+} ngx_stream_nginxcraft_version_name_t;
+
+/* the newest release speaking each protocol version */
+static ngx_stream_nginxcraft_version_name_t  ngx_stream_nginxcraft_versions[] = {
+    { 4,    ngx_string("1.7.5") },
+    { 5,    ngx_string("1.7.10") },
+    { 47,   ngx_string("1.8.9") },
+    { 107,  ngx_string("1.9") },
+    { 108,  ngx_string("1.9.1") },
+    { 109,  ngx_string("1.9.2") },
+    { 110,  ngx_string("1.9.4") },
+    { 210,  ngx_string("1.10.2") },
+    { 315,  ngx_string("1.11") },
+    { 316,  ngx_string("1.11.2") },
+    { 335,  ngx_string("1.12") },
+    { 338,  ngx_string("1.12.1") },
+    { 340,  ngx_string("1.12.2") },
+    { 393,  ngx_string("1.13") },
+    { 401,  ngx_string("1.13.1") },
+    { 404,  ngx_string("1.13.2") },
+    { 477,  ngx_string("1.14") },
+    { 480,  ngx_string("1.14.1") },
+    { 485,  ngx_string("1.14.2") },
+    { 490,  ngx_string("1.14.3") },
+    { 498,  ngx_string("1.14.4") },
+    { 573,  ngx_string("1.15") },
+    { 575,  ngx_string("1.15.1") },
+    { 578,  ngx_string("1.15.2") },
+    { 735,  ngx_string("1.16") },
+    { 736,  ngx_string("1.16.1") },
+    { 751,  ngx_string("1.16.2") },
+    { 753,  ngx_string("1.16.3") },
+    { 754,  ngx_string("1.16.5") },
+    { 755,  ngx_string("1.17") },
+    { 756,  ngx_string("1.17.1") },
+    { 757,  ngx_string("1.18.1") },
+    { 758,  ngx_string("1.18.2") },
+    { 759,  ngx_string("1.19") },
+    { 760,  ngx_string("1.19.2") },
+    { 761,  ngx_string("1.19.3") },
+    { 762,  ngx_string("1.19.4") },
+    { 763,  ngx_string("1.20.1") },
+    { 764,  ngx_string("1.20.2") },
+    { 765,  ngx_string("1.20.4") },
+    { 766,  ngx_string("1.20.6") },
+    { 767,  ngx_string("1.21.1") },
+    { 768,  ngx_string("1.21.3") },
+    { 769,  ngx_string("1.21.4") },
+    { 770,  ngx_string("1.21.5") },
+    { 771,  ngx_string("1.21.6") },
+    { 772,  ngx_string("1.21.8") },
+    { 773,  ngx_string("1.21.10") }
+};
+
+static ngx_str_t  ngx_stream_nginxcraft_version_snapshot = ngx_string("snapshot");
+
+static ngx_str_t  ngx_stream_nginxcraft_version_message =
+    ngx_string("{\"text\":\"This Minecraft version is not supported\"}");
+
+static ngx_stream_nginxcraft_version_range_t *ngx_stream_nginxcraft_version_find(
+    ngx_stream_nginxcraft_version_map_t *map, int32_t protocol);
+static char *ngx_stream_nginxcraft_version_entry(ngx_conf_t *cf,
+    ngx_command_t *dummy, void *conf);
+static ngx_int_t ngx_stream_nginxcraft_version_range(ngx_str_t *value,
+    int32_t *from, int32_t *to);
+static int ngx_libc_cdecl ngx_stream_nginxcraft_version_cmp(const void *one,
+    const void *two);
+
+ngx_int_t
+ngx_stream_nginxcraft_version_handler(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx)
+{
+    ngx_stream_nginxcraft_srv_conf_t       *nscf;
+    ngx_stream_nginxcraft_version_range_t  *range;
+
+    nscf = ngx_stream_get_module_srv_conf(s, ngx_stream_nginxcraft_module);
+
+    if (nscf->version_map == NULL) {
+        return NGX_DECLINED;
+    }
+
+    range = ngx_stream_nginxcraft_version_find(nscf->version_map,
+                                               ctx->handshake.protocolVersion);
+
+    ctx->version_range = range;
+
+    /* rejected clients still see the server list */
+
+    if (range == NULL || range->disconnect.len == 0
+        || ctx->handshake.nextState == 1)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "rejecting protocol version %D",
+                  ctx->handshake.protocolVersion);
+
+    ngx_stream_nginxcraft_metrics_reject(s, NGX_STREAM_NGINXCRAFT_METRICS_VERSION);
+
+    return ngx_stream_nginxcraft_disconnect(s, &range->disconnect);
+}
+
+static ngx_stream_nginxcraft_version_range_t *
+ngx_stream_nginxcraft_version_find(ngx_stream_nginxcraft_version_map_t *map,
+    int32_t protocol)
+{
+    ngx_uint_t                              lo, hi, mid;
+    ngx_stream_nginxcraft_version_range_t  *ranges;
+
+    ranges = map->ranges.elts;
+
+    lo = 0;
+    hi = map->ranges.nelts;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (protocol < ranges[mid].from) {
+            hi = mid;
+
+        } else if (protocol > ranges[mid].to) {
+            lo = mid + 1;
+
+        } else {
+            return &ranges[mid];
+        }
+    }
+
+    return map->default_range;
+}
+
+ngx_int_t
+ngx_stream_nginxcraft_version_upstream_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data)
+{
+    ngx_stream_nginxcraft_ctx_t            *ctx;
+    ngx_stream_nginxcraft_version_range_t  *range;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+
+    range = (ctx != NULL) ? ctx->version_range : NULL;
+
+    if (range == NULL || range->disconnect.len) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    *v = range->upstream;
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_stream_nginxcraft_version_name_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data)
+{
+    int32_t                                protocol;
+    ngx_str_t                             *name;
+    ngx_uint_t                             lo, hi, mid;
+    ngx_stream_nginxcraft_ctx_t           *ctx;
+    ngx_stream_nginxcraft_version_name_t  *versions;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
+
+    if (ctx == NULL || ctx->state != NGX_STREAM_NGINXCRAFT_STATE_DONE) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    protocol = ctx->handshake.protocolVersion;
+    versions = ngx_stream_nginxcraft_versions;
+    name = NULL;
+
+    if (protocol > 0 && (protocol & NGX_STREAM_NGINXCRAFT_SNAPSHOT)) {
+        name = &ngx_stream_nginxcraft_version_snapshot;
+
+    } else {
+        lo = 0;
+        hi = sizeof(ngx_stream_nginxcraft_versions)
+             / sizeof(ngx_stream_nginxcraft_version_name_t);
+
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+
+            if (protocol < versions[mid].protocol) {
+                hi = mid;
+
+            } else if (protocol > versions[mid].protocol) {
+                lo = mid + 1;
+
+            } else {
+                name = &versions[mid].name;
+                break;
+            }
+        }
+    }
+
+    if (name == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->len = name->len;
+    v->data = name->data;
+
+    return NGX_OK;
+}
+
+char *
+ngx_stream_nginxcraft_version_map(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    char                                   *rv;
+    ngx_uint_t                              i;
+    ngx_conf_t                              save;
+    ngx_stream_nginxcraft_version_map_t    *map;
+    ngx_stream_nginxcraft_version_range_t  *ranges;
+
+    if (nscf->version_map != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    map = ngx_pcalloc(cf->pool, sizeof(ngx_stream_nginxcraft_version_map_t));
+
+    if (map == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_array_init(&map->ranges, cf->pool, 16,
+                       sizeof(ngx_stream_nginxcraft_version_range_t))
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    save = *cf;
+    cf->ctx = map;
+    cf->handler = ngx_stream_nginxcraft_version_entry;
+    cf->handler_conf = conf;
+
+    rv = ngx_conf_parse(cf, NULL);
+
+    *cf = save;
+
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    ranges = map->ranges.elts;
+
+    ngx_qsort(ranges, map->ranges.nelts,
+              sizeof(ngx_stream_nginxcraft_version_range_t),
+              ngx_stream_nginxcraft_version_cmp);
+
+    for (i = 1; i < map->ranges.nelts; i++) {
+        if (ranges[i].from <= ranges[i - 1].to) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "protocol versions %D..%D and %D..%D overlap",
+                               ranges[i - 1].from, ranges[i - 1].to,
+                               ranges[i].from, ranges[i].to);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    nscf->version_map = map;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_stream_nginxcraft_version_entry(ngx_conf_t *cf, ngx_command_t *dummy,
+    void *conf)
+{
+    ngx_str_t                              *value, *message;
+    ngx_stream_nginxcraft_version_map_t    *map;
+    ngx_stream_nginxcraft_version_range_t  *range;
+
+    map = cf->ctx;
+    value = cf->args->elts;
+
+    if (cf->args->nelts < 2 || cf->args->nelts > 3
+        || (cf->args->nelts == 3 && ngx_strcmp(value[1].data, "reject") != 0))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of the map parameters");
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strcmp(value[0].data, "default") == 0) {
+
+        if (map->default_range) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate default version");
+            return NGX_CONF_ERROR;
+        }
+
+        range = ngx_pcalloc(cf->pool,
+                            sizeof(ngx_stream_nginxcraft_version_range_t));
+
+        if (range == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        map->default_range = range;
+
+    } else {
+        range = ngx_array_push(&map->ranges);
+
+        if (range == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(range, sizeof(ngx_stream_nginxcraft_version_range_t));
+
+        if (ngx_stream_nginxcraft_version_range(&value[0], &range->from,
+                                                &range->to)
+            != NGX_OK)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid protocol version range \"%V\"",
+                               &value[0]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (ngx_strcmp(value[1].data, "reject") == 0) {
+        message = (cf->args->nelts == 3) ? &value[2]
+                                         : &ngx_stream_nginxcraft_version_message;
+
+        if (ngx_stream_nginxcraft_disconnect_packet(cf->pool, message,
+                                                    &range->disconnect)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    range->upstream.len = value[1].len;
+    range->upstream.data = value[1].data;
+    range->upstream.valid = 1;
+
+    return NGX_CONF_OK;
+}
+
+/* "N", "N..M", "N.." or "..M" */
+static ngx_int_t
+ngx_stream_nginxcraft_version_range(ngx_str_t *value, int32_t *from, int32_t *to)
+{
+    u_char     *dots, *last;
+    ngx_int_t   n;
+
+    last = value->data + value->len;
+
+    dots = ngx_strlchr(value->data, last, '.');
+
+    if (dots == NULL) {
+        n = ngx_atoi(value->data, value->len);
+
+        if (n == NGX_ERROR || n > NGX_MAX_INT32_VALUE) {
+            return NGX_ERROR;
+        }
+
+        *from = *to = (int32_t) n;
+        return NGX_OK;
+    }
+
+    if (dots + 1 == last || dots[1] != '.') {
+        return NGX_ERROR;
+    }
+
+    *from = 0;
+    *to = NGX_MAX_INT32_VALUE;
+
+    if (dots != value->data) {
+        n = ngx_atoi(value->data, dots - value->data);
+
+        if (n == NGX_ERROR || n > NGX_MAX_INT32_VALUE) {
+            return NGX_ERROR;
+        }
+
+        *from = (int32_t) n;
+    }
+
+    if (dots + 2 != last) {
+        n = ngx_atoi(dots + 2, last - dots - 2);
+
+        if (n == NGX_ERROR || n > NGX_MAX_INT32_VALUE) {
+            return NGX_ERROR;
+        }
+
+        *to = (int32_t) n;
+    }
+
+    return (*from <= *to) ? NGX_OK : NGX_ERROR;
+}
+
+static int ngx_libc_cdecl
+ngx_stream_nginxcraft_version_cmp(const void *one, const void *two)
+{
+    const ngx_stream_nginxcraft_version_range_t  *first = one, *second = two;
+
+    if (first->from == second->from) {
+        return 0;
+    }
+
+    return (first->from < second->from) ? -1 : 1;
+}
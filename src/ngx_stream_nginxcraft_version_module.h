@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_version_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_VERSION_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_VERSION_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+struct ngx_stream_nginxcraft_version_range_s {
+    int32_t                      from;
+    int32_t                      to;
+    ngx_stream_variable_value_t  upstream;
+    /* Disconnect packet, empty unless the range is rejected */
+    ngx_str_t                    disconnect;
+};
+
+struct ngx_stream_nginxcraft_version_map_s {
+    /* sorted by protocol version, not overlapping */
+    ngx_array_t                               ranges;
+    ngx_stream_nginxcraft_version_range_t    *default_range;
+};
+
+char *ngx_stream_nginxcraft_version_map(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_stream_nginxcraft_version_handler(ngx_stream_session_t *s,
+    ngx_stream_nginxcraft_ctx_t *ctx);
+ngx_int_t ngx_stream_nginxcraft_version_upstream_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data);
+ngx_int_t ngx_stream_nginxcraft_version_name_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data);
+
+#endif /* NGX_STREAM_NGINXCRAFT_VERSION_MODULE_H */
@@ -0,0 +1,744 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_warm_module.c
+ *
+ * Keeps a few connections to every peer of an upstream open ahead of
+ * time, so that a session does not wait for a TCP handshake with a far
+ * away backend after preread. Each worker tops up its own pool from a
+ * timer; the balancer of the upstream still chooses the peer, and when a
+ * connection to that peer is waiting it is handed to the proxy instead
+ * of a new one, which then writes the preread handshake at once.
+ *
+ * A Minecraft server sends nothing before the handshake, so anything
+ * readable on a waiting connection is a close or a reset. Such
+ * connections are dropped as soon as they are noticed and once more
+ * checked right before they are handed out. Servers also close a
+ * connection that stays silent for 30 seconds, connections are dropped
+ * well before that.
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+#include "ngx_stream_nginxcraft_warm_module.h"
+
+typedef struct ngx_stream_nginxcraft_warm_peer_s  ngx_stream_nginxcraft_warm_peer_t;
+
+typedef struct {
+    ngx_queue_t                          queue;
+    ngx_stream_nginxcraft_warm_peer_t   *wp;
+    ngx_peer_connection_t                pc;
+    ngx_msec_t                           expires;
+    unsigned                             connected:1;
+} ngx_stream_nginxcraft_warm_conn_t;
+
+struct ngx_stream_nginxcraft_warm_peer_s {
+    ngx_stream_nginxcraft_warm_t        *warm;
+    ngx_stream_upstream_rr_peer_t       *peer;
+    struct sockaddr                     *sockaddr;
+    socklen_t                            socklen;
+    ngx_str_t                           *name;
+    /* connected, oldest first */
+    ngx_queue_t                          idle;
+    ngx_uint_t                           nidle;
+    ngx_uint_t                           connecting;
+};
+
+struct ngx_stream_nginxcraft_warm_s {
+    ngx_stream_upstream_srv_conf_t      *upstream;
+    ngx_stream_upstream_init_peer_pt     original_init_peer;
+    /* connections kept per peer in each worker */
+    ngx_uint_t                           max;
+    ngx_msec_t                           idle;
+    ngx_msec_t                           interval;
+
+    /* per worker */
+    ngx_event_t                          event;
+    ngx_stream_nginxcraft_warm_peer_t   *peers;
+    ngx_uint_t                           npeers;
+    ngx_queue_t                          free;
+};
+
+typedef struct {
+    ngx_stream_nginxcraft_warm_t        *warm;
+    void                                *data;
+    ngx_event_get_peer_pt                original_get_peer;
+    ngx_event_free_peer_pt               original_free_peer;
+#if (NGX_STREAM_SSL)
+    ngx_event_set_peer_session_pt        original_set_session;
+    ngx_event_save_peer_session_pt       original_save_session;
+#endif
+} ngx_stream_nginxcraft_warm_peer_data_t;
+
+static ngx_int_t ngx_stream_nginxcraft_warm_init_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_nginxcraft_warm_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_stream_nginxcraft_warm_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+#if (NGX_STREAM_SSL)
+static ngx_int_t ngx_stream_nginxcraft_warm_set_session(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_stream_nginxcraft_warm_save_session(ngx_peer_connection_t *pc,
+    void *data);
+#endif
+static ngx_connection_t *ngx_stream_nginxcraft_warm_take(
+    ngx_stream_nginxcraft_warm_t *warm, struct sockaddr *sockaddr,
+    socklen_t socklen);
+static void ngx_stream_nginxcraft_warm_handler(ngx_event_t *ev);
+static ngx_int_t ngx_stream_nginxcraft_warm_connect(
+    ngx_stream_nginxcraft_warm_peer_t *wp);
+static void ngx_stream_nginxcraft_warm_connect_handler(ngx_event_t *ev);
+static void ngx_stream_nginxcraft_warm_ready(ngx_stream_nginxcraft_warm_conn_t *wc);
+static void ngx_stream_nginxcraft_warm_idle_handler(ngx_event_t *ev);
+static void ngx_stream_nginxcraft_warm_dummy_handler(ngx_event_t *ev);
+static ngx_int_t ngx_stream_nginxcraft_warm_test(ngx_stream_nginxcraft_warm_conn_t *wc);
+static void ngx_stream_nginxcraft_warm_close(ngx_stream_nginxcraft_warm_conn_t *wc);
+
+char *
+ngx_stream_nginxcraft_warm(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_nginxcraft_srv_conf_t  *nscf = conf;
+
+    ngx_int_t                          n;
+    ngx_str_t                         *value, s;
+    ngx_uint_t                         i;
+    ngx_stream_nginxcraft_warm_t      *warm;
+
+    if (nscf->warm != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    warm = ngx_pcalloc(cf->pool, sizeof(ngx_stream_nginxcraft_warm_t));
+
+    if (warm == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    warm->upstream = ngx_stream_conf_get_module_srv_conf(cf,
+                                                         ngx_stream_upstream_module);
+    warm->idle = 15000;
+    warm->interval = 1000;
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of connections \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    warm->max = n;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "idle=", 5) == 0) {
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
+
+            warm->idle = ngx_parse_time(&s, 0);
+
+            if (warm->idle == (ngx_msec_t) NGX_ERROR || warm->idle == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.data = value[i].data + 9;
+            s.len = value[i].len - 9;
+
+            warm->interval = ngx_parse_time(&s, 0);
+
+            if (warm->interval == (ngx_msec_t) NGX_ERROR || warm->interval == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    nscf->warm = warm;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+/*
+ * Every balancer has set up its peers by now, the pool wraps whichever
+ * one the upstream uses, wherever the directive was placed.
+ */
+ngx_int_t
+ngx_stream_nginxcraft_warm_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                          i;
+    ngx_stream_nginxcraft_warm_t       *warm, **warmp;
+    ngx_stream_upstream_srv_conf_t    **uscfp;
+    ngx_stream_nginxcraft_srv_conf_t   *nscf;
+    ngx_stream_upstream_main_conf_t    *umcf;
+    ngx_stream_nginxcraft_main_conf_t  *nmcf;
+
+    umcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_upstream_module);
+    nmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_nginxcraft_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        nscf = ngx_stream_conf_upstream_srv_conf(uscfp[i],
+                                                 ngx_stream_nginxcraft_module);
+        warm = nscf->warm;
+
+        if (warm == NGX_CONF_UNSET_PTR || warm == NULL) {
+            continue;
+        }
+
+        warm->original_init_peer = uscfp[i]->peer.init;
+        uscfp[i]->peer.init = ngx_stream_nginxcraft_warm_init_peer;
+
+        warmp = ngx_array_push(&nmcf->warms);
+
+        if (warmp == NULL) {
+            return NGX_ERROR;
+        }
+
+        *warmp = warm;
+    }
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_stream_nginxcraft_warm_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                          i, j, n;
+    ngx_stream_nginxcraft_warm_t      **warms, *warm;
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_nginxcraft_warm_peer_t  *wp;
+    ngx_stream_nginxcraft_warm_conn_t  *wc;
+    ngx_stream_nginxcraft_main_conf_t  *nmcf;
+
+    nmcf = ngx_stream_cycle_get_module_main_conf(cycle, ngx_stream_nginxcraft_module);
+
+    if (nmcf == NULL) {
+        return NGX_OK;
+    }
+
+    warms = nmcf->warms.elts;
+
+    for (i = 0; i < nmcf->warms.nelts; i++) {
+        warm = warms[i];
+
+        peers = warm->upstream->peer.data;
+        n = peers->number + (peers->next ? peers->next->number : 0);
+
+        warm->peers = ngx_pcalloc(cycle->pool,
+                                  n * sizeof(ngx_stream_nginxcraft_warm_peer_t));
+
+        if (warm->peers == NULL) {
+            return NGX_ERROR;
+        }
+
+        wc = ngx_pcalloc(cycle->pool,
+                         n * warm->max * sizeof(ngx_stream_nginxcraft_warm_conn_t));
+
+        if (wc == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_queue_init(&warm->free);
+
+        for (j = 0; j < n * warm->max; j++) {
+            ngx_queue_insert_tail(&warm->free, &wc[j].queue);
+        }
+
+        j = 0;
+
+        for ( /* void */ ; peers; peers = peers->next) {
+            for (peer = peers->peer; peer && j < n; peer = peer->next) {
+                wp = &warm->peers[j++];
+
+                wp->warm = warm;
+                wp->peer = peer;
+                wp->sockaddr = peer->sockaddr;
+                wp->socklen = peer->socklen;
+                wp->name = &peer->name;
+
+                ngx_queue_init(&wp->idle);
+            }
+        }
+
+        warm->npeers = j;
+
+        warm->event.handler = ngx_stream_nginxcraft_warm_handler;
+        warm->event.data = warm;
+        warm->event.log = cycle->log;
+        warm->event.cancelable = 1;
+
+        /* do not let every worker connect at the same moment */
+        ngx_add_timer(&warm->event, ngx_random() % warm->interval);
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_warm_init_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_nginxcraft_srv_conf_t        *nscf;
+    ngx_stream_nginxcraft_warm_peer_data_t  *wd;
+
+    nscf = ngx_stream_conf_upstream_srv_conf(us, ngx_stream_nginxcraft_module);
+
+    wd = ngx_palloc(s->connection->pool,
+                    sizeof(ngx_stream_nginxcraft_warm_peer_data_t));
+
+    if (wd == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (nscf->warm->original_init_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    wd->warm = nscf->warm;
+    wd->data = s->upstream->peer.data;
+    wd->original_get_peer = s->upstream->peer.get;
+    wd->original_free_peer = s->upstream->peer.free;
+
+    s->upstream->peer.data = wd;
+    s->upstream->peer.get = ngx_stream_nginxcraft_warm_get_peer;
+    s->upstream->peer.free = ngx_stream_nginxcraft_warm_free_peer;
+
+#if (NGX_STREAM_SSL)
+    wd->original_set_session = s->upstream->peer.set_session;
+    wd->original_save_session = s->upstream->peer.save_session;
+
+    s->upstream->peer.set_session = ngx_stream_nginxcraft_warm_set_session;
+    s->upstream->peer.save_session = ngx_stream_nginxcraft_warm_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_warm_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_nginxcraft_warm_peer_data_t  *wd = data;
+
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    rc = wd->original_get_peer(pc, wd->data);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    c = ngx_stream_nginxcraft_warm_take(wd->warm, pc->sockaddr, pc->socklen);
+
+    if (c == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "nginxcraft warm connection to %V", pc->name);
+
+    /* the proxy takes a connection that is already there as it is */
+
+    pc->connection = c;
+    pc->cached = 1;
+
+    return NGX_DONE;
+}
+
+static void
+ngx_stream_nginxcraft_warm_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_stream_nginxcraft_warm_peer_data_t  *wd = data;
+
+    wd->original_free_peer(pc, wd->data, state);
+}
+
+#if (NGX_STREAM_SSL)
+
+static ngx_int_t
+ngx_stream_nginxcraft_warm_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_nginxcraft_warm_peer_data_t  *wd = data;
+
+    return wd->original_set_session(pc, wd->data);
+}
+
+static void
+ngx_stream_nginxcraft_warm_save_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_nginxcraft_warm_peer_data_t  *wd = data;
+
+    wd->original_save_session(pc, wd->data);
+}
+
+#endif
+
+static ngx_connection_t *
+ngx_stream_nginxcraft_warm_take(ngx_stream_nginxcraft_warm_t *warm,
+    struct sockaddr *sockaddr, socklen_t socklen)
+{
+    ngx_uint_t                          i;
+    ngx_queue_t                        *q;
+    ngx_connection_t                   *c;
+    ngx_stream_nginxcraft_warm_peer_t  *wp;
+    ngx_stream_nginxcraft_warm_conn_t  *wc;
+
+    wp = NULL;
+
+    for (i = 0; i < warm->npeers; i++) {
+        if (ngx_cmp_sockaddr(warm->peers[i].sockaddr, warm->peers[i].socklen,
+                             sockaddr, socklen, 1)
+            == NGX_OK)
+        {
+            wp = &warm->peers[i];
+            break;
+        }
+    }
+
+    if (wp == NULL) {
+        return NULL;
+    }
+
+    while (!ngx_queue_empty(&wp->idle)) {
+
+        /* the newest is the furthest from being closed by the server */
+
+        q = ngx_queue_last(&wp->idle);
+        wc = ngx_queue_data(q, ngx_stream_nginxcraft_warm_conn_t, queue);
+
+        if (ngx_stream_nginxcraft_warm_test(wc) != NGX_OK) {
+            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
+                           "nginxcraft warm connection to %V is stale",
+                           wp->name);
+            ngx_stream_nginxcraft_warm_close(wc);
+            continue;
+        }
+
+        c = wc->pc.connection;
+
+        ngx_queue_remove(q);
+        wp->nidle--;
+
+        wc->pc.connection = NULL;
+        ngx_queue_insert_head(&warm->free, q);
+
+        c->idle = 0;
+        ngx_reusable_connection(c, 0);
+
+        c->data = NULL;
+
+        return c;
+    }
+
+    return NULL;
+}
+
+static void
+ngx_stream_nginxcraft_warm_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                          i;
+    ngx_msec_t                          now;
+    ngx_queue_t                        *q;
+    ngx_stream_nginxcraft_warm_t       *warm;
+    ngx_stream_nginxcraft_warm_peer_t  *wp;
+    ngx_stream_nginxcraft_warm_conn_t  *wc;
+
+    warm = ev->data;
+
+    if (ngx_terminate || ngx_exiting) {
+        return;
+    }
+
+    now = ngx_current_msec;
+
+    for (i = 0; i < warm->npeers; i++) {
+        wp = &warm->peers[i];
+
+        while (!ngx_queue_empty(&wp->idle)) {
+            q = ngx_queue_head(&wp->idle);
+            wc = ngx_queue_data(q, ngx_stream_nginxcraft_warm_conn_t, queue);
+
+            if ((ngx_msec_int_t) (wc->expires - now) > 0) {
+                break;
+            }
+
+            ngx_stream_nginxcraft_warm_close(wc);
+        }
+
+        /* down in the configuration or by nginxcraft_check */
+
+        if (wp->peer->down) {
+            continue;
+        }
+
+        while (wp->nidle + wp->connecting < warm->max) {
+            if (ngx_stream_nginxcraft_warm_connect(wp) != NGX_OK) {
+                break;
+            }
+        }
+    }
+
+    ngx_add_timer(ev, warm->interval);
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_warm_connect(ngx_stream_nginxcraft_warm_peer_t *wp)
+{
+    ngx_int_t                           rc;
+    ngx_queue_t                        *q;
+    ngx_connection_t                   *c;
+    ngx_stream_nginxcraft_warm_t       *warm;
+    ngx_stream_nginxcraft_warm_conn_t  *wc;
+
+    warm = wp->warm;
+
+    if (ngx_queue_empty(&warm->free)) {
+        return NGX_ERROR;
+    }
+
+    q = ngx_queue_head(&warm->free);
+    ngx_queue_remove(q);
+
+    wc = ngx_queue_data(q, ngx_stream_nginxcraft_warm_conn_t, queue);
+
+    ngx_memzero(&wc->pc, sizeof(ngx_peer_connection_t));
+
+    wc->wp = wp;
+    wc->connected = 0;
+    wc->expires = ngx_current_msec + warm->idle;
+
+    wc->pc.sockaddr = wp->sockaddr;
+    wc->pc.socklen = wp->socklen;
+    wc->pc.name = wp->name;
+    wc->pc.get = ngx_event_get_peer;
+    wc->pc.log = ngx_cycle->log;
+    wc->pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&wc->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_DECLINED || rc == NGX_BUSY) {
+        if (wc->pc.connection) {
+            ngx_close_connection(wc->pc.connection);
+            wc->pc.connection = NULL;
+        }
+
+        ngx_queue_insert_head(&warm->free, q);
+        return NGX_ERROR;
+    }
+
+    wp->connecting++;
+
+    c = wc->pc.connection;
+    c->data = wc;
+
+    c->read->handler = ngx_stream_nginxcraft_warm_connect_handler;
+    c->write->handler = ngx_stream_nginxcraft_warm_connect_handler;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, warm->idle);
+        return NGX_OK;
+    }
+
+    ngx_stream_nginxcraft_warm_ready(wc);
+
+    return NGX_OK;
+}
+
+static void
+ngx_stream_nginxcraft_warm_connect_handler(ngx_event_t *ev)
+{
+    int                                 err;
+    socklen_t                           len;
+    ngx_connection_t                   *c;
+    ngx_stream_nginxcraft_warm_conn_t  *wc;
+
+    c = ev->data;
+    wc = c->data;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_WARN, c->log, NGX_ETIMEDOUT,
+                      "nginxcraft warm connect to %V timed out", wc->wp->name);
+        ngx_stream_nginxcraft_warm_close(wc);
+        return;
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        ngx_log_error(NGX_LOG_WARN, c->log, err,
+                      "nginxcraft warm connect to %V failed", wc->wp->name);
+        ngx_stream_nginxcraft_warm_close(wc);
+        return;
+    }
+
+    ngx_stream_nginxcraft_warm_ready(wc);
+}
+
+static void
+ngx_stream_nginxcraft_warm_ready(ngx_stream_nginxcraft_warm_conn_t *wc)
+{
+    ngx_connection_t                   *c;
+    ngx_stream_nginxcraft_warm_peer_t  *wp;
+
+    c = wc->pc.connection;
+    wp = wc->wp;
+
+    wp->connecting--;
+    wp->nidle++;
+    wc->connected = 1;
+
+    ngx_queue_insert_tail(&wp->idle, &wc->queue);
+
+    if (ngx_terminate || ngx_exiting) {
+        ngx_stream_nginxcraft_warm_close(wc);
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "nginxcraft warm connected to %V", wp->name);
+
+    c->read->handler = ngx_stream_nginxcraft_warm_idle_handler;
+    c->write->handler = ngx_stream_nginxcraft_warm_dummy_handler;
+
+    if (c->write->active && (ngx_event_flags & NGX_USE_LEVEL_EVENT)) {
+        if (ngx_del_event(c->write, NGX_WRITE_EVENT, 0) != NGX_OK) {
+            ngx_stream_nginxcraft_warm_close(wc);
+            return;
+        }
+    }
+
+    /* closed first when the worker runs out of connections or exits */
+
+    c->idle = 1;
+    ngx_reusable_connection(c, 1);
+
+    if (c->read->ready) {
+        ngx_stream_nginxcraft_warm_idle_handler(c->read);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_stream_nginxcraft_warm_close(wc);
+    }
+}
+
+static void
+ngx_stream_nginxcraft_warm_idle_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                   *c;
+    ngx_stream_nginxcraft_warm_conn_t  *wc;
+
+    c = ev->data;
+    wc = c->data;
+
+    if (c->close || ngx_stream_nginxcraft_warm_test(wc) != NGX_OK) {
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "nginxcraft warm connection to %V closed",
+                       wc->wp->name);
+        ngx_stream_nginxcraft_warm_close(wc);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_stream_nginxcraft_warm_close(wc);
+    }
+}
+
+static void
+ngx_stream_nginxcraft_warm_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "nginxcraft warm dummy handler");
+}
+
+static ngx_int_t
+ngx_stream_nginxcraft_warm_test(ngx_stream_nginxcraft_warm_conn_t *wc)
+{
+    u_char             buf[1];
+    ssize_t            n;
+    ngx_err_t          err;
+    ngx_connection_t  *c;
+
+    c = wc->pc.connection;
+
+    if (c->read->eof || c->read->error || c->write->error) {
+        return NGX_ERROR;
+    }
+
+    if ((ngx_msec_int_t) (wc->expires - ngx_current_msec) <= 0) {
+        return NGX_ERROR;
+    }
+
+    /* nothing may be readable before the handshake, not even an EOF */
+
+    n = recv(c->fd, (char *) buf, 1, MSG_PEEK);
+
+    if (n == -1) {
+        err = ngx_socket_errno;
+
+        if (err == NGX_EAGAIN) {
+            return NGX_OK;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+static void
+ngx_stream_nginxcraft_warm_close(ngx_stream_nginxcraft_warm_conn_t *wc)
+{
+    ngx_stream_nginxcraft_warm_peer_t  *wp;
+
+    wp = wc->wp;
+
+    if (wc->connected) {
+        ngx_queue_remove(&wc->queue);
+        wp->nidle--;
+
+    } else {
+        wp->connecting--;
+    }
+
+    ngx_close_connection(wc->pc.connection);
+    wc->pc.connection = NULL;
+
+    ngx_queue_insert_head(&wp->warm->free, &wc->queue);
+}
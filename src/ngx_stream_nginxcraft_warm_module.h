@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ngx_stream_nginxcraft_warm_module.h
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#ifndef NGX_STREAM_NGINXCRAFT_WARM_MODULE_H
+#define NGX_STREAM_NGINXCRAFT_WARM_MODULE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_nginxcraft_module.h"
+
+char *ngx_stream_nginxcraft_warm(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_stream_nginxcraft_warm_init(ngx_conf_t *cf);
+ngx_int_t ngx_stream_nginxcraft_warm_init_process(ngx_cycle_t *cycle);
+
+#endif /* NGX_STREAM_NGINXCRAFT_WARM_MODULE_H */
@@ -17,27 +17,66 @@
 #include "ngx_stream_nginxcraft_module.h"
 #include "minecraft_funcs.h"
 
-#define ngx_snprint_int(buf, len, val) \
-    ngx_str_snprintf(buf, len, "%d", val)
-
-#define ngx_snprint_uint(buf, len, val) \
-    ngx_str_snprintf(buf, len, "%u", val)
-
-
-static ngx_int_t ngx_str_snprintf(ngx_str_t* ret, size_t sz, const char *fmt, ...);
-
-static ngx_int_t minecraft_port_variable(ngx_stream_session_t *s, ngx_stream_variable_value_t *v,
-    uintptr_t data);
-static ngx_int_t minecraft_version_variable(ngx_stream_session_t *s,
+#define NGX_STREAM_NGINXCRAFT_VAR_PORT        0
+#define NGX_STREAM_NGINXCRAFT_VAR_VERSION     1
+#define NGX_STREAM_NGINXCRAFT_VAR_NEXT_STATE  2
+#define NGX_STREAM_NGINXCRAFT_VAR_USERNAME    3
+#define NGX_STREAM_NGINXCRAFT_VAR_UUID        4
+
+#define NGX_STREAM_NGINXCRAFT_VAR_PREREAD_TIME     0
+#define NGX_STREAM_NGINXCRAFT_VAR_HANDSHAKE_BYTES  1
+#define NGX_STREAM_NGINXCRAFT_VAR_PREREAD_READS    2
+#define NGX_STREAM_NGINXCRAFT_VAR_ROUTE_SOURCE     3
+
+static ngx_int_t ngx_stream_nginxcraft_handshake_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_stream_nginxcraft_preread_variable(ngx_stream_session_t *s,
     ngx_stream_variable_value_t *v, uintptr_t data);
 
+static ngx_str_t  ngx_stream_nginxcraft_route_sources[] = {
+    ngx_null_string,
+    ngx_string("name"),
+    ngx_string("default"),
+    ngx_string("declined")
+};
+
 static ngx_stream_variable_t nginxcraft_vars[] = {
 
     { ngx_string("minecraft_port"), NULL,
-      minecraft_port_variable, 0, 0, 0 },
+      ngx_stream_nginxcraft_handshake_variable,
+      NGX_STREAM_NGINXCRAFT_VAR_PORT, 0, 0 },
 
     { ngx_string("minecraft_version"), NULL,
-      minecraft_version_variable, 0, 0, 0 },
+      ngx_stream_nginxcraft_handshake_variable,
+      NGX_STREAM_NGINXCRAFT_VAR_VERSION, 0, 0 },
+
+    { ngx_string("minecraft_next_state"), NULL,
+      ngx_stream_nginxcraft_handshake_variable,
+      NGX_STREAM_NGINXCRAFT_VAR_NEXT_STATE, 0, 0 },
+
+    { ngx_string("minecraft_username"), NULL,
+      ngx_stream_nginxcraft_handshake_variable,
+      NGX_STREAM_NGINXCRAFT_VAR_USERNAME, 0, 0 },
+
+    { ngx_string("minecraft_uuid"), NULL,
+      ngx_stream_nginxcraft_handshake_variable,
+      NGX_STREAM_NGINXCRAFT_VAR_UUID, 0, 0 },
+
+    { ngx_string("minecraft_preread_time"), NULL,
+      ngx_stream_nginxcraft_preread_variable,
+      NGX_STREAM_NGINXCRAFT_VAR_PREREAD_TIME, NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("minecraft_handshake_bytes"), NULL,
+      ngx_stream_nginxcraft_preread_variable,
+      NGX_STREAM_NGINXCRAFT_VAR_HANDSHAKE_BYTES, NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("minecraft_preread_reads"), NULL,
+      ngx_stream_nginxcraft_preread_variable,
+      NGX_STREAM_NGINXCRAFT_VAR_PREREAD_READS, NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("minecraft_route_source"), NULL,
+      ngx_stream_nginxcraft_preread_variable,
+      NGX_STREAM_NGINXCRAFT_VAR_ROUTE_SOURCE, NGX_STREAM_VAR_NOCACHEABLE, 0 },
 
       ngx_stream_null_variable
 };
@@ -62,118 +101,219 @@ submodule_nginxcraft_add_variables(ngx_conf_t *cf)
     return NGX_OK;
 }
 
+/*
+ * The numbers are only formatted when a variable is first read, into
+ * storage inside the ctx, so sessions nobody logs cost no allocations.
+ */
 static ngx_int_t
-minecraft_port_variable(ngx_stream_session_t *s,
+ngx_stream_nginxcraft_handshake_variable(ngx_stream_session_t *s,
     ngx_stream_variable_value_t *v, uintptr_t data)
 {
-    ngx_stream_nginxcraft_ctx_t *ctx;
-    nginxcraft_var              *vars;
-
-    (void)data;
+    u_char                       *p;
+    ngx_stream_nginxcraft_ctx_t  *ctx;
 
     ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
-    vars = (nginxcraft_var *)ctx->variables;
 
     v->valid = 1;
     v->no_cacheable = 0;
     v->not_found = 0;
 
-    if (ctx == NULL || vars == NULL) {
+    if (ctx == NULL || ctx->state != NGX_STREAM_NGINXCRAFT_STATE_DONE) {
         v->len = 0;
         v->data = NULL;
         return NGX_OK;
     }
 
-    v->len = vars->minecraft_port.len;
-    v->data = vars->minecraft_port.data;
+    switch (data) {
+
+    case NGX_STREAM_NGINXCRAFT_VAR_PORT:
+        v->data = ctx->port_text;
+        p = ngx_sprintf(v->data, "%uD", (uint32_t) ctx->handshake.serv_Port);
+        break;
+
+    case NGX_STREAM_NGINXCRAFT_VAR_VERSION:
+        v->data = ctx->version_text;
+        p = ngx_sprintf(v->data, "%D", ctx->handshake.protocolVersion);
+        break;
+
+    case NGX_STREAM_NGINXCRAFT_VAR_NEXT_STATE:
+        v->data = ctx->next_state_text;
+        p = ngx_sprintf(v->data, "%D", ctx->handshake.nextState);
+        break;
+
+    case NGX_STREAM_NGINXCRAFT_VAR_USERNAME:
+        v->data = ctx->username.data;
+        p = ctx->username.data + ctx->username.len;
+        break;
+
+    default: /* NGX_STREAM_NGINXCRAFT_VAR_UUID */
+        if (ctx->uuid == NULL) {
+            v->len = 0;
+            v->data = NULL;
+            return NGX_OK;
+        }
+
+        v->data = ctx->uuid_text;
+
+        p = ngx_hex_dump(v->data, (u_char *) ctx->uuid, 4);
+        *p++ = '-';
+        p = ngx_hex_dump(p, (u_char *) ctx->uuid + 4, 2);
+        *p++ = '-';
+        p = ngx_hex_dump(p, (u_char *) ctx->uuid + 6, 2);
+        *p++ = '-';
+        p = ngx_hex_dump(p, (u_char *) ctx->uuid + 8, 2);
+        *p++ = '-';
+        p = ngx_hex_dump(p, (u_char *) ctx->uuid + 10, 6);
+        break;
+    }
+
+    v->len = p - v->data;
 
     return NGX_OK;
 }
 
+/*
+ * Timing of the preread, from the time cached by the event loop when the
+ * handler was first and last called, so reading it costs no system call.
+ */
 static ngx_int_t
-minecraft_version_variable(ngx_stream_session_t *s,
+ngx_stream_nginxcraft_preread_variable(ngx_stream_session_t *s,
     ngx_stream_variable_value_t *v, uintptr_t data)
 {
-    ngx_stream_nginxcraft_ctx_t *ctx;
-    nginxcraft_var              *vars;
-
-    (void)data;
+    u_char                       *p;
+    ngx_msec_int_t                ms;
+    ngx_stream_nginxcraft_ctx_t  *ctx;
 
     ctx = ngx_stream_get_module_ctx(s, ngx_stream_nginxcraft_module);
-    vars = (nginxcraft_var *)ctx->variables;
+
+    /* still changing while the preread goes on, the access log wants the end */
 
     v->valid = 1;
-    v->no_cacheable = 0;
+    v->no_cacheable = 1;
     v->not_found = 0;
 
-    if (ctx == NULL || vars == NULL) {
+    if (ctx == NULL || ctx->preread_reads == 0) {
         v->len = 0;
         v->data = NULL;
         return NGX_OK;
     }
 
-    v->len = vars->minecraft_version.len;
-    v->data = vars->minecraft_version.data;
+    switch (data) {
+
+    case NGX_STREAM_NGINXCRAFT_VAR_PREREAD_TIME:
+        ms = (ngx_msec_int_t) (ctx->end - ctx->start);
+        ms = ngx_max(ms, 0);
+
+        v->data = ctx->preread_time_text;
+        p = ngx_sprintf(v->data, "%T.%03M", (time_t) ms / 1000, ms % 1000);
+        break;
+
+    case NGX_STREAM_NGINXCRAFT_VAR_HANDSHAKE_BYTES:
+        if (!ctx->routed) {
+            v->len = 0;
+            v->data = NULL;
+            return NGX_OK;
+        }
+
+        v->data = ctx->handshake_bytes_text;
+        p = ngx_sprintf(v->data, "%uz", ctx->handshake_bytes);
+        break;
+
+    case NGX_STREAM_NGINXCRAFT_VAR_PREREAD_READS:
+        v->data = ctx->preread_reads_text;
+        p = ngx_sprintf(v->data, "%ui", ctx->preread_reads);
+        break;
+
+    default: /* NGX_STREAM_NGINXCRAFT_VAR_ROUTE_SOURCE */
+        v->data = ngx_stream_nginxcraft_route_sources[ctx->route].data;
+        p = v->data + ngx_stream_nginxcraft_route_sources[ctx->route].len;
+        break;
+    }
+
+    v->len = p - v->data;
 
     return NGX_OK;
 }
 
 ngx_int_t
-ngx_stream_nginxcraft_parse(ngx_stream_nginxcraft_ctx_t *ctx, ngx_buf_t *buf)
+ngx_stream_nginxcraft_parse(ngx_stream_nginxcraft_ctx_t *ctx, ngx_buf_t *buf,
+    size_t limit)
 {
     u_char              *p = buf->pos;
-    size_t               len = p - buf->last;;
-    minecraft_packet     packet;
-    minecraft_handshake  handshake;
-    nginxcraft_var      *vars;
+    size_t               len = buf->last - buf->pos;
+    minecraft_packet    *packet;
     int                  ret;
 
-    ret = parse_packet(p, len, &packet);
+    switch (ctx->state) {
 
-    if (ret != NGX_OK) {
-        return NGX_DECLINED;
-    }
+    case NGX_STREAM_NGINXCRAFT_STATE_FRAME:
+        if (len - ctx->length.length < (size_t)ctx->length.value) {
+            return NGX_AGAIN;
+        }
 
-    ret = parse_handshake(&packet, &handshake);
+        /* the length prefix was decoded when the frame was first seen */
 
-    if (ret != NGX_OK) {
-        return NGX_DECLINED;
-    }
+        packet = &ctx->frames.packet[0];
 
-    ctx->variables = ngx_pnalloc(ctx->pool, sizeof(nginxcraft_var));
+        if (parse_packet_frame(p + ctx->length.length, ctx->length, packet)
+            != NGX_OK)
+        {
+            return NGX_DECLINED;
+        }
 
-    if (ctx->variables == NULL) {
-        return NGX_ERROR;
-    }
+        ctx->frames.count = 1;
+        break;
 
-    vars = (nginxcraft_var *)ctx->variables;
+    case NGX_STREAM_NGINXCRAFT_STATE_LENGTH:
+        ret = parse_frames(p, len, &ctx->frames);
 
-    ctx->host.data = ngx_pnalloc(ctx->pool, handshake.serv_Address.data_length);
+        if (ret == NGX_AGAIN) {
+            if (!ctx->frames.partial.valid) {
+                return NGX_AGAIN;
+            }
 
-    if (ctx->host.data == NULL) {
-        return NGX_ERROR;
-    }
+            ctx->length = ctx->frames.partial;
+            ctx->state = NGX_STREAM_NGINXCRAFT_STATE_FRAME;
 
-    ret = mc_str2ngx_str(&ctx->host, handshake.serv_Address.data_length, handshake.serv_Address);
+        } else if (ret == NGX_OK) {
+            ctx->length = ctx->frames.packet[0].length;
 
-    if (ret != NGX_OK) {
-        return NGX_ERROR;
-    }
+        } else {
+            return NGX_DECLINED;
+        }
 
-    vars->minecraft_port.data = ngx_pnalloc(ctx->pool, 6);
+        if (ctx->length.length + (size_t)ctx->length.value > limit) {
+            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ctx->log, 0,
+                           "nginxcraft frame length: %d", ctx->length.value);
+            return NGX_DECLINED;
+        }
 
-    if (vars->minecraft_port.data == NULL) {
-        return NGX_ERROR;
+        if (ret == NGX_AGAIN) {
+            return NGX_AGAIN;
+        }
+
+        packet = &ctx->frames.packet[0];
+        break;
+
+    default:
+        return NGX_OK;
     }
 
-    vars->minecraft_version.data = ngx_pnalloc(ctx->pool, 11);
+    ret = parse_handshake(packet, &ctx->handshake);
 
-    if (vars->minecraft_version.data == NULL) {
-        return NGX_ERROR;
+    if (ret != NGX_OK) {
+        return NGX_DECLINED;
     }
 
-    ngx_snprint_uint(&vars->minecraft_port, 6, handshake.serv_Port);
-    ngx_snprint_int(&vars->minecraft_version, 11, handshake.protocolVersion);
+    ctx->offset = ctx->length.length + ctx->length.value;
+    ctx->frame = 1;
+    ctx->state = NGX_STREAM_NGINXCRAFT_STATE_DONE;
+
+    /* a view into the preread buffer, which lives as long as the session */
+
+    ctx->host.data = (u_char *) ctx->handshake.serv_Address.data;
+    ctx->host.len = mc_host_length(ctx->host.data,
+                                   ctx->handshake.serv_Address.data_length);
 
     ngx_log_debug(NGX_LOG_DEBUG_STREAM, ctx->log, 0, "nginxcraft parse: %V",  &ctx->host);
 
@@ -181,24 +321,81 @@ ngx_stream_nginxcraft_parse(ngx_stream_nginxcraft_ctx_t *ctx, ngx_buf_t *buf)
 }
 
 
-static ngx_int_t
-ngx_str_snprintf(ngx_str_t* ret, size_t sz, const char *fmt, ...)
+/*
+ * Hands out the packet at ctx->offset and moves past it. The frames found
+ * by the last scan of the preread buffer are used first, the buffer is only
+ * scanned again once they run out. On NGX_AGAIN packet->length is the
+ * length prefix of the incomplete packet, if it could be read.
+ */
+ngx_int_t
+ngx_stream_nginxcraft_next_packet(ngx_stream_nginxcraft_ctx_t *ctx,
+    ngx_buf_t *buf, minecraft_packet *packet)
+{
+    ngx_int_t  rc;
+
+    if (ctx->frame == ctx->frames.count) {
+        ctx->frame = 0;
+
+        rc = parse_frames(buf->pos + ctx->offset,
+                          buf->last - buf->pos - ctx->offset, &ctx->frames);
+
+        if (rc != NGX_OK) {
+            packet->length = ctx->frames.partial;
+            return rc;
+        }
+    }
+
+    *packet = ctx->frames.packet[ctx->frame++];
+    ctx->offset += packet->length.length + packet->length.value;
+
+    return NGX_OK;
+}
+
+/*
+ * Login Start follows the handshake, usually in the same segment. Giving up
+ * on it is not an error, the session is proxied without the username.
+ */
+ngx_int_t
+ngx_stream_nginxcraft_parse_login(ngx_stream_nginxcraft_ctx_t *ctx,
+    ngx_buf_t *buf, size_t limit)
 {
-    //u_char   *p;
-    va_list   args;
+    minecraft_packet        packet;
+    minecraft_login_start   login;
+    int                     ret;
 
-    if (ret->data == NULL) {
-        return NGX_ERROR;
+    if (ctx->login_done) {
+        return NGX_OK;
+    }
+
+    ret = ngx_stream_nginxcraft_next_packet(ctx, buf, &packet);
+
+    if (ret == NGX_AGAIN) {
+        if (!packet.length.valid
+            || ctx->offset + packet.length.length + packet.length.value <= limit)
+        {
+            return NGX_AGAIN;
+        }
+
+        ret = NGX_ERROR;
+    }
+
+    ctx->login_done = 1;
+
+    if (ret != NGX_OK
+        || parse_login_start(&packet, ctx->handshake.protocolVersion, &login)
+           != NGX_OK)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ctx->log, 0,
+                       "nginxcraft login start not found");
+        return NGX_OK;
     }
 
-    va_start(args, fmt);
-    //TODO: use ngx_vsnprintf
-    //p = ngx_vsnprintf(ret->data, sz, fmt, args);
-    (void)vsnprintf((char*)ret->data, sz, fmt, args);
-    ret->len = strnlen((char*)ret->data, sz);
-    va_end(args);
+    ctx->username.data = (u_char *) login.name.data;
+    ctx->username.len = login.name.data_length;
+    ctx->uuid = login.uuid;
 
-    //ret->len = p - ret->data;
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ctx->log, 0,
+                   "nginxcraft login: %V", &ctx->username);
 
     return NGX_OK;
 }
@@ -0,0 +1,283 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * mc_events.c
+ *
+ * Drains the handshake records of an nginxcraft_event_log zone from an
+ * nginxcraft_event_log_drain server. Records are printed one per line,
+ * or with -o appended as they are, 64 bytes each, to a file for other
+ * tools. With -i the server is drained again every interval until the
+ * tool is stopped. Records lost to a full ring are reported on stderr.
+ *
+ * usage: mc_events [-l addr] [-p port] [-u path] [-o file] [-i seconds]
+ *
+ * Copyright (C) 2024-2025 Jesse Taube <Mr.Bossman075@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MC_EVENTS_MAGIC   "NCEVLOG1"
+#define MC_EVENTS_HOST    18
+
+/* as ngx_stream_nginxcraft_event_record_t */
+typedef struct {
+    uint64_t       seq;
+    uint64_t       time;
+    unsigned char  addr[16];
+    uint32_t       host_hash;
+    int32_t        version;
+    uint16_t       port;
+    uint8_t        next_state;
+    uint8_t        route;
+    uint8_t        outcome;
+    uint8_t        host_len;
+    unsigned char  host[MC_EVENTS_HOST];
+} mc_event_t;
+
+/* as ngx_stream_nginxcraft_event_header_t */
+typedef struct {
+    unsigned char  magic[8];
+    uint32_t       record_size;
+    uint32_t       count;
+    uint64_t       lost;
+    uint64_t       total;
+} mc_event_header_t;
+
+static const char  *mc_routes[] = { "none", "name", "default", "declined" };
+static const char  *mc_outcomes[] = { "proxy", "local", "closed" };
+
+static int
+mc_connect(const char *addr, int port, const char *path)
+{
+    int                  fd;
+    struct sockaddr_in   sin;
+    struct sockaddr_un   sun;
+
+    if (path) {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (fd == -1 || connect(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+            perror(path);
+            goto failed;
+        }
+
+        return fd;
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+        fprintf(stderr, "invalid address \"%s\"\n", addr);
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd == -1 || connect(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+        perror(addr);
+        goto failed;
+    }
+
+    return fd;
+
+failed:
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    return -1;
+}
+
+static int
+mc_read(int fd, void *buf, size_t len)
+{
+    ssize_t  n;
+    size_t   got;
+
+    for (got = 0; got < len; got += n) {
+        n = read(fd, (char *) buf + got, len - got);
+
+        if (n == -1 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+
+        if (n <= 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+mc_print(const mc_event_t *e)
+{
+    char         addr[INET6_ADDRSTRLEN], when[32];
+    time_t       sec;
+    struct tm    tm;
+    static const unsigned char  mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                               0xff, 0xff };
+
+    if (memcmp(e->addr, mapped, 12) == 0) {
+        inet_ntop(AF_INET, &e->addr[12], addr, sizeof(addr));
+
+    } else {
+        inet_ntop(AF_INET6, e->addr, addr, sizeof(addr));
+    }
+
+    sec = (time_t) (e->time / 1000);
+    gmtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    printf("%s.%03uZ %s %.*s%s %08x %d %u %u %s %s\n",
+           when, (unsigned) (e->time % 1000), addr,
+           e->host_len == 0 ? 1
+           : e->host_len < MC_EVENTS_HOST ? e->host_len : MC_EVENTS_HOST,
+           e->host_len ? (const char *) e->host : "-",
+           e->host_len > MC_EVENTS_HOST ? "..." : "",
+           e->host_hash, e->version, e->port, e->next_state,
+           e->route < 4 ? mc_routes[e->route] : "?",
+           e->outcome < 3 ? mc_outcomes[e->outcome] : "?");
+}
+
+/* returns -1 on errors */
+static int
+mc_drain(int fd, FILE *out)
+{
+    uint32_t           i;
+    mc_event_t         e;
+    mc_event_header_t  h;
+
+    if (mc_read(fd, &h, sizeof(h)) == -1) {
+        fprintf(stderr, "short drain header\n");
+        return -1;
+    }
+
+    if (memcmp(h.magic, MC_EVENTS_MAGIC, 8) != 0
+        || h.record_size != sizeof(mc_event_t))
+    {
+        fprintf(stderr, "not an event log drain, or another record layout\n");
+        return -1;
+    }
+
+    if (h.lost) {
+        fprintf(stderr, "mc_events: %llu records lost\n",
+                (unsigned long long) h.lost);
+    }
+
+    for (i = 0; i < h.count; i++) {
+        if (mc_read(fd, &e, sizeof(e)) == -1) {
+            fprintf(stderr, "short drain, %u of %u records\n", i, h.count);
+            return -1;
+        }
+
+        if (out) {
+            if (fwrite(&e, sizeof(e), 1, out) != 1) {
+                perror("write");
+                return -1;
+            }
+
+            continue;
+        }
+
+        mc_print(&e);
+    }
+
+    fflush(out ? out : stdout);
+
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    int          i, fd, port, interval, rc;
+    FILE        *out;
+    const char  *addr, *path, *file;
+
+    addr = "127.0.0.1";
+    port = 25599;
+    path = NULL;
+    file = NULL;
+    interval = 0;
+
+    while ((i = getopt(argc, argv, "l:p:u:o:i:")) != -1) {
+        switch (i) {
+        case 'l':
+            addr = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            path = optarg;
+            break;
+        case 'o':
+            file = optarg;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-l addr] [-p port] [-u path] [-o file]"
+                    " [-i seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    out = NULL;
+
+    if (file) {
+        out = fopen(file, "ab");
+
+        if (out == NULL) {
+            perror(file);
+            return 1;
+        }
+    }
+
+    for ( ;; ) {
+        fd = mc_connect(addr, port, path);
+
+        if (fd == -1) {
+            return 1;
+        }
+
+        rc = mc_drain(fd, out);
+
+        close(fd);
+
+        if (rc == -1) {
+            return 1;
+        }
+
+        if (interval <= 0) {
+            break;
+        }
+
+        sleep(interval);
+    }
+
+    if (out) {
+        fclose(out);
+    }
+
+    return 0;
+}